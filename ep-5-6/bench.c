@@ -0,0 +1,599 @@
+#define NN_IMPLEMENTATION
+#include "nn.h"
+#include <time.h>
+
+// Benchmark suite. Writes one JSON document (to stdout, or to the file given with -o) so results
+// from different versions can be diffed or tracked over time.
+//   bench [-o out.json] [--quick]
+// --quick cuts every repetition count down, for a smoke run.
+
+typedef struct
+{
+    FILE *f;
+    size_t depth;
+    int first[16];
+} Json;
+
+static void json_key(Json *j, const char *key)
+{
+    if (!j->first[j->depth])
+    {
+        fputc(',', j->f);
+    }
+    j->first[j->depth] = 0;
+    fprintf(j->f, "\n%*s", (int)(2 * j->depth), "");
+    if (key != NULL)
+    {
+        fprintf(j->f, "\"%s\": ", key);
+    }
+}
+
+static void json_open(Json *j, const char *key, char bracket)
+{
+    if (j->depth > 0 || !j->first[0])
+    {
+        json_key(j, key);
+    }
+    fputc(bracket, j->f);
+    j->depth++;
+    assert(j->depth < ARRAY_LEN(j->first));
+    j->first[j->depth] = 1;
+}
+
+static void json_close(Json *j, char bracket)
+{
+    int empty = j->first[j->depth];
+    j->depth--;
+    if (!empty)
+    {
+        fprintf(j->f, "\n%*s", (int)(2 * j->depth), "");
+    }
+    fputc(bracket, j->f);
+}
+
+static void json_num(Json *j, const char *key, double val)
+{
+    json_key(j, key);
+    fprintf(j->f, isfinite(val) ? "%.6g" : "null", val);
+}
+
+static void json_str(Json *j, const char *key, const char *val)
+{
+    json_key(j, key);
+    fprintf(j->f, "\"%s\"", val);
+}
+
+static void json_sizes(Json *j, const char *key, const size_t *vals, size_t count)
+{
+    json_key(j, key);
+    fputc('[', j->f);
+    for (size_t i = 0; i < count; i++)
+    {
+        fprintf(j->f, i > 0 ? ", %zu" : "%zu", vals[i]);
+    }
+    fputc(']', j->f);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Value at fraction q of sorted samples
+static double percentile(const double *sorted, size_t n, double q)
+{
+    size_t i = (size_t)(q * (n - 1) + 0.5);
+    return sorted[i < n ? i : n - 1];
+}
+
+static double min_time = 0.25; // seconds each throughput measurement runs for
+static size_t latency_runs = 2000;
+
+// mat_dot / mat_gemm throughput for one shape. layout: "contiguous", "strided" (every operand
+// is a view into a wider matrix), "trans_a" or "trans_b" (operand stored transposed).
+static void bench_gemm(Json *j, size_t m, size_t n, size_t k, const char *layout)
+{
+    int strided = strcmp(layout, "strided") == 0;
+    int trans_a = strcmp(layout, "trans_a") == 0;
+    int trans_b = strcmp(layout, "trans_b") == 0;
+    size_t pad = strided ? 13 : 0;
+
+    Matrix a = trans_a ? mat_alloc(k, m + pad) : mat_alloc(m, k + pad);
+    Matrix b = trans_b ? mat_alloc(n, k + pad) : mat_alloc(k, n + pad);
+    Matrix c = mat_alloc(m, n + pad);
+    mat_rand(a, -1.0f, 1.0f);
+    mat_rand(b, -1.0f, 1.0f);
+    a.cols -= pad;
+    b.cols -= pad;
+    c.cols -= pad;
+
+    mat_gemm(c, a, trans_a, b, trans_b, 0);
+    size_t reps = 0;
+    double start = now();
+    double elapsed;
+    do
+    {
+        mat_gemm(c, a, trans_a, b, trans_b, 0);
+        reps++;
+        elapsed = now() - start;
+    } while (elapsed < min_time);
+
+    json_open(j, NULL, '{');
+    json_num(j, "m", m);
+    json_num(j, "n", n);
+    json_num(j, "k", k);
+    json_str(j, "layout", layout);
+    json_num(j, "gflops", 2.0 * m * n * k * reps / elapsed * 1e-9);
+    json_close(j, '}');
+
+    mat_free(a);
+    mat_free(b);
+    mat_free(c);
+}
+
+static void bench_forward(Json *j, size_t *archi, size_t num_layers, size_t batch_size)
+{
+    NeuralNetwork nn = nn_alloc_batch(archi, num_layers, batch_size);
+    nn_rand(nn, -1.0f, 1.0f);
+    mat_rand(NN_INPUT(nn), 0.0f, 1.0f);
+
+    double *lat = malloc(latency_runs * sizeof(*lat));
+    assert(lat != NULL);
+    nn_forward(nn);
+    for (size_t i = 0; i < latency_runs; i++)
+    {
+        double start = now();
+        nn_forward(nn);
+        lat[i] = now() - start;
+    }
+    double total = 0.0;
+    for (size_t i = 0; i < latency_runs; i++)
+    {
+        total += lat[i];
+    }
+    qsort(lat, latency_runs, sizeof(*lat), cmp_double);
+
+    json_open(j, NULL, '{');
+    json_sizes(j, "archi", archi, num_layers + 1);
+    json_num(j, "batch_size", batch_size);
+    json_num(j, "mean_us", total / latency_runs * 1e6);
+    json_num(j, "p50_us", percentile(lat, latency_runs, 0.50) * 1e6);
+    json_num(j, "p90_us", percentile(lat, latency_runs, 0.90) * 1e6);
+    json_num(j, "p99_us", percentile(lat, latency_runs, 0.99) * 1e6);
+    json_num(j, "samples_per_sec", batch_size * latency_runs / total);
+    json_close(j, '}');
+
+    free(lat);
+    nn_free(nn);
+}
+
+// Forward latency with the weights stored as dtype, and how far its outputs drift from the
+// float network's on the same random inputs
+static void bench_dtype(Json *j, size_t *archi, size_t num_layers, size_t batch_size, NnDtype dtype, const char *name)
+{
+    NeuralNetwork ref = nn_alloc_batch(archi, num_layers, batch_size);
+    nn_rand(ref, -1.0f, 1.0f);
+    mat_rand(NN_INPUT(ref), 0.0f, 1.0f);
+    NeuralNetwork nn = nn_convert(ref, dtype);
+    mat_cpy(NN_INPUT(nn), NN_INPUT(ref));
+
+    nn_forward(ref);
+    nn_forward(nn);
+    float max_err = 0.0f;
+    for (size_t r = 0; r < batch_size; r++)
+    {
+        for (size_t c = 0; c < NN_OUTPUT(nn).cols; c++)
+        {
+            float err = fabsf(MAT_AT(NN_OUTPUT(nn), r, c) - MAT_AT(NN_OUTPUT(ref), r, c));
+            max_err = err > max_err ? err : max_err;
+        }
+    }
+
+    size_t weight_bytes = 0;
+    for (size_t i = 0; i < num_layers; i++)
+    {
+        weight_bytes += archi[i] * archi[i + 1] * (dtype == NN_DTYPE_F32 ? sizeof(float) : sizeof(uint16_t));
+    }
+
+    double *lat = malloc(latency_runs * sizeof(*lat));
+    assert(lat != NULL);
+    for (size_t i = 0; i < latency_runs; i++)
+    {
+        double start = now();
+        nn_forward(nn);
+        lat[i] = now() - start;
+    }
+    qsort(lat, latency_runs, sizeof(*lat), cmp_double);
+
+    json_open(j, NULL, '{');
+    json_str(j, "dtype", name);
+    json_sizes(j, "archi", archi, num_layers + 1);
+    json_num(j, "batch_size", batch_size);
+    json_num(j, "weight_bytes", weight_bytes);
+    json_num(j, "max_abs_error", max_err);
+    json_num(j, "p50_us", percentile(lat, latency_runs, 0.50) * 1e6);
+    json_num(j, "p99_us", percentile(lat, latency_runs, 0.99) * 1e6);
+    json_close(j, '}');
+
+    free(lat);
+    nn_free(nn);
+    nn_free(ref);
+}
+
+// int8 forward latency and its accuracy against the float network, calibrated on 256 random
+// samples and compared on another 1024
+static void bench_quant(Json *j, size_t *archi, size_t num_layers, size_t batch_size, NnQuantGranularity gran,
+                        const char *name)
+{
+    NeuralNetwork nn = nn_alloc_batch(archi, num_layers, batch_size);
+    nn_rand(nn, -1.0f, 1.0f);
+    Matrix data = mat_alloc(256 + 1024, archi[0]);
+    mat_rand(data, 0.0f, 1.0f);
+
+    NnQuantNetwork q = nn_quantize(nn, mat_rows(data, 0, 256), gran);
+    NnQuantError e = nn_quant_error(nn, q, mat_rows(data, 256, 1024));
+
+    Matrix in = mat_rows(data, 0, batch_size);
+    double *lat = malloc(latency_runs * sizeof(*lat));
+    assert(lat != NULL);
+    for (size_t i = 0; i < latency_runs; i++)
+    {
+        double start = now();
+        nn_quant_forward_batch(q, in);
+        lat[i] = now() - start;
+    }
+    qsort(lat, latency_runs, sizeof(*lat), cmp_double);
+
+    json_open(j, NULL, '{');
+    json_str(j, "granularity", name);
+    json_sizes(j, "archi", archi, num_layers + 1);
+    json_num(j, "batch_size", batch_size);
+    json_num(j, "max_abs_error", e.max_abs_error);
+    json_num(j, "mean_abs_error", e.mean_abs_error);
+    json_num(j, "argmax_agreement", e.argmax_agreement);
+    json_num(j, "p50_us", percentile(lat, latency_runs, 0.50) * 1e6);
+    json_num(j, "p99_us", percentile(lat, latency_runs, 0.99) * 1e6);
+    json_close(j, '}');
+
+    free(lat);
+    nn_quant_free(q);
+    mat_free(data);
+    nn_free(nn);
+}
+
+static double bench_forward_p50(NeuralNetwork nn, double *lat)
+{
+    for (size_t i = 0; i < latency_runs; i++)
+    {
+        double start = now();
+        nn_forward(nn);
+        lat[i] = now() - start;
+    }
+    qsort(lat, latency_runs, sizeof(*lat), cmp_double);
+    return percentile(lat, latency_runs, 0.50);
+}
+
+// Forward latency of a network pruned to the given sparsity, dense against every layer in CSR
+static void bench_sparse(Json *j, size_t *archi, size_t num_layers, size_t batch_size, float sparsity)
+{
+    NeuralNetwork nn = nn_alloc_batch(archi, num_layers, batch_size);
+    nn_rand(nn, -1.0f, 1.0f);
+    nn_prune(nn, sparsity, NN_PRUNE_GLOBAL);
+    mat_rand(NN_INPUT(nn), 0.0f, 1.0f);
+    NeuralNetwork sp = nn_sparsify(nn, 1.0f);
+    mat_cpy(NN_INPUT(sp), NN_INPUT(nn));
+
+    nn_forward(nn);
+    nn_forward(sp);
+    float max_err = 0.0f;
+    for (size_t r = 0; r < batch_size; r++)
+    {
+        for (size_t c = 0; c < NN_OUTPUT(nn).cols; c++)
+        {
+            float err = fabsf(MAT_AT(NN_OUTPUT(sp), r, c) - MAT_AT(NN_OUTPUT(nn), r, c));
+            max_err = err > max_err ? err : max_err;
+        }
+    }
+
+    double *lat = malloc(latency_runs * sizeof(*lat));
+    assert(lat != NULL);
+    double dense = bench_forward_p50(nn, lat);
+    double sparse = bench_forward_p50(sp, lat);
+
+    json_open(j, NULL, '{');
+    json_sizes(j, "archi", archi, num_layers + 1);
+    json_num(j, "batch_size", batch_size);
+    json_num(j, "sparsity", sparsity);
+    json_num(j, "max_abs_error", max_err);
+    json_num(j, "dense_p50_us", dense * 1e6);
+    json_num(j, "sparse_p50_us", sparse * 1e6);
+    json_num(j, "speedup", dense / sparse);
+    json_close(j, '}');
+
+    free(lat);
+    nn_free(sp);
+    nn_free(nn);
+}
+
+// Gradient throughput over a random dataset. method: "backprop", "backprop_mt", "finite_diff"
+// or "finite_diff_mt"; the _mt variants use one thread per CPU.
+static void bench_gradient(Json *j, size_t *archi, size_t num_layers, size_t batch_size, size_t samples,
+                           const char *method)
+{
+    NeuralNetwork nn = nn_alloc_batch(archi, num_layers, batch_size);
+    NeuralNetwork grad = nn_alloc_batch(archi, num_layers, batch_size);
+    Matrix ti = mat_alloc(samples, archi[0]);
+    Matrix to = mat_alloc(samples, archi[num_layers]);
+    nn_rand(nn, -1.0f, 1.0f);
+    mat_rand(ti, 0.0f, 1.0f);
+    mat_rand(to, 0.0f, 1.0f);
+
+    int backprop = strncmp(method, "backprop", 8) == 0;
+    size_t threads = strstr(method, "_mt") != NULL ? nn_num_cpus() : 1;
+    FiniteDiffConfig fd = {.eps = 1e-2f, .num_threads = threads};
+
+    size_t reps = 0;
+    double start = now();
+    double elapsed;
+    do
+    {
+        if (backprop)
+        {
+            nn_backpropagation_mt(nn, grad, ti, to, threads);
+        }
+        else if (threads > 1)
+        {
+            nn_finite_diff_mt(nn, grad, ti, to, fd);
+        }
+        else
+        {
+            nn_finite_diff(nn, grad, fd.eps, ti, to);
+        }
+        reps++;
+        elapsed = now() - start;
+    } while (elapsed < min_time);
+
+    json_open(j, NULL, '{');
+    json_str(j, "method", method);
+    json_sizes(j, "archi", archi, num_layers + 1);
+    json_num(j, "batch_size", batch_size);
+    json_num(j, "samples", samples);
+    json_num(j, "threads", threads);
+    json_num(j, "gradients_per_sec", reps / elapsed);
+    json_num(j, "samples_per_sec", samples * reps / elapsed);
+    json_close(j, '}');
+
+    mat_free(ti);
+    mat_free(to);
+    nn_free(nn);
+    nn_free(grad);
+}
+
+static float xor_set[] = {
+    0, 0, 0,
+    0, 1, 1,
+    1, 0, 1,
+    1, 1, 0,
+};
+
+// Finite-difference gradient descent on the 2-2-1 XOR network, as in ep-4/nn.c (rate 0.5,
+// eps 0.1) and ep-5-6/nn.c (nn_gradient_descent_until, rate 10, eps 0.1), stopping once the
+// loss measured by each step drops below target or max_iters runs out.
+static void bench_xor(Json *j, const char *name, unsigned seed, float rate, float target, size_t max_iters)
+{
+    Matrix ti = {.rows = 4, .cols = 2, .stride = 3, .data = xor_set};
+    Matrix to = {.rows = 4, .cols = 1, .stride = 3, .data = xor_set + 2};
+    size_t archi[] = {2, 2, 1};
+
+    srand(seed);
+    NeuralNetwork nn = nn_alloc(archi, ARRAY_LEN(archi) - 1);
+    nn_rand(nn, 0.0f, 1.0f);
+
+    NnStopConfig stop = {.target_loss = target};
+    NnProgress done = nn_gradient_descent_until(nn, rate, ti, to, max_iters, stop);
+    float mse = nn_mse(nn, ti, to);
+
+    json_open(j, NULL, '{');
+    json_str(j, "setup", name);
+    json_num(j, "target_mse", target);
+    json_num(j, "reached", done.loss <= target);
+    json_num(j, "iterations", done.iteration);
+    json_num(j, "seconds", done.elapsed);
+    json_num(j, "final_mse", mse);
+    json_close(j, '}');
+
+    nn_free(nn);
+}
+
+static void bench_sigf(Json *j, SigfMode mode, const char *name, uint32_t step)
+{
+    enum { N = 1 << 14 };
+    static float src[N];
+    static float buf[N];
+    for (size_t i = 0; i < N; i++)
+    {
+        src[i] = (float)i / N * 32.0f - 16.0f;
+    }
+
+    float err = nn_sigf_max_error(mode, step);
+    nn_sigf_mode(mode);
+    size_t reps = 0;
+    double start = now();
+    double elapsed;
+    do
+    {
+        memcpy(buf, src, sizeof(buf));
+        nn_kernels.sigf(buf, N);
+        reps++;
+        elapsed = now() - start;
+    } while (elapsed < min_time);
+    nn_sigf_mode(NN_SIGF_EXACT);
+
+    json_open(j, NULL, '{');
+    json_str(j, "mode", name);
+    json_num(j, "max_abs_error", err);
+    json_num(j, "ns_per_elem", elapsed / ((double)reps * N) * 1e9);
+    json_close(j, '}');
+}
+
+int main(int argc, char **argv)
+{
+    const char *out_path = NULL;
+    int quick = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            out_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--quick") == 0)
+        {
+            quick = 1;
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [-o out.json] [--quick]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (quick)
+    {
+        min_time = 0.02;
+        latency_runs = 100;
+    }
+
+    Json j = {.f = stdout, .first = {1}};
+    if (out_path != NULL)
+    {
+        j.f = fopen(out_path, "w");
+        if (j.f == NULL)
+        {
+            perror(out_path);
+            return 1;
+        }
+    }
+    srand(0);
+
+    json_open(&j, NULL, '{');
+    json_str(&j, "isa", nn_kernels.name);
+    json_num(&j, "cpus", nn_num_cpus());
+    json_num(&j, "quick", quick);
+
+    json_open(&j, "mat_dot", '[');
+    static const size_t shapes[][3] = { // m, n, k
+        {64, 64, 64},
+        {256, 256, 256},
+        {512, 512, 512},
+        {1, 128, 784},
+        {64, 128, 784},
+        {256, 64, 4096},
+        {1000, 10, 1000},
+        {1, 10, 4096},
+        {64, 1, 1024},
+        {256, 1, 256},
+        {1, 1, 100000},
+    };
+    static const char *layouts[] = {"contiguous", "strided", "trans_a", "trans_b"};
+    for (size_t s = 0; s < ARRAY_LEN(shapes); s++)
+    {
+        for (size_t l = 0; l < ARRAY_LEN(layouts); l++)
+        {
+            bench_gemm(&j, shapes[s][0], shapes[s][1], shapes[s][2], layouts[l]);
+        }
+    }
+    json_close(&j, ']');
+
+    size_t xor_archi[] = {2, 2, 1};
+    size_t mnist_archi[] = {784, 128, 10};
+    size_t deep_archi[] = {784, 256, 256, 10};
+    size_t wide_archi[] = {64, 1024, 1024, 10};
+
+    json_open(&j, "forward", '[');
+    static const size_t batches[] = {1, 64};
+    for (size_t b = 0; b < ARRAY_LEN(batches); b++)
+    {
+        bench_forward(&j, xor_archi, ARRAY_LEN(xor_archi) - 1, batches[b]);
+        bench_forward(&j, mnist_archi, ARRAY_LEN(mnist_archi) - 1, batches[b]);
+        bench_forward(&j, deep_archi, ARRAY_LEN(deep_archi) - 1, batches[b]);
+        bench_forward(&j, wide_archi, ARRAY_LEN(wide_archi) - 1, batches[b]);
+    }
+    json_close(&j, ']');
+
+    json_open(&j, "weight_dtype", '[');
+    static const struct
+    {
+        NnDtype dtype;
+        const char *name;
+    } dtypes[] = {{NN_DTYPE_F32, "f32"}, {NN_DTYPE_F16, "f16"}, {NN_DTYPE_BF16, "bf16"}};
+    for (size_t b = 0; b < ARRAY_LEN(batches); b++)
+    {
+        for (size_t d = 0; d < ARRAY_LEN(dtypes); d++)
+        {
+            bench_dtype(&j, wide_archi, ARRAY_LEN(wide_archi) - 1, batches[b], dtypes[d].dtype, dtypes[d].name);
+        }
+    }
+    json_close(&j, ']');
+
+    json_open(&j, "int8", '[');
+    for (size_t b = 0; b < ARRAY_LEN(batches); b++)
+    {
+        bench_quant(&j, mnist_archi, ARRAY_LEN(mnist_archi) - 1, batches[b], NN_QUANT_PER_LAYER, "per_layer");
+        bench_quant(&j, mnist_archi, ARRAY_LEN(mnist_archi) - 1, batches[b], NN_QUANT_PER_CHANNEL, "per_channel");
+        bench_quant(&j, wide_archi, ARRAY_LEN(wide_archi) - 1, batches[b], NN_QUANT_PER_CHANNEL, "per_channel");
+    }
+    json_close(&j, ']');
+
+    json_open(&j, "sparse", '[');
+    static const float sparsities[] = {0.5f, 0.8f, 0.9f, 0.95f, 0.98f};
+    for (size_t b = 0; b < ARRAY_LEN(batches); b++)
+    {
+        for (size_t s = 0; s < ARRAY_LEN(sparsities); s++)
+        {
+            bench_sparse(&j, wide_archi, ARRAY_LEN(wide_archi) - 1, batches[b], sparsities[s]);
+        }
+    }
+    json_close(&j, ']');
+
+    json_open(&j, "gradient", '[');
+    bench_gradient(&j, mnist_archi, ARRAY_LEN(mnist_archi) - 1, 64, 1024, "backprop");
+    bench_gradient(&j, mnist_archi, ARRAY_LEN(mnist_archi) - 1, 64, 1024, "backprop_mt");
+    size_t small_archi[] = {16, 16, 4};
+    bench_gradient(&j, small_archi, ARRAY_LEN(small_archi) - 1, 64, 64, "backprop");
+    bench_gradient(&j, small_archi, ARRAY_LEN(small_archi) - 1, 64, 64, "finite_diff");
+    bench_gradient(&j, small_archi, ARRAY_LEN(small_archi) - 1, 64, 64, "finite_diff_mt");
+    json_close(&j, ']');
+
+    json_open(&j, "xor_time_to_target", '[');
+    size_t max_iters = quick ? 100 * 1000 : 1000 * 1000;
+    bench_xor(&j, "ep-4", 69, 0.5f, 1e-2f, max_iters);
+    bench_xor(&j, "ep-5-6", 69, 10.0f, 1e-3f, max_iters);
+    json_close(&j, ']');
+
+    json_open(&j, "sigmoid", '[');
+    uint32_t step = quick ? 1000003 : 65537;
+    bench_sigf(&j, NN_SIGF_EXACT, "exact", step);
+    bench_sigf(&j, NN_SIGF_FAST, "fast", step);
+    bench_sigf(&j, NN_SIGF_FASTEST, "fastest", step);
+    bench_sigf(&j, NN_SIGF_TABLE, "table", step);
+    json_close(&j, ']');
+
+    json_close(&j, '}');
+    fputc('\n', j.f);
+
+    if (j.f != stdout && fclose(j.f) != 0)
+    {
+        perror(out_path);
+        return 1;
+    }
+
+    return 0;
+}
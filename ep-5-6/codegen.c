@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+// Emits a header with a fully unrolled forward and backward pass for one fixed architecture:
+// every shape is a constant, every loop is gone and the activations are locals, which is what
+// tiny networks like {2, 2, 1} need to stop paying for strides, asserts and loop overhead.
+//   codegen -a 2,2,1 [-A sigmoid,relu,...] [-p prefix] > xor_gen.h
+// -A gives each layer's activation (default all sigmoid), -p the prefix of every generated name
+// (default "gen"). The header goes after nn.h and provides, for prefix p:
+//   p_params                         the parameters, laid out like a NeuralNetwork's arena
+//   p_load(&params, nn) / p_store    copy to / from a NeuralNetwork of the same shape
+//   p_forward(&params, in, out)
+//   p_backward(&params, &grad, in, target)   adds one sample's squared error gradient to grad,
+//                                            returns its squared error
+// The output grows with the number of weights, so keep it to networks of a few hundred.
+
+#define MAX_LAYERS 16
+
+static const char *act_names[] = {"sigmoid", "relu", "tanh", "identity"}; // Activation order
+static const char *act_enums[] = {"NN_ACT_SIGMOID", "NN_ACT_RELU", "NN_ACT_TANH", "NN_ACT_IDENTITY"};
+
+static size_t archi[MAX_LAYERS + 1];
+static size_t act[MAX_LAYERS];
+static size_t num_layers;
+static const char *prefix = "gen";
+
+// Name of input i of layer l: the network input, or the previous layer's output
+static void emit_input(size_t l, size_t i)
+{
+    if (l == 0)
+    {
+        printf("in[%zu]", i);
+    }
+    else
+    {
+        printf("a%zu_%zu", l, i);
+    }
+}
+
+// b[j] + sum_i x_i * w[i][j]
+static void emit_sum(size_t l, size_t j)
+{
+    printf("p->b%zu[%zu]", l, j);
+    for (size_t i = 0; i < archi[l]; i++)
+    {
+        printf(" + ");
+        emit_input(l, i);
+        printf(" * p->w%zu[%zu][%zu]", l, i, j);
+    }
+}
+
+// Computes every layer into locals a<l+1>_<j>; the last layer is kept too when keep_output is set,
+// otherwise written to out[]
+static void emit_layers(const char *indent, int keep_output)
+{
+    for (size_t l = 0; l < num_layers; l++)
+    {
+        for (size_t j = 0; j < archi[l + 1]; j++)
+        {
+            if (l + 1 == num_layers && !keep_output)
+            {
+                printf("%sout[%zu] = %s_%s(", indent, j, prefix, act_names[act[l]]);
+            }
+            else
+            {
+                printf("%sconst float a%zu_%zu = %s_%s(", indent, l + 1, j, prefix, act_names[act[l]]);
+            }
+            emit_sum(l, j);
+            printf(");\n");
+        }
+    }
+}
+
+// Derivative of layer l's activation, written in terms of its output a
+static void emit_dact(size_t l, const char *a)
+{
+    switch (act[l])
+    {
+    case 0:
+        printf("%s * (1.0f - %s)", a, a);
+        break;
+    case 1:
+        printf("(%s > 0.0f ? 1.0f : 0.0f)", a);
+        break;
+    case 2:
+        printf("(1.0f - %s * %s)", a, a);
+        break;
+    default:
+        printf("1.0f");
+        break;
+    }
+}
+
+static void emit_header(int argc, char **argv)
+{
+    char guard[64];
+    size_t n = 0;
+    for (const char *c = prefix; *c != '\0' && n + 7 < sizeof(guard); c++)
+    {
+        guard[n++] = (char)toupper((unsigned char)*c);
+    }
+    strcpy(guard + n, "_GEN_H");
+
+    size_t num_params = 0;
+    for (size_t l = 0; l < num_layers; l++)
+    {
+        num_params += archi[l] * archi[l + 1] + archi[l + 1];
+    }
+
+    printf("// Generated by:");
+    for (int i = 0; i < argc; i++)
+    {
+        printf(" %s", argv[i]);
+    }
+    printf("\n// Do not edit. Include after nn.h.\n");
+    printf("#ifndef %s\n#define %s\n\n", guard, guard);
+    printf("#define %.*s_INPUTS %zu\n", (int)n, guard, archi[0]);
+    printf("#define %.*s_OUTPUTS %zu\n\n", (int)n, guard, archi[num_layers]);
+
+    printf("// Same order as the NeuralNetwork parameter arena, so loading is one copy\n");
+    printf("typedef struct\n{\n");
+    for (size_t l = 0; l < num_layers; l++)
+    {
+        printf("    float w%zu[%zu][%zu];\n", l, archi[l], archi[l + 1]);
+        printf("    float b%zu[%zu];\n", l, archi[l + 1]);
+    }
+    printf("} %s_params;\n\n", prefix);
+    printf("_Static_assert(sizeof(%s_params) == %zu * sizeof(float), \"%s_params must not be padded\");\n\n",
+           prefix, num_params, prefix);
+
+    printf("static inline float %s_sigmoid(float x)\n{\n    return 1.0f / (1.0f + expf(-x));\n}\n\n", prefix);
+    printf("static inline float %s_relu(float x)\n{\n    return x > 0.0f ? x : 0.0f;\n}\n\n", prefix);
+    printf("static inline float %s_tanh(float x)\n{\n    return tanhf(x);\n}\n\n", prefix);
+    printf("static inline float %s_identity(float x)\n{\n    return x;\n}\n\n", prefix);
+
+    // Shape and activation check shared by load and store
+    printf("static inline int %s_matches(NeuralNetwork nn)\n{\n", prefix);
+    printf("    static const size_t archi[] = {");
+    for (size_t l = 0; l <= num_layers; l++)
+    {
+        printf(l == 0 ? "%zu" : ", %zu", archi[l]);
+    }
+    printf("};\n    static const Activation act[] = {");
+    for (size_t l = 0; l < num_layers; l++)
+    {
+        printf(l == 0 ? "%s" : ", %s", act_enums[act[l]]);
+    }
+    printf("};\n\n");
+    printf("    return nn.num_layers == %zu && nn.dtype == NN_DTYPE_F32 &&\n", num_layers);
+    printf("           memcmp(nn.archi, archi, sizeof(archi)) == 0 && memcmp(nn.act, act, sizeof(act)) == 0;\n}\n\n");
+
+    printf("// Returns 0, or -1 when nn has another shape or other activations\n");
+    printf("static inline int %s_load(%s_params *p, NeuralNetwork nn)\n{\n", prefix, prefix);
+    printf("    if (!%s_matches(nn))\n    {\n        return -1;\n    }\n", prefix);
+    printf("    memcpy(p, nn.params, sizeof(*p));\n    return 0;\n}\n\n");
+
+    printf("static inline int %s_store(const %s_params *p, NeuralNetwork nn)\n{\n", prefix, prefix);
+    printf("    if (!%s_matches(nn))\n    {\n        return -1;\n    }\n", prefix);
+    printf("    memcpy(nn.params, p, sizeof(*p));\n    return 0;\n}\n\n");
+
+    printf("static inline void %s_forward(const %s_params *p, const float *in, float *out)\n{\n", prefix, prefix);
+    emit_layers("    ", 0);
+    printf("}\n\n");
+
+    printf("// Adds the gradient of sum((out - target)^2) for one sample to g; nn_backpropagation's\n");
+    printf("// result is the mean of these over its rows. Returns the squared error.\n");
+    printf("static inline float %s_backward(const %s_params *p, %s_params *g, const float *in, const float *target)\n{\n",
+           prefix, prefix, prefix);
+    emit_layers("    ", 1);
+    printf("    float loss = 0.0f;\n");
+
+    // Output deltas, then walk back: biases, weights, and the next layer's deltas
+    size_t L = num_layers;
+    for (size_t j = 0; j < archi[L]; j++)
+    {
+        char a[48];
+        snprintf(a, sizeof(a), "a%zu_%zu", L, j);
+        printf("    const float e%zu = %s - target[%zu];\n", j, a, j);
+        printf("    loss += e%zu * e%zu;\n", j, j);
+        printf("    const float d%zu_%zu = 2.0f * e%zu * ", L, j, j);
+        emit_dact(L - 1, a);
+        printf(";\n");
+    }
+    for (size_t l = L; l-- > 0;)
+    {
+        for (size_t j = 0; j < archi[l + 1]; j++)
+        {
+            printf("    g->b%zu[%zu] += d%zu_%zu;\n", l, j, l + 1, j);
+            for (size_t i = 0; i < archi[l]; i++)
+            {
+                printf("    g->w%zu[%zu][%zu] += ", l, i, j);
+                emit_input(l, i);
+                printf(" * d%zu_%zu;\n", l + 1, j);
+            }
+        }
+        if (l == 0)
+        {
+            break;
+        }
+        for (size_t i = 0; i < archi[l]; i++)
+        {
+            char a[48];
+            snprintf(a, sizeof(a), "a%zu_%zu", l, i);
+            printf("    const float d%zu_%zu = (", l, i);
+            for (size_t j = 0; j < archi[l + 1]; j++)
+            {
+                printf(j == 0 ? "p->w%zu[%zu][%zu] * d%zu_%zu" : " + p->w%zu[%zu][%zu] * d%zu_%zu", l, i, j, l + 1, j);
+            }
+            printf(") * ");
+            emit_dact(l - 1, a);
+            printf(";\n");
+        }
+    }
+    printf("    return loss;\n}\n\n");
+    printf("#endif // %s\n", guard);
+}
+
+// Fills out[] from a comma separated list, returns the count or 0 on a malformed one
+static size_t parse_list(const char *s, size_t *out, size_t cap, int names)
+{
+    size_t n = 0;
+    while (*s != '\0')
+    {
+        if (n == cap)
+        {
+            return 0;
+        }
+        size_t len = strcspn(s, ",");
+        if (names)
+        {
+            size_t k = 0;
+            while (k < 4 && (strlen(act_names[k]) != len || strncmp(s, act_names[k], len) != 0))
+            {
+                k++;
+            }
+            if (k == 4)
+            {
+                return 0;
+            }
+            out[n++] = k;
+        }
+        else
+        {
+            char *end;
+            unsigned long v = strtoul(s, &end, 10);
+            if (end != s + len || v == 0)
+            {
+                return 0;
+            }
+            out[n++] = v;
+        }
+        s += len + (s[len] == ',');
+    }
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    const char *archi_arg = NULL;
+    const char *act_arg = NULL;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "-a") == 0)
+        {
+            archi_arg = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-A") == 0)
+        {
+            act_arg = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-p") == 0)
+        {
+            prefix = argv[i + 1];
+        }
+        else
+        {
+            archi_arg = NULL;
+            break;
+        }
+    }
+
+    size_t n = archi_arg != NULL ? parse_list(archi_arg, archi, MAX_LAYERS + 1, 0) : 0;
+    num_layers = n > 0 ? n - 1 : 0;
+    int bad = argc % 2 == 0 || num_layers == 0 || strspn(prefix, "abcdefghijklmnopqrstuvwxyz0123456789_") != strlen(prefix);
+    if (!bad && act_arg != NULL)
+    {
+        bad = parse_list(act_arg, act, MAX_LAYERS, 1) != num_layers;
+    }
+    if (bad)
+    {
+        fprintf(stderr, "usage: %s -a 2,2,1 [-A sigmoid,relu,tanh,identity,...] [-p prefix]\n", argv[0]);
+        return 1;
+    }
+
+    emit_header(argc, argv);
+    return 0;
+}
@@ -0,0 +1,95 @@
+#define NN_IMPLEMENTATION
+#include "nn.h"
+#include "xor_gen.h"
+
+// XOR through the code generated by `codegen -a 2,2,1 -p xor`: trains with the unrolled backward
+// pass, copies the result into a NeuralNetwork, and checks and times the unrolled forward pass
+// against nn_forward.
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(void)
+{
+    srand(69);
+    size_t archi[] = {2, 2, 1};
+    NeuralNetwork nn = nn_alloc(archi, ARRAY_LEN(archi) - 1);
+    nn_rand(nn, 0.0f, 1.0f);
+
+    static const float train[4][3] = {
+        {0, 0, 0},
+        {0, 1, 1},
+        {1, 0, 1},
+        {1, 1, 0},
+    };
+
+    xor_params p;
+    if (xor_load(&p, nn) != 0)
+    {
+        fprintf(stderr, "network does not match the generated code\n");
+        return 1;
+    }
+
+    float rate = 10.0f;
+    float loss = 0.0f;
+    for (size_t it = 0; it < 1000 * 1000; it++)
+    {
+        xor_params g = {0};
+        loss = 0.0f;
+        for (size_t i = 0; i < 4; i++)
+        {
+            loss += xor_backward(&p, &g, train[i], &train[i][2]);
+        }
+        float *w = (float *)&p;
+        const float *dw = (const float *)&g;
+        for (size_t i = 0; i < sizeof(p) / sizeof(float); i++)
+        {
+            w[i] -= rate / 4 * dw[i];
+        }
+    }
+    printf("MSE AFTER: %f\n", loss / 4);
+    xor_store(&p, nn);
+
+    float max_diff = 0.0f;
+    for (size_t i = 0; i < 4; i++)
+    {
+        float out;
+        xor_forward(&p, train[i], &out);
+        MAT_AT(NN_INPUT(nn), 0, 0) = train[i][0];
+        MAT_AT(NN_INPUT(nn), 0, 1) = train[i][1];
+        nn_forward(nn);
+        float diff = fabsf(out - MAT_AT(NN_OUTPUT(nn), 0, 0));
+        max_diff = diff > max_diff ? diff : max_diff;
+        printf("%.0f ^ %.0f = %f\n", train[i][0], train[i][1], out);
+    }
+    printf("max difference from nn_forward: %g\n", max_diff);
+
+    size_t reps = 1000 * 1000;
+    volatile float sink = 0.0f;
+    double start = now();
+    for (size_t r = 0; r < reps; r++)
+    {
+        float out;
+        xor_forward(&p, train[r & 3], &out);
+        sink = out;
+    }
+    double generated = (now() - start) / reps;
+    start = now();
+    for (size_t r = 0; r < reps; r++)
+    {
+        MAT_AT(NN_INPUT(nn), 0, 0) = train[r & 3][0];
+        MAT_AT(NN_INPUT(nn), 0, 1) = train[r & 3][1];
+        nn_forward(nn);
+        sink = MAT_AT(NN_OUTPUT(nn), 0, 0);
+    }
+    double generic = (now() - start) / reps;
+    (void)sink;
+    printf("forward: generated %.1f ns, nn_forward %.1f ns\n", generated * 1e9, generic * 1e9);
+
+    nn_free(nn);
+    return 0;
+}
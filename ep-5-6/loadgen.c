@@ -0,0 +1,215 @@
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Load generator for server.c. Opens -c connections, each keeping -d requests in flight until it
+// has had -n answered, then prints client-side latency percentiles and throughput.
+//   loadgen [-s socket] [-c connections] [-d depth] [-n requests]
+
+typedef struct
+{
+    const char *path;
+    size_t depth;
+    size_t requests;
+    double *lat; // requests entries
+    int failed;
+} Client;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, size_t n, double q)
+{
+    size_t i = (size_t)(q * (n - 1) + 0.5);
+    return sorted[i < n ? i : n - 1];
+}
+
+static int read_all(int fd, void *buf, size_t n)
+{
+    char *p = buf;
+    while (n > 0)
+    {
+        ssize_t got = read(fd, p, n);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            return -1;
+        }
+        p += got;
+        n -= (size_t)got;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t n)
+{
+    const char *p = buf;
+    while (n > 0)
+    {
+        ssize_t put = write(fd, p, n);
+        if (put < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (put <= 0)
+        {
+            return -1;
+        }
+        p += put;
+        n -= (size_t)put;
+    }
+    return 0;
+}
+
+static void *run_client(void *arg)
+{
+    Client *cl = arg;
+    cl->failed = 1;
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, cl->path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    uint32_t hello[2];
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || read_all(fd, hello, sizeof(hello)) != 0)
+    {
+        perror(cl->path);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    size_t in_bytes = hello[0] * sizeof(float);
+    size_t out_bytes = hello[1] * sizeof(float);
+    float *in = malloc(in_bytes);
+    float *out = malloc(out_bytes);
+    double *sent = malloc(cl->depth * sizeof(*sent)); // send times of the requests in flight, FIFO
+    assert(in != NULL && out != NULL && sent != NULL);
+    unsigned seed = (unsigned)(uintptr_t)cl;
+    for (size_t i = 0; i < hello[0]; i++)
+    {
+        in[i] = (float)rand_r(&seed) / (float)RAND_MAX;
+    }
+
+    size_t issued = 0;
+    size_t done = 0;
+    int ok = 1;
+    while (ok && done < cl->requests)
+    {
+        while (ok && issued < cl->requests && issued - done < cl->depth)
+        {
+            sent[issued % cl->depth] = now();
+            ok = write_all(fd, in, in_bytes) == 0;
+            issued++;
+        }
+        ok = ok && read_all(fd, out, out_bytes) == 0;
+        if (ok)
+        {
+            cl->lat[done] = now() - sent[done % cl->depth];
+            done++;
+        }
+    }
+    cl->failed = !ok;
+
+    free(sent);
+    free(out);
+    free(in);
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = "/tmp/nn.sock";
+    size_t connections = 8;
+    size_t depth = 1;
+    size_t requests = 10000;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "-s") == 0)
+        {
+            path = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-c") == 0)
+        {
+            connections = strtoul(argv[i + 1], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-d") == 0)
+        {
+            depth = strtoul(argv[i + 1], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-n") == 0)
+        {
+            requests = strtoul(argv[i + 1], NULL, 10);
+        }
+        else
+        {
+            argc = 0;
+        }
+    }
+    if (argc % 2 == 0 || connections == 0 || depth == 0 || requests == 0)
+    {
+        fprintf(stderr, "usage: %s [-s socket] [-c connections] [-d depth] [-n requests]\n", argv[0]);
+        return 1;
+    }
+
+    Client *clients = calloc(connections, sizeof(*clients));
+    pthread_t *threads = malloc(connections * sizeof(*threads));
+    double *lat = malloc(connections * requests * sizeof(*lat));
+    assert(clients != NULL && threads != NULL && lat != NULL);
+
+    double start = now();
+    for (size_t c = 0; c < connections; c++)
+    {
+        clients[c] = (Client){.path = path, .depth = depth, .requests = requests, .lat = lat + c * requests};
+        pthread_create(&threads[c], NULL, run_client, &clients[c]);
+    }
+    int failed = 0;
+    for (size_t c = 0; c < connections; c++)
+    {
+        pthread_join(threads[c], NULL);
+        failed |= clients[c].failed;
+    }
+    double elapsed = now() - start;
+    if (failed)
+    {
+        fprintf(stderr, "some connections failed\n");
+        return 1;
+    }
+
+    size_t n = connections * requests;
+    qsort(lat, n, sizeof(*lat), cmp_double);
+    printf("%zu requests over %zu connections x depth %zu in %.2fs: %.0f req/s\n",
+           n, connections, depth, elapsed, n / elapsed);
+    printf("latency p50 %.0fus p90 %.0fus p99 %.0fus max %.0fus\n",
+           percentile(lat, n, 0.50) * 1e6, percentile(lat, n, 0.90) * 1e6,
+           percentile(lat, n, 0.99) * 1e6, lat[n - 1] * 1e6);
+
+    free(lat);
+    free(threads);
+    free(clients);
+    return 0;
+}
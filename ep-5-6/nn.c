@@ -2,6 +2,13 @@
 #include "nn.h"
 #include "time.h"
 
+static int print_progress(void *ctx, const NnProgress *p)
+{
+    (void)ctx;
+    printf("%6zu: %f\n", p->iteration, p->loss);
+    return 0;
+}
+
 int main(void)
 {
     srand(69);
@@ -32,7 +39,13 @@ int main(void)
 
     printf("MSE BEFORE: %f\n", nn_mse(nn, train_in, train_out));
 
-    nn_gradient_descent(nn, 10, train_in, train_out, 1000*1000);
+    NnStopConfig stop = {
+        .target_loss = 1e-4f,
+        .progress_every = 1000,
+        .progress = print_progress,
+    };
+    NnProgress done = nn_gradient_descent_until(nn, 10, train_in, train_out, 1000*1000, stop);
+    printf("stopped after %zu iterations, %.3fs\n", done.iteration, done.elapsed);
 
     printf("MSE  AFTER: %f\n", nn_mse(nn, train_in, train_out));
 
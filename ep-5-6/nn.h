@@ -6,30 +6,222 @@
 #include <assert.h>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// Element type of a Matrix. The half types are weight storage for inference: they can be the b
+// operand of mat_dot, mat_gemm and mat_dot_bias_act, which widen them to float while packing and
+// accumulate in float, and go through mat_convert, mat_print and the row views. Everything else
+// takes F32.
+typedef enum
+{
+    NN_DTYPE_F32,
+    NN_DTYPE_F16,  // IEEE binary16
+    NN_DTYPE_BF16, // the top half of a float
+} NnDtype;
 
 typedef struct
 {
     size_t rows;
     size_t cols;
     size_t stride;
-    float *data;
+    union
+    {
+        float *data;
+        uint16_t *data16; // F16, BF16
+    };
+    NnDtype dtype;
 } Matrix;
 
 #define MAT_AT(m, i, j) (m).data[(i) * (m).stride + (j)]
 
+// GEMM blocking: MR x NR register tile, MC x KC panel of a (L2), KC x NR sliver of b (L1).
+// MR/NR are the scalar kernel's tile, the SIMD kernels bring their own.
+#ifndef NN_GEMM_MR
+#define NN_GEMM_MR 4
+#endif
+#ifndef NN_GEMM_NR
+#define NN_GEMM_NR 8
+#endif
+#ifndef NN_GEMM_MC
+#define NN_GEMM_MC 64
+#endif
+#ifndef NN_GEMM_KC
+#define NN_GEMM_KC 256
+#endif
+#ifndef NN_GEMM_NC
+#define NN_GEMM_NC 512
+#endif
+// Below this many multiply-adds packing does not pay off
+#ifndef NN_GEMM_SMALL
+#define NN_GEMM_SMALL (32 * 32 * 32)
+#endif
+// Below this many multiply-adds a product, and below this many elements an elementwise pass,
+// stays on the calling thread instead of going to the thread pool
+#ifndef NN_POOL_GEMM_MIN
+#define NN_POOL_GEMM_MIN (1 << 20)
+#endif
+#ifndef NN_POOL_GRAIN
+#define NN_POOL_GRAIN (1 << 15)
+#endif
+// Alignment of the network's parameter and activation blocks
+#ifndef NN_ALIGN
+#define NN_ALIGN 64
+#endif
+// Largest MR * NR and NR of any kernel
+#define NN_GEMM_MAX_TILE (8 * 32)
+#define NN_GEMM_MAX_NR 32
+// Column padding of the int8 weight layout, a multiple of every int8 kernel's column step
+#define NN_QGEMM_NR 16
+
+typedef enum
+{
+    NN_ISA_SCALAR,
+    NN_ISA_SSE2,
+    NN_ISA_AVX2,
+    NN_ISA_AVX512,
+} NnIsa;
+
+// Sigmoid accuracy modes. Max absolute error against sigf() over all finite floats:
+//   EXACT   Cephes exp, within a few ulp of libm (~1e-7)
+//   FAST    degree-3 2^f polynomial (~4e-5)
+//   FASTEST degree-2 2^f polynomial and an approximate reciprocal (~8e-4)
+//   TABLE   linear interpolation over 1024 steps on [-16, 16] (~1.2e-5)
+typedef enum
+{
+    NN_SIGF_EXACT,
+    NN_SIGF_FAST,
+    NN_SIGF_FASTEST,
+    NN_SIGF_TABLE,
+} SigfMode;
+
+// Per-layer activation. SIGMOID is 0 so zeroed layer settings keep the original behaviour.
+typedef enum
+{
+    NN_ACT_SIGMOID,
+    NN_ACT_RELU,
+    NN_ACT_TANH,
+    NN_ACT_IDENTITY, // plain linear output layers
+    NN_ACT_COUNT,
+} Activation;
+
+typedef enum
+{
+    NN_OPT_SGD,
+    NN_OPT_MOMENTUM,
+    NN_OPT_NESTEROV,
+    NN_OPT_RMSPROP,
+    NN_OPT_ADAM,
+} OptimizerKind;
+
+// Per-step constants handed to the fused update kernel
+typedef struct
+{
+    OptimizerKind kind;
+    float rate;     // Adam: already scaled by its bias correction
+    float scale;    // applied to the raw gradient first, e.g. 1 / num_samples
+    float momentum;
+    float beta1;
+    float beta2;
+    float eps;
+} OptimizerStep;
+
+// Kernel table, filled once at startup from CPUID. Lengths are element counts over contiguous memory.
+typedef struct
+{
+    NnIsa isa;
+    const char *name;
+    size_t mr;
+    size_t nr;
+    // c (mr x nr, row stride ldc) [+]= packed a panel * packed b panel [+ bias, nr values added to every row]
+    void (*gemm_kernel)(size_t kc, const float *pa, const float *pb, float *c, size_t ldc, int accumulate,
+                        const float *bias);
+    void (*add)(float *dst, const float *src, size_t n);
+    void (*fill)(float *dst, float val, size_t n);
+    void (*axpy)(float *dst, float alpha, const float *src, size_t n);
+    float (*dot)(const float *a, const float *b, size_t n);
+    void (*sigf)(float *x, size_t n);
+    SigfMode sigf_mode;
+    void (*relu)(float *x, size_t n);
+    void (*tanh)(float *x, size_t n);
+    // d *= a * (1 - a), the sigmoid derivative expressed through its output a
+    void (*dsigf)(float *d, const float *a, size_t n);
+    // dst = src widened to float
+    void (*cvt_f16)(float *dst, const uint16_t *src, size_t n);
+    void (*cvt_bf16)(float *dst, const uint16_t *src, size_t n);
+    // c (m x n int32) = a (m x 4 * k4, values 0..127) * b (4 * k4 x n int8, stored k4 x n x 4),
+    // n a multiple of NN_QGEMM_NR
+    void (*qgemm)(size_t m, size_t n, size_t k4, const uint8_t *a, const int8_t *b, int32_t *c);
+    // c (m x n, row stride ldc) = a * b (k x n, row stride ldb), a an m x k CSR matrix: row i's
+    // nonzeros are val[row_ptr[i] .. row_ptr[i + 1]) in columns col[...]
+    void (*spmm)(size_t m, size_t n, const uint32_t *row_ptr, const uint32_t *col, const float *val,
+                 const float *b, size_t ldb, float *c, size_t ldc);
+    // One pass of g = scale * g_raw and the optimizer update of w (and its state m, v)
+    void (*optimize)(float *w, const float *g, float *m, float *v, size_t n, const OptimizerStep *step);
+} NnKernels;
+
+extern NnKernels nn_kernels;
+
+NnIsa nn_cpu_isa(void);
+void nn_kernels_select(NnIsa isa);
+void nn_sigf_mode(SigfMode mode);
+float nn_sigf_max_error(SigfMode mode, uint32_t step);
+
 float rand_float(void);
 float sigf(float x);
+float nn_half_to_float(uint16_t h, NnDtype dtype);
+uint16_t nn_float_to_half(float x, NnDtype dtype);
 
 Matrix mat_alloc(size_t rows, size_t cols);
+Matrix mat_alloc_dtype(size_t rows, size_t cols, NnDtype dtype);
+void mat_convert(Matrix dst, Matrix src);
+void mat_free(Matrix m);
 void mat_print(Matrix m, char *name);
 void mat_rand(Matrix m, float min, float max);
 void mat_fill(Matrix m, float val);
 void mat_cpy(Matrix dst, Matrix src);
 Matrix mat_row(Matrix m, size_t row);
+Matrix mat_rows(Matrix m, size_t row, size_t count);
 
 void mat_dot(Matrix dst, Matrix a, Matrix b);
+void mat_dot_naive(Matrix dst, Matrix a, Matrix b);
+void mat_gemm(Matrix dst, Matrix a, int trans_a, Matrix b, int trans_b, int accumulate);
+void mat_dot_bias_act(Matrix dst, Matrix a, Matrix b, Matrix bias, Activation act);
 void mat_sum(Matrix dst, Matrix a);
+void mat_sum_cols(Matrix dst, Matrix a);
+void mat_axpy(Matrix dst, float alpha, Matrix src);
 void mat_sigf(Matrix a);
+void mat_dsigf(Matrix d, Matrix a);
+void mat_activate(Matrix a, Activation act);
+void mat_activate_grad(Matrix d, Matrix a, Activation act);
+
+// A layer's weights in CSR, transposed so each row lists the inputs one output reads:
+// row j holds val[row_ptr[j] .. row_ptr[j + 1]) at input indices col[...]
+typedef struct
+{
+    size_t rows; // the layer's outputs
+    size_t cols; // the layer's inputs
+    size_t nnz;
+    uint32_t *row_ptr; // rows + 1, NULL for a layer left dense
+    uint32_t *col;
+    float *val;
+} NnSparseMatrix;
+
+void mat_dot_sparse_bias_act(Matrix dst, Matrix a, const NnSparseMatrix *w, Matrix bias, Activation act);
+
+// Magnitude pruning: the smallest weights over the whole network, or the same fraction of each layer
+typedef enum
+{
+    NN_PRUNE_GLOBAL,
+    NN_PRUNE_PER_LAYER,
+} NnPruneScope;
 
 typedef struct
 {
@@ -37,28 +229,396 @@ typedef struct
     size_t num_layers;
     Matrix *weights;
     Matrix *biases;
-    Matrix *activations; // num_layers + 1 (input)
+    Matrix *activations; // num_layers + 1 (input); the network's own scratch, see NnWorkspace for sharing
+    Activation *act;     // num_layers, the function each layer applies (NN_ACT_SIGMOID by default)
+    float *params;       // weights[0], biases[0], weights[1], ... back to back; the matrices above are views
+    size_t num_params;
+    void *mapping;       // set when params point into an nn_load_mmap file mapping
+    size_t mapping_size;
+    NnDtype dtype;       // weight storage; anything but F32 comes from nn_convert and is inference only
+    NnSparseMatrix *sparse; // num_layers, set by nn_sparsify (inference only), NULL for all dense
 } NeuralNetwork;
 
+// Per-caller scratch for nn_infer: the hidden layer outputs for up to batch_size rows. nn_infer
+// only reads the network, so any number of threads can run one model, each with its own workspace.
+typedef struct
+{
+    Matrix *hidden; // num_layers - 1, NULL for a single layer
+    size_t batch_size;
+} NnWorkspace;
+
 #define ARRAY_LEN(arr) (sizeof((arr)) / sizeof((arr)[0]))
 #define NN_INPUT(nn) ((nn).activations[0])
 #define NN_OUTPUT(nn) ((nn).activations[(nn).num_layers])
 
+typedef struct
+{
+    float eps;
+    int central;        // (f(p + eps) - f(p - eps)) / 2eps instead of (f(p + eps) - f(p)) / eps
+    size_t subset;      // evaluate only this many randomly chosen parameters (the rest get 0), 0 = all
+    size_t num_threads; // parts run on the thread pool, 0 = one per pool thread
+} FiniteDiffConfig;
+
+typedef struct
+{
+    OptimizerKind kind;
+    float rate;
+    float momentum; // MOMENTUM, NESTEROV
+    float beta1;    // ADAM
+    float beta2;    // RMSPROP, ADAM
+    float eps;      // RMSPROP, ADAM
+    size_t step;
+    NeuralNetwork m; // velocity / first moment, laid out like the parameters
+    NeuralNetwork v; // second moment
+} Optimizer;
+
+typedef struct NnCheckpointer NnCheckpointer;
+
+// Where a training loop stands after an iteration (an epoch of nn_train, a step of
+// nn_gradient_descent_until); loss is the MSE measured by that iteration's own forward passes
+typedef struct
+{
+    size_t iteration; // counted from 1
+    float loss;
+    float best_loss;  // lowest loss that counted as an improvement
+    double elapsed;   // seconds since training started
+} NnProgress;
+
+// Stopping criteria, checked after every iteration; zeroed fields are off. Training stops once
+// the loss reaches target_loss, after patience iterations in a row that did not beat best_loss by
+// the fraction min_improvement (in [0, 1)), or once max_seconds have passed. The first iteration
+// always sets best_loss. progress is called every progress_every iterations and on the last one;
+// a nonzero return stops training too.
+typedef struct
+{
+    float target_loss;
+    size_t patience;
+    float min_improvement;
+    double max_seconds;
+    size_t progress_every;
+    int (*progress)(void *ctx, const NnProgress *p);
+    void *progress_ctx;
+} NnStopConfig;
+
+typedef struct
+{
+    float rate;           // step size of the default SGD optimizer
+    Optimizer *optimizer; // NULL = plain SGD at rate
+    size_t batch_size;    // samples per update, 0 = the whole dataset
+    size_t epochs;
+    int shuffle;          // visit the samples in a new random order every epoch
+    size_t num_threads;   // backpropagation parts, 0 = one per pool thread
+    NnCheckpointer *checkpoint; // snapshot every checkpoint_every steps, NULL = none
+    size_t checkpoint_every;
+    size_t start_step;    // steps already taken (see nn_checkpoint_load), skipped on this run
+    NnStopConfig stop;    // checked once per epoch
+} TrainConfig;
+
 // size_t archi[] = {2, 2, 1}
 
 NeuralNetwork nn_alloc(size_t *archi, size_t num_layers);
+NeuralNetwork nn_alloc_batch(size_t *archi, size_t num_layers, size_t batch_size);
+void nn_free(NeuralNetwork nn);
+NeuralNetwork nn_clone(NeuralNetwork nn);
+void nn_copy(NeuralNetwork dst, NeuralNetwork src);
+void nn_set_activation(NeuralNetwork nn, size_t layer, Activation act);
+NeuralNetwork nn_convert(NeuralNetwork nn, NnDtype dtype);
+void nn_prune(NeuralNetwork nn, float sparsity, NnPruneScope scope);
+NeuralNetwork nn_sparsify(NeuralNetwork nn, float max_density);
+size_t nn_num_params(NeuralNetwork nn);
+float *nn_param(NeuralNetwork nn, size_t index);
 void nn_rand(NeuralNetwork nn, float min, float max);
 void nn_fill(NeuralNetwork nn, float val);
 void nn_print(NeuralNetwork nn, char *name);
 void nn_forward(NeuralNetwork nn);
+void nn_forward_batch(NeuralNetwork nn, Matrix in);
+void nn_predict(NeuralNetwork nn, Matrix in, Matrix out);
+NnWorkspace nn_workspace_alloc(NeuralNetwork nn, size_t batch_size);
+void nn_workspace_free(NnWorkspace ws);
+void nn_infer(NeuralNetwork nn, NnWorkspace ws, Matrix in, Matrix out);
 float nn_mse(NeuralNetwork nn, Matrix train_in, Matrix train_out);
-void nn_finite_diff(NeuralNetwork nn, NeuralNetwork grad, float eps, Matrix train_in, Matrix train_out);
-void nn_backpropagation(NeuralNetwork nn, NeuralNetwork grad, Matrix train_in, Matrix train_out);
-void nn_gradient_descent(NeuralNetwork nn, float rate, Matrix train_in, Matrix train_out, size_t iterations);
+float nn_finite_diff(NeuralNetwork nn, NeuralNetwork grad, float eps, Matrix train_in, Matrix train_out);
+void nn_finite_diff_mt(NeuralNetwork nn, NeuralNetwork grad, Matrix train_in, Matrix train_out, FiniteDiffConfig cfg);
+float nn_backpropagation(NeuralNetwork nn, NeuralNetwork grad, Matrix train_in, Matrix train_out);
+float nn_backpropagation_mt(NeuralNetwork nn, NeuralNetwork grad, Matrix train_in, Matrix train_out, size_t num_threads);
+size_t nn_num_cpus(void);
+float nn_gradient_descent(NeuralNetwork nn, float rate, Matrix train_in, Matrix train_out, size_t iterations);
+NnProgress nn_gradient_descent_until(NeuralNetwork nn, float rate, Matrix train_in, Matrix train_out,
+                                     size_t max_iterations, NnStopConfig stop);
+
+// Persistent thread pool behind the parallel paths of nn_gemm, mat_activate(_grad), nn_mse,
+// nn_optimizer_step and the _mt gradients. Each worker owns a deque of ranges and steals from the
+// others' when it runs dry; the calling thread works too, so num_threads counts it. The pool starts
+// on first use with one thread per CPU; nn_pool_init resizes it (0 = one per CPU) and, like
+// nn_kernels_select, must not race with running kernels. After nn_pool_shutdown everything runs
+// on the calling thread until the next nn_pool_init.
+// nn_parallel_for calls fn on disjoint subranges covering [begin, end), none shorter than grain
+// except the last, and returns when all are done. Ranges of at most grain elements, and loops
+// started from inside a pool task, run inline on the calling thread.
+typedef void (*NnRangeFn)(void *ctx, size_t begin, size_t end);
+
+void nn_pool_init(size_t num_threads);
+void nn_pool_shutdown(void);
+size_t nn_pool_size(void);
+void nn_parallel_for(size_t begin, size_t end, size_t grain, NnRangeFn fn, void *ctx);
+
+// Binary model file: NnFileHeader, archi[num_layers + 1] as uint64, act[num_layers] as uint32
+// (version 2 on; version 1 files are all sigmoid), then the parameter arena at params_offset
+// (a multiple of NN_ALIGN), all in host byte order.
+#define NN_FILE_MAGIC "NNCM"
+#define NN_FILE_VERSION 2
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t num_layers;
+    uint64_t num_params;
+    uint64_t params_offset;
+} NnFileHeader;
+
+int nn_save(NeuralNetwork nn, const char *path);
+int nn_load(const char *path, size_t batch_size, NeuralNetwork *nn);
+int nn_load_mmap(const char *path, size_t batch_size, NeuralNetwork *nn);
+NnProgress nn_train(NeuralNetwork nn, Matrix train_in, Matrix train_out, TrainConfig cfg);
+
+Optimizer nn_optimizer_alloc(NeuralNetwork nn, OptimizerKind kind, float rate);
+void nn_optimizer_free(Optimizer opt);
+void nn_optimizer_step(Optimizer *opt, NeuralNetwork nn, NeuralNetwork grad, float scale);
+
+// Streaming dataset: a background thread reads fixed-size chunks of a file into two buffers
+// while the caller trains on the other one, so I/O overlaps compute and memory stays at two
+// chunks whatever the file size. Every record is in_cols inputs followed by out_cols outputs:
+//   NN_DATA_CSV     one record per line, fields separated by commas and/or whitespace; a first
+//                   line that does not start with a number is taken as a header and skipped
+//   NN_DATA_BINARY  records of host-order float32 back to back, no header
+typedef enum
+{
+    NN_DATA_CSV,
+    NN_DATA_BINARY,
+} NnDataFormat;
+
+typedef struct
+{
+    float *data; // chunk_rows records of in_cols + out_cols floats
+    size_t rows;
+    int full;
+    int error; // errno of a failed read or parse; the reader stops after publishing it
+} NnStreamChunk;
+
+typedef struct
+{
+    FILE *file;
+    NnDataFormat format;
+    size_t in_cols;
+    size_t out_cols;
+    size_t chunk_rows;
+    NnStreamChunk chunks[2];
+    size_t fill;    // chunk the reader fills next
+    size_t take;    // chunk the consumer takes next
+    int held;       // the consumer still has chunks[take] out
+    int stop;
+    char *line;     // CSV line buffer
+    size_t line_cap;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} NnStream;
+
+NnStream *nn_stream_open(const char *path, NnDataFormat format, size_t in_cols, size_t out_cols, size_t chunk_rows);
+int nn_stream_next(NnStream *stream, Matrix *train_in, Matrix *train_out);
+void nn_stream_close(NnStream *stream);
+int nn_train_stream(NeuralNetwork nn, NnStream *stream, TrainConfig cfg);
+
+// Binary dataset file: NnDataHeader, then rows records from data_offset (a multiple of NN_ALIGN).
+// A record is stride floats: in_cols inputs, out_cols outputs, then padding. Host byte order.
+#define NN_DATA_MAGIC "NNDS"
+#define NN_DATA_VERSION 1
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t rows;
+    uint64_t in_cols;
+    uint64_t out_cols;
+    uint64_t stride; // floats per record, at least in_cols + out_cols
+    uint64_t data_offset;
+} NnDataHeader;
+
+typedef struct
+{
+    Matrix train_in;  // views into the mapping, stride = the file's record stride
+    Matrix train_out;
+    void *mapping;
+    size_t mapping_size;
+} NnDataset;
+
+int nn_dataset_save(const char *path, Matrix train_in, Matrix train_out);
+int nn_dataset_open(const char *path, NnDataset *ds);
+void nn_dataset_close(NnDataset ds);
+
+// Asynchronous checkpoints. nn_checkpoint_snapshot copies the parameters, and the optimizer's
+// state, into a buffer between two steps; a background thread writes it to path.tmp, fsyncs it
+// and renames it over path, so path always holds a complete checkpoint while training goes on.
+// File: NnCheckpointHeader, archi[num_layers + 1] as uint64, then from data_offset (a multiple of
+// NN_ALIGN) the parameter arena followed by the m and v arenas named in states, host byte order.
+#define NN_CKPT_MAGIC "NNCK"
+#define NN_CKPT_VERSION 1
+#define NN_CKPT_M 1u
+#define NN_CKPT_V 2u
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t num_layers;
+    uint64_t num_params;
+    uint64_t step;     // training steps taken when the snapshot was made
+    uint64_t opt_step; // Optimizer.step
+    uint32_t opt_kind;
+    uint32_t states;   // NN_CKPT_M | NN_CKPT_V: the optimizer arenas stored
+    uint64_t data_offset;
+} NnCheckpointHeader;
+
+struct NnCheckpointer
+{
+    char *path;
+    char *tmp_path;
+    uint64_t *archi;
+    float *snapshot; // the parameters, then m and v as in header.states
+    NnCheckpointHeader header;
+    int pending; // snapshot handed to the writer and not on disk yet
+    int stop;
+    int error;        // errno of a failed write, reported by the next nn_checkpoint_wait
+    uint64_t written; // step of the last checkpoint on disk
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+NnCheckpointer *nn_checkpoint_open(const char *path, NeuralNetwork nn, const Optimizer *opt);
+int nn_checkpoint_snapshot(NnCheckpointer *ck, NeuralNetwork nn, const Optimizer *opt, size_t step);
+int nn_checkpoint_wait(NnCheckpointer *ck);
+int nn_checkpoint_close(NnCheckpointer *ck);
+int nn_checkpoint_load(const char *path, NeuralNetwork nn, Optimizer *opt, size_t *step);
+
+// Post-training int8 inference. Weights are symmetric int8 with one scale per layer or per output
+// column; each layer's input is quantized on the fly to 0..127 with a scale and zero point
+// calibrated on sample data (inputs outside the calibrated range are clamped). Seven bits keep
+// pmaddubsw's 16-bit pair sums from saturating, so every ISA gets the same integer results.
+// Products accumulate in int32 and are dequantized, biased and activated in float.
+typedef enum
+{
+    NN_QUANT_PER_LAYER,
+    NN_QUANT_PER_CHANNEL,
+} NnQuantGranularity;
+
+typedef struct
+{
+    size_t in;
+    size_t out;
+    size_t k4;    // in rounded up to a multiple of 4, divided by 4
+    size_t n_pad; // out rounded up to NN_QGEMM_NR
+    int8_t *w;    // k4 x n_pad x 4, the layout the qgemm kernels read
+    float *mul;   // n_pad: input scale * weight scale of the column
+    float *add;   // n_pad: bias - input zero point * column weight sum * mul
+    float in_scale;
+    int32_t in_zero;
+} NnQuantLayer;
+
+typedef struct
+{
+    size_t *archi;
+    size_t num_layers;
+    Activation *act;
+    NnQuantLayer *layers;
+    Matrix *activations; // float, num_layers + 1 like NeuralNetwork, so NN_INPUT / NN_OUTPUT work
+    uint8_t *qin;        // batch x 4 * max k4: the current layer's quantized input
+    int32_t *acc;        // batch x max n_pad
+} NnQuantNetwork;
+
+typedef struct
+{
+    float max_abs_error;
+    float mean_abs_error;
+    float argmax_agreement; // fraction of rows whose largest output is the same column
+} NnQuantError;
+
+NnQuantNetwork nn_quantize(NeuralNetwork nn, Matrix calib, NnQuantGranularity gran);
+void nn_quant_free(NnQuantNetwork q);
+void nn_quant_forward_batch(NnQuantNetwork q, Matrix in);
+NnQuantError nn_quant_error(NeuralNetwork nn, NnQuantNetwork q, Matrix in);
+
+// Instrumentation. Build with -DNN_TRACE to time every kernel call, layer and training phase,
+// count its FLOPs and bytes, and keep the most recent events of each thread for a Chrome trace
+// (chrome://tracing, Perfetto). Without NN_TRACE the macros expand to nothing.
+typedef enum
+{
+    NN_TRACE_GEMM,
+    NN_TRACE_ACTIVATION,
+    NN_TRACE_ACTIVATION_GRAD,
+    NN_TRACE_COPY,
+    NN_TRACE_ADD,
+    NN_TRACE_LAYER_FORWARD,
+    NN_TRACE_LAYER_BACKWARD,
+    NN_TRACE_BACKPROP,
+    NN_TRACE_GRAD_REDUCE,
+    NN_TRACE_OPTIMIZER,
+    NN_TRACE_FINITE_DIFF,
+    NN_TRACE_GATHER,
+    NN_TRACE_CHECKPOINT,
+    NN_TRACE_KIND_COUNT,
+} NnTraceKind;
+
+// Events kept per thread; older ones are overwritten
+#ifndef NN_TRACE_RING
+#define NN_TRACE_RING 16384
+#endif
+// Layers with their own stats; deeper layers share the last slot
+#define NN_TRACE_MAX_LAYERS 32
+
+typedef struct
+{
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    uint64_t flops;
+    uint64_t bytes;
+    uint32_t tid;
+    uint16_t kind;
+    int16_t layer; // -1 when the event is not tied to a layer
+} NnTraceEvent;
+
+typedef struct
+{
+    uint64_t calls;
+    uint64_t ns;
+    uint64_t flops;
+    uint64_t bytes;
+} NnTraceStats;
+
+#ifdef NN_TRACE
+uint64_t nn_trace_now(void);
+void nn_trace_record(NnTraceKind kind, int layer, uint64_t start_ns, uint64_t flops, uint64_t bytes);
+#define NN_TRACE_BEGIN(t) uint64_t t = nn_trace_now()
+#define NN_TRACE_END(t, kind, layer, flops, bytes) \
+    nn_trace_record((kind), (int)(layer), (t), (uint64_t)(flops), (uint64_t)(bytes))
+#else
+#define NN_TRACE_BEGIN(t)
+#define NN_TRACE_END(t, kind, layer, flops, bytes)
+#endif
+
+const char *nn_trace_name(NnTraceKind kind);
+void nn_trace_reset(void);
+NnTraceStats nn_trace_stats(NnTraceKind kind, int layer);
+void nn_trace_report(FILE *f);
+int nn_trace_export_chrome(const char *path);
 
 #endif // NN_H
 
 #ifdef NN_IMPLEMENTATION
+#include <stdatomic.h>
+#include <sched.h>
 
 float rand_float(void)
 {
@@ -70,231 +630,3558 @@ float sigf(float x)
     return 1.0f / (1.0f + expf(-x));
 }
 
-Matrix mat_alloc(size_t rows, size_t cols)
+static void nn_gemm_kernel_scalar(size_t kc, const float *pa, const float *pb, float *c, size_t ldc, int accumulate,
+                                  const float *bias)
 {
-    Matrix m;
-    m.rows = rows;
-    m.cols = cols;
-    m.stride = cols;
-    m.data = malloc(rows * cols * sizeof(*m.data));
-
-    assert(m.data != NULL);
-
-    return m;
-}
+    float acc[NN_GEMM_MR][NN_GEMM_NR] = {{0.0f}};
 
-void mat_print(Matrix m, char *name)
-{
-    printf("%s: [\n", name);
-    for (size_t i = 0; i < m.rows; i++)
+    for (size_t p = 0; p < kc; p++)
     {
-        for (size_t j = 0; j < m.cols; j++)
+        for (size_t r = 0; r < NN_GEMM_MR; r++)
         {
-            printf("    %f", MAT_AT(m, i, j));
+            float ar = pa[p * NN_GEMM_MR + r];
+            for (size_t j = 0; j < NN_GEMM_NR; j++)
+            {
+                acc[r][j] += ar * pb[p * NN_GEMM_NR + j];
+            }
         }
-        printf("\n");
     }
-    printf("]\n");
-}
 
-void mat_rand(Matrix m, float min, float max)
-{
-    for (size_t i = 0; i < m.rows; i++)
+    for (size_t r = 0; r < NN_GEMM_MR; r++)
     {
-        for (size_t j = 0; j < m.cols; j++)
+        for (size_t j = 0; j < NN_GEMM_NR; j++)
         {
-            MAT_AT(m, i, j) = rand_float() * (max - min) + min;
+            float v = bias != NULL ? acc[r][j] + bias[j] : acc[r][j];
+            c[r * ldc + j] = accumulate ? c[r * ldc + j] + v : v;
         }
     }
 }
 
-void mat_fill(Matrix m, float val)
+static void nn_add_scalar(float *dst, const float *src, size_t n)
 {
-    for (size_t i = 0; i < m.rows; i++)
+    for (size_t i = 0; i < n; i++)
     {
-        for (size_t j = 0; j < m.cols; j++)
-        {
-            MAT_AT(m, i, j) = val;
-        }
+        dst[i] += src[i];
     }
 }
 
-void mat_cpy(Matrix dst, Matrix src)
+static void nn_fill_scalar(float *dst, float val, size_t n)
 {
-    assert(dst.rows == src.rows);
-    assert(dst.cols == src.cols);
+    for (size_t i = 0; i < n; i++)
+    {
+        dst[i] = val;
+    }
+}
 
-    for (size_t i = 0; i < dst.rows; i++)
+static void nn_axpy_scalar(float *dst, float alpha, const float *src, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
     {
-        for (size_t j = 0; j < dst.cols; j++)
-        {
-            MAT_AT(dst, i, j) = MAT_AT(src, i, j);
-        }
+        dst[i] += alpha * src[i];
     }
 }
 
-Matrix mat_row(Matrix m, size_t row)
+static float nn_dot_scalar(const float *a, const float *b, size_t n)
 {
-    return (Matrix){
-        .rows = 1,
-        .cols = m.cols,
-        .stride = m.stride,
-        .data = &MAT_AT(m, row, 0)};
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; i++)
+    {
+        sum += a[i] * b[i];
+    }
+    return sum;
 }
 
-void mat_sum(Matrix dst, Matrix a)
+static void nn_sigf_scalar(float *x, size_t n)
 {
-    assert(dst.rows == a.rows);
-    assert(dst.cols == a.cols);
+    for (size_t i = 0; i < n; i++)
+    {
+        x[i] = sigf(x[i]);
+    }
+}
 
-    for (size_t i = 0; i < dst.rows; i++)
+// Fast sigmoid: 1 / (1 + 2^t) with t = -x * log2(e) split into floor(t) + f, f in [0, 1).
+// 2^floor(t) goes straight into the exponent bits, 2^f comes from a minimax polynomial
+// (relative error 1.5e-4 at degree 3, 2.7e-3 at degree 2). t is clamped to +-126 so the
+// exponent stays normal; past that the sigmoid is already 0 or 1 to float precision.
+#define NN_SIGF_LOG2E 1.44269504088896341f
+#define NN_SIGF_T_MAX 126.0f
+#define NN_SIGF_F3_1 0.6960656421638072f
+#define NN_SIGF_F3_2 0.224494337302845f
+#define NN_SIGF_F3_3 0.07944023841053369f
+#define NN_SIGF_F2_1 0.6602f
+#define NN_SIGF_F2_2 0.3398f
+
+// Interpolation table: NN_SIGF_TABLE_N steps over [-NN_SIGF_TABLE_RANGE, NN_SIGF_TABLE_RANGE]
+#define NN_SIGF_TABLE_N 1024
+#define NN_SIGF_TABLE_RANGE 16.0f
+#define NN_SIGF_TABLE_SCALE (NN_SIGF_TABLE_N / (2.0f * NN_SIGF_TABLE_RANGE))
+
+static float nn_sigf_table[NN_SIGF_TABLE_N + 1];
+
+static void nn_sigf_table_init(void)
+{
+    for (size_t i = 0; i <= NN_SIGF_TABLE_N; i++)
     {
-        for (size_t j = 0; j < dst.cols; j++)
-        {
-            MAT_AT(dst, i, j) += MAT_AT(a, i, j);
-        }
+        nn_sigf_table[i] = sigf((float)i / NN_SIGF_TABLE_SCALE - NN_SIGF_TABLE_RANGE);
     }
 }
 
-void mat_dot(Matrix dst, Matrix a, Matrix b)
+static inline float nn_exp2_fast(float t, int fastest)
 {
-    assert(dst.rows == a.rows);
-    assert(dst.cols == b.cols);
-    assert(a.cols == b.rows);
+    t = t > -NN_SIGF_T_MAX ? t : -NN_SIGF_T_MAX; // also maps NaN to the low end
+    t = t < NN_SIGF_T_MAX ? t : NN_SIGF_T_MAX;
+    // floor by truncation, which libm's floorf does not get inlined for on plain x86-64
+    int32_t fl = (int32_t)t;
+    fl -= (float)fl > t;
+    float f = t - (float)fl;
+    float p = fastest ? 1.0f + f * (NN_SIGF_F2_1 + f * NN_SIGF_F2_2)
+                      : 1.0f + f * (NN_SIGF_F3_1 + f * (NN_SIGF_F3_2 + f * NN_SIGF_F3_3));
+    uint32_t bits = (uint32_t)(fl + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
 
-    for (size_t i = 0; i < dst.rows; i++)
+static void nn_sigf_fast_scalar(float *x, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
     {
-        for (size_t j = 0; j < dst.cols; j++)
-        {
-            MAT_AT(dst, i, j) = 0.0f;
-            for (size_t k = 0; k < a.cols; k++)
-            {
-                MAT_AT(dst, i, j) += MAT_AT(a, i, k) * MAT_AT(b, k, j);
-            }
-        }
+        x[i] = 1.0f / (1.0f + nn_exp2_fast(-x[i] * NN_SIGF_LOG2E, 0));
     }
 }
 
-void mat_sigf(Matrix a)
+static void nn_sigf_fastest_scalar(float *x, size_t n)
 {
-    for (size_t i = 0; i < a.rows; i++)
+    for (size_t i = 0; i < n; i++)
     {
-        for (size_t j = 0; j < a.cols; j++)
-        {
-            MAT_AT(a, i, j) = sigf(MAT_AT(a, i, j));
-        }
+        x[i] = 1.0f / (1.0f + nn_exp2_fast(-x[i] * NN_SIGF_LOG2E, 1));
     }
 }
 
-NeuralNetwork nn_alloc(size_t archi[], size_t num_layers)
+static void nn_sigf_table_scalar(float *x, size_t n)
 {
-    size_t input_size = archi[0];
-    NeuralNetwork nn;
-    nn.archi = archi;
-    nn.num_layers = num_layers;
-    nn.weights = malloc(num_layers * sizeof(*nn.weights));
-    nn.biases = malloc(num_layers * sizeof(*nn.biases));
-    nn.activations = malloc((num_layers + 1) * sizeof(*nn.activations));
-
-    nn.activations[0] = mat_alloc(1, input_size);
-
-    for (size_t i = 1; i <= nn.num_layers; i++)
+    const float top = NN_SIGF_TABLE_N - 1.0f / 1024.0f;
+    for (size_t i = 0; i < n; i++)
     {
-        nn.weights[i - 1] = mat_alloc(nn.activations[i - 1].cols, archi[i]);
-        nn.biases[i - 1] = mat_alloc(1, archi[i]);
-        nn.activations[i] = mat_alloc(1, archi[i]);
+        // the first compare is false for a NaN, so the index is always in range
+        float u = (x[i] + NN_SIGF_TABLE_RANGE) * NN_SIGF_TABLE_SCALE;
+        u = u > 0.0f ? u : 0.0f;
+        u = u < top ? u : top;
+        size_t j = (size_t)u;
+        float f = u - (float)j;
+        x[i] = nn_sigf_table[j] + f * (nn_sigf_table[j + 1] - nn_sigf_table[j]);
     }
+}
 
-    return nn;
+static void nn_relu_scalar(float *x, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        x[i] = x[i] > 0.0f ? x[i] : 0.0f;
+    }
 }
 
-void nn_rand(NeuralNetwork nn, float min, float max)
+static void nn_tanh_scalar(float *x, size_t n)
 {
-    for (size_t i = 0; i < nn.num_layers; i++)
+    for (size_t i = 0; i < n; i++)
     {
-        mat_rand(nn.weights[i], min, max);
-        mat_rand(nn.biases[i], min, max);
+        x[i] = tanhf(x[i]);
     }
 }
 
-void nn_fill(NeuralNetwork nn, float val)
+static float nn_f16_to_f32(uint16_t h)
 {
-    for (size_t i = 0; i < nn.num_layers; i++)
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+    if (exp == 0x1f)
+    {
+        bits = sign | 0x7f800000 | (mant << 13);
+    }
+    else if (exp != 0)
     {
-        mat_fill(nn.weights[i], val);
-        mat_fill(nn.biases[i], val);
+        bits = sign | ((exp + 127 - 15) << 23) | (mant << 13);
     }
+    else
+    {
+        // Zero or subnormal, mant * 2^-24, which float holds exactly
+        float f = (float)mant * 0x1p-24f;
+        memcpy(&bits, &f, sizeof(bits));
+        bits |= sign;
+    }
+
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
 }
 
-void nn_print(NeuralNetwork nn, char *name)
+// Rounds to nearest even; overflow goes to infinity and NaN stays NaN
+static uint16_t nn_f32_to_f16(float x)
 {
-    printf("%s: [\n", name);
-    for (size_t i = 0; i < nn.num_layers; i++)
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t abs = bits & 0x7fffffff;
+
+    if (abs >= (127 + 16) << 23)
     {
-        mat_print(nn.weights[i], "weights");
-        mat_print(nn.biases[i], "biases");
+        return (uint16_t)(sign | (abs > 0x7f800000 ? 0x7e00 : 0x7c00));
     }
-    printf("]\n");
+    if (abs < (127 - 14) << 23)
+    {
+        // Below the smallest normal half: adding 0.5 lines the half's subnormal mantissa up with
+        // the bottom of the float's, and the float add does the rounding
+        float f;
+        memcpy(&f, &abs, sizeof(f));
+        f += 0.5f;
+        memcpy(&abs, &f, sizeof(abs));
+        return (uint16_t)(sign | (abs - 0x3f000000));
+    }
+
+    uint32_t odd = (abs >> 13) & 1;
+    abs += ((uint32_t)(15 - 127) << 23) + 0xfff + odd;
+    return (uint16_t)(sign | (abs >> 13));
 }
 
-void nn_forward(NeuralNetwork nn)
+static float nn_bf16_to_f32(uint16_t h)
 {
-    for (size_t i = 0; i < nn.num_layers; i++)
+    uint32_t bits = (uint32_t)h << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static uint16_t nn_f32_to_bf16(float x)
+{
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    if ((bits & 0x7fffffff) > 0x7f800000)
     {
-        mat_dot(nn.activations[i + 1], nn.activations[i], nn.weights[i]);
-        mat_sum(nn.activations[i + 1], nn.biases[i]);
-        mat_sigf(nn.activations[i + 1]);
+        return (uint16_t)((bits >> 16) | 0x40);
     }
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return (uint16_t)(bits >> 16);
 }
 
-float nn_mse(NeuralNetwork nn, Matrix train_in, Matrix train_out)
+float nn_half_to_float(uint16_t h, NnDtype dtype)
 {
-    assert(train_in.rows == train_out.rows);
-    assert(train_in.cols == NN_INPUT(nn).cols);
-    assert(train_out.cols == nn.activations[nn.num_layers].cols);
+    assert(dtype == NN_DTYPE_F16 || dtype == NN_DTYPE_BF16);
 
-    float result = 0.0f;
+    return dtype == NN_DTYPE_F16 ? nn_f16_to_f32(h) : nn_bf16_to_f32(h);
+}
 
-    for (size_t i = 0; i < train_in.rows; i++)
-    {
-        Matrix x = mat_row(train_in, i);
-        Matrix y = mat_row(train_out, i);
-        mat_cpy(NN_INPUT(nn), x);
+uint16_t nn_float_to_half(float x, NnDtype dtype)
+{
+    assert(dtype == NN_DTYPE_F16 || dtype == NN_DTYPE_BF16);
 
-        nn_forward(nn);
+    return dtype == NN_DTYPE_F16 ? nn_f32_to_f16(x) : nn_f32_to_bf16(x);
+}
 
-        for (size_t j = 0; j < train_out.cols; j++)
-        {
-            float diff = MAT_AT(NN_OUTPUT(nn), 0, j) - MAT_AT(y, 0, j);
-            result += diff * diff;
-        }
+static void nn_cvt_f16_scalar(float *dst, const uint16_t *src, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        dst[i] = nn_f16_to_f32(src[i]);
     }
+}
 
-    return result / train_in.rows;
+static void nn_cvt_bf16_scalar(float *dst, const uint16_t *src, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        dst[i] = nn_bf16_to_f32(src[i]);
+    }
 }
 
-void nn_finite_diff(NeuralNetwork nn, NeuralNetwork grad, float eps, Matrix train_in, Matrix train_out)
+static void nn_qgemm_scalar(size_t m, size_t n, size_t k4, const uint8_t *a, const int8_t *b, int32_t *c)
 {
-    float saved;
-    float mse = nn_mse(nn, train_in, train_out);
-    for (size_t i = 0; i < nn.num_layers; i++)
+    for (size_t i = 0; i < m; i++)
     {
-        for (size_t j = 0; j < nn.weights[i].rows; j++)
+        const uint8_t *ai = a + i * 4 * k4;
+        for (size_t j = 0; j < n; j++)
         {
-            for (size_t k = 0; k < nn.weights[i].cols; k++)
+            int32_t acc = 0;
+            for (size_t p = 0; p < k4; p++)
             {
-                saved = MAT_AT(nn.weights[i], j, k);
-                MAT_AT(nn.weights[i], j, k) += eps;
-                float new_mse = nn_mse(nn, train_in, train_out);
-                MAT_AT(grad.weights[i], j, k) = (new_mse - mse) / eps;
-                MAT_AT(nn.weights[i], j, k) = saved;
+                const int8_t *bp = b + (p * n + j) * 4;
+                acc += ai[4 * p] * bp[0] + ai[4 * p + 1] * bp[1] + ai[4 * p + 2] * bp[2] + ai[4 * p + 3] * bp[3];
             }
+            c[i * n + j] = acc;
         }
-        for (size_t j = 0; j < nn.biases[i].rows; j++)
+    }
+}
+
+static void nn_spmm_scalar(size_t m, size_t n, const uint32_t *row_ptr, const uint32_t *col, const float *val,
+                           const float *b, size_t ldb, float *c, size_t ldc)
+{
+    for (size_t i = 0; i < m; i++)
+    {
+        float *ci = c + i * ldc;
+        for (size_t j = 0; j < n; j++)
         {
-            for (size_t k = 0; k < nn.biases[i].cols; k++)
+            ci[j] = 0.0f;
+        }
+        for (uint32_t p = row_ptr[i]; p < row_ptr[i + 1]; p++)
+        {
+            const float *bp = b + col[p] * ldb;
+            for (size_t j = 0; j < n; j++)
             {
-                saved = MAT_AT(nn.biases[i], 0, k);
+                ci[j] += val[p] * bp[j];
+            }
+        }
+    }
+}
+
+static void nn_dsigf_scalar(float *d, const float *a, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        d[i] *= a[i] * (1.0f - a[i]);
+    }
+}
+
+static void nn_optimize_scalar(float *w, const float *g, float *m, float *v, size_t n, const OptimizerStep *st)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        float gi = st->scale * g[i];
+        switch (st->kind)
+        {
+        case NN_OPT_SGD:
+            w[i] -= st->rate * gi;
+            break;
+        case NN_OPT_MOMENTUM:
+            m[i] = st->momentum * m[i] + gi;
+            w[i] -= st->rate * m[i];
+            break;
+        case NN_OPT_NESTEROV:
+            m[i] = st->momentum * m[i] + gi;
+            w[i] -= st->rate * (gi + st->momentum * m[i]);
+            break;
+        case NN_OPT_RMSPROP:
+            v[i] = st->beta2 * v[i] + (1.0f - st->beta2) * gi * gi;
+            w[i] -= st->rate * gi / (sqrtf(v[i]) + st->eps);
+            break;
+        case NN_OPT_ADAM:
+            m[i] = st->beta1 * m[i] + (1.0f - st->beta1) * gi;
+            v[i] = st->beta2 * v[i] + (1.0f - st->beta2) * gi * gi;
+            w[i] -= st->rate * m[i] / (sqrtf(v[i]) + st->eps);
+            break;
+        }
+    }
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define NN_X86 1
+#include <immintrin.h>
+
+// Cephes expf: e^x = 2^n * e^r with |r| <= ln2/2, e^r from a degree-5 polynomial (~1 ulp).
+// Inputs are clamped to +-88 so 2^n stays a normal float (or flushes to 0 at the low end).
+#define NN_EXP_HI 88.0f
+#define NN_EXP_LO -88.0f
+#define NN_LOG2E 1.44269504088896341f
+#define NN_EXP_C1 0.693359375f
+#define NN_EXP_C2 -2.12194440e-4f
+#define NN_EXP_P0 1.9875691500e-4f
+#define NN_EXP_P1 1.3981999507e-3f
+#define NN_EXP_P2 8.3334519073e-3f
+#define NN_EXP_P3 4.1665795894e-2f
+#define NN_EXP_P4 1.6666665459e-1f
+#define NN_EXP_P5 5.0000001201e-1f
+
+// Runs a vector kernel of width w over the last n < w elements through a padded buffer
+#define NN_TAIL(w, x, n, call)                      \
+    do                                              \
+    {                                               \
+        float nn_tail_[w] = {0.0f};                 \
+        memcpy(nn_tail_, (x), (n) * sizeof(float)); \
+        call(nn_tail_, w);                          \
+        memcpy((x), nn_tail_, (n) * sizeof(float)); \
+    } while (0)
+
+// SSE2
+
+__attribute__((target("sse2"))) static inline __m128 nn_exp_sse2(__m128 x)
+{
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(NN_EXP_LO)), _mm_set1_ps(NN_EXP_HI));
+    __m128i n = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(NN_LOG2E)));
+    __m128 fx = _mm_cvtepi32_ps(n);
+    x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(NN_EXP_C1)));
+    x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(NN_EXP_C2)));
+
+    __m128 y = _mm_set1_ps(NN_EXP_P0);
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(NN_EXP_P1));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(NN_EXP_P2));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(NN_EXP_P3));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(NN_EXP_P4));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(NN_EXP_P5));
+    y = _mm_add_ps(_mm_mul_ps(y, _mm_mul_ps(x, x)), _mm_add_ps(x, _mm_set1_ps(1.0f)));
+
+    __m128i e = _mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(y, _mm_castsi128_ps(e));
+}
+
+__attribute__((target("sse2"))) static void nn_gemm_kernel_sse2(size_t kc, const float *pa, const float *pb,
+                                                                float *c, size_t ldc, int accumulate,
+                                                                const float *bias)
+{
+    __m128 acc[4][2];
+    for (size_t r = 0; r < 4; r++)
+    {
+        acc[r][0] = _mm_setzero_ps();
+        acc[r][1] = _mm_setzero_ps();
+    }
+
+    for (size_t p = 0; p < kc; p++)
+    {
+        __m128 b0 = _mm_loadu_ps(pb + p * 8);
+        __m128 b1 = _mm_loadu_ps(pb + p * 8 + 4);
+        for (size_t r = 0; r < 4; r++)
+        {
+            __m128 ar = _mm_set1_ps(pa[p * 4 + r]);
+            acc[r][0] = _mm_add_ps(acc[r][0], _mm_mul_ps(ar, b0));
+            acc[r][1] = _mm_add_ps(acc[r][1], _mm_mul_ps(ar, b1));
+        }
+    }
+
+    if (bias != NULL)
+    {
+        __m128 bias0 = _mm_loadu_ps(bias);
+        __m128 bias1 = _mm_loadu_ps(bias + 4);
+        for (size_t r = 0; r < 4; r++)
+        {
+            acc[r][0] = _mm_add_ps(acc[r][0], bias0);
+            acc[r][1] = _mm_add_ps(acc[r][1], bias1);
+        }
+    }
+
+    for (size_t r = 0; r < 4; r++)
+    {
+        float *cr = c + r * ldc;
+        if (accumulate)
+        {
+            acc[r][0] = _mm_add_ps(acc[r][0], _mm_loadu_ps(cr));
+            acc[r][1] = _mm_add_ps(acc[r][1], _mm_loadu_ps(cr + 4));
+        }
+        _mm_storeu_ps(cr, acc[r][0]);
+        _mm_storeu_ps(cr + 4, acc[r][1]);
+    }
+}
+
+__attribute__((target("sse2"))) static void nn_add_sse2(float *dst, const float *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_loadu_ps(src + i)));
+    }
+    nn_add_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void nn_fill_sse2(float *dst, float val, size_t n)
+{
+    __m128 v = _mm_set1_ps(val);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm_storeu_ps(dst + i, v);
+    }
+    nn_fill_scalar(dst + i, val, n - i);
+}
+
+__attribute__((target("sse2"))) static void nn_axpy_sse2(float *dst, float alpha, const float *src, size_t n)
+{
+    __m128 a = _mm_set1_ps(alpha);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(a, _mm_loadu_ps(src + i))));
+    }
+    nn_axpy_scalar(dst + i, alpha, src + i, n - i);
+}
+
+__attribute__((target("sse2"))) static float nn_dot_sse2(const float *a, const float *b, size_t n)
+{
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    __m128 h = _mm_add_ps(acc0, acc1);
+    h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+    return _mm_cvtss_f32(_mm_add_ss(h, _mm_shuffle_ps(h, h, 1))) + nn_dot_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void nn_relu_sse2(float *x, size_t n)
+{
+    const __m128 zero = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm_storeu_ps(x + i, _mm_max_ps(_mm_loadu_ps(x + i), zero));
+    }
+    nn_relu_scalar(x + i, n - i);
+}
+
+// Interleaving zeros below each bf16 value is the whole conversion
+__attribute__((target("sse2"))) static void nn_cvt_bf16_sse2(float *dst, const uint16_t *src, size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i h = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_ps(dst + i, _mm_castsi128_ps(_mm_unpacklo_epi16(zero, h)));
+        _mm_storeu_ps(dst + i + 4, _mm_castsi128_ps(_mm_unpackhi_epi16(zero, h)));
+    }
+    nn_cvt_bf16_scalar(dst + i, src + i, n - i);
+}
+
+// tanh(x) = 2 sigmoid(2x) - 1, so the vector levels get tanh from whichever sigmoid kernel
+// (and accuracy mode) is selected
+static void nn_tanh_sigf(float *x, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        x[i] *= 2.0f;
+    }
+    nn_kernels.sigf(x, n);
+    for (size_t i = 0; i < n; i++)
+    {
+        x[i] = 2.0f * x[i] - 1.0f;
+    }
+}
+
+__attribute__((target("sse2"))) static void nn_sigf_sse2(float *x, size_t n)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 e = nn_exp_sse2(_mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(x + i)));
+        _mm_storeu_ps(x + i, _mm_div_ps(one, _mm_add_ps(one, e)));
+    }
+    if (i < n)
+    {
+        NN_TAIL(4, x + i, n - i, nn_sigf_sse2);
+    }
+}
+
+// 2^t for the fast sigmoid modes; see nn_exp2_fast
+__attribute__((target("sse2"))) static inline __m128 nn_exp2_fast_sse2(__m128 t, int fastest)
+{
+    t = _mm_min_ps(_mm_max_ps(t, _mm_set1_ps(-NN_SIGF_T_MAX)), _mm_set1_ps(NN_SIGF_T_MAX));
+    // SSE2 has no floor: truncate, then step the negative non-integers back down by one
+    __m128i i = _mm_cvttps_epi32(t);
+    __m128 fl = _mm_cvtepi32_ps(i);
+    __m128 up = _mm_cmpgt_ps(fl, t);
+    i = _mm_add_epi32(i, _mm_castps_si128(up));
+    fl = _mm_sub_ps(fl, _mm_and_ps(up, _mm_set1_ps(1.0f)));
+    __m128 f = _mm_sub_ps(t, fl);
+
+    __m128 p;
+    if (fastest)
+    {
+        p = _mm_add_ps(_mm_mul_ps(f, _mm_set1_ps(NN_SIGF_F2_2)), _mm_set1_ps(NN_SIGF_F2_1));
+    }
+    else
+    {
+        p = _mm_add_ps(_mm_mul_ps(f, _mm_set1_ps(NN_SIGF_F3_3)), _mm_set1_ps(NN_SIGF_F3_2));
+        p = _mm_add_ps(_mm_mul_ps(f, p), _mm_set1_ps(NN_SIGF_F3_1));
+    }
+    p = _mm_add_ps(_mm_mul_ps(f, p), _mm_set1_ps(1.0f));
+
+    __m128i e = _mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(e));
+}
+
+// Runs the fast sigmoid over whole vectors and returns how many elements it covered
+__attribute__((target("sse2"))) static inline size_t nn_sigf_poly_sse2(float *x, size_t n, int fastest)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 nlog2e = _mm_set1_ps(-NN_SIGF_LOG2E);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 d = _mm_add_ps(one, nn_exp2_fast_sse2(_mm_mul_ps(_mm_loadu_ps(x + i), nlog2e), fastest));
+        _mm_storeu_ps(x + i, fastest ? _mm_rcp_ps(d) : _mm_div_ps(one, d));
+    }
+    return i;
+}
+
+__attribute__((target("sse2"))) static void nn_sigf_fast_sse2(float *x, size_t n)
+{
+    size_t i = nn_sigf_poly_sse2(x, n, 0);
+    if (i < n)
+    {
+        NN_TAIL(4, x + i, n - i, nn_sigf_fast_sse2);
+    }
+}
+
+__attribute__((target("sse2"))) static void nn_sigf_fastest_sse2(float *x, size_t n)
+{
+    size_t i = nn_sigf_poly_sse2(x, n, 1);
+    if (i < n)
+    {
+        NN_TAIL(4, x + i, n - i, nn_sigf_fastest_sse2);
+    }
+}
+
+__attribute__((target("sse2"))) static void nn_dsigf_sse2(float *d, const float *a, size_t n)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 av = _mm_loadu_ps(a + i);
+        _mm_storeu_ps(d + i, _mm_mul_ps(_mm_loadu_ps(d + i), _mm_mul_ps(av, _mm_sub_ps(one, av))));
+    }
+    nn_dsigf_scalar(d + i, a + i, n - i);
+}
+
+// AVX2 + FMA
+
+__attribute__((target("avx2,fma"))) static inline __m256 nn_exp_avx2(__m256 x)
+{
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(NN_EXP_LO)), _mm256_set1_ps(NN_EXP_HI));
+    __m256i n = _mm256_cvtps_epi32(_mm256_mul_ps(x, _mm256_set1_ps(NN_LOG2E)));
+    __m256 fx = _mm256_cvtepi32_ps(n);
+    x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(NN_EXP_C1), x);
+    x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(NN_EXP_C2), x);
+
+    __m256 y = _mm256_set1_ps(NN_EXP_P0);
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(NN_EXP_P1));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(NN_EXP_P2));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(NN_EXP_P3));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(NN_EXP_P4));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(NN_EXP_P5));
+    y = _mm256_fmadd_ps(y, _mm256_mul_ps(x, x), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+
+    __m256i e = _mm256_slli_epi32(_mm256_add_epi32(n, _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(e));
+}
+
+__attribute__((target("avx2,fma"))) static void nn_gemm_kernel_avx2(size_t kc, const float *pa, const float *pb,
+                                                                   float *c, size_t ldc, int accumulate,
+                                                                   const float *bias)
+{
+    __m256 acc[6][2];
+    for (size_t r = 0; r < 6; r++)
+    {
+        acc[r][0] = _mm256_setzero_ps();
+        acc[r][1] = _mm256_setzero_ps();
+    }
+
+    for (size_t p = 0; p < kc; p++)
+    {
+        __m256 b0 = _mm256_loadu_ps(pb + p * 16);
+        __m256 b1 = _mm256_loadu_ps(pb + p * 16 + 8);
+        for (size_t r = 0; r < 6; r++)
+        {
+            __m256 ar = _mm256_broadcast_ss(pa + p * 6 + r);
+            acc[r][0] = _mm256_fmadd_ps(ar, b0, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_ps(ar, b1, acc[r][1]);
+        }
+    }
+
+    if (bias != NULL)
+    {
+        __m256 bias0 = _mm256_loadu_ps(bias);
+        __m256 bias1 = _mm256_loadu_ps(bias + 8);
+        for (size_t r = 0; r < 6; r++)
+        {
+            acc[r][0] = _mm256_add_ps(acc[r][0], bias0);
+            acc[r][1] = _mm256_add_ps(acc[r][1], bias1);
+        }
+    }
+
+    for (size_t r = 0; r < 6; r++)
+    {
+        float *cr = c + r * ldc;
+        if (accumulate)
+        {
+            acc[r][0] = _mm256_add_ps(acc[r][0], _mm256_loadu_ps(cr));
+            acc[r][1] = _mm256_add_ps(acc[r][1], _mm256_loadu_ps(cr + 8));
+        }
+        _mm256_storeu_ps(cr, acc[r][0]);
+        _mm256_storeu_ps(cr + 8, acc[r][1]);
+    }
+}
+
+__attribute__((target("avx2,fma"))) static void nn_add_avx2(float *dst, const float *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), _mm256_loadu_ps(src + i)));
+    }
+    nn_add_sse2(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2,fma"))) static void nn_fill_avx2(float *dst, float val, size_t n)
+{
+    __m256 v = _mm256_set1_ps(val);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        _mm256_storeu_ps(dst + i, v);
+    }
+    nn_fill_sse2(dst + i, val, n - i);
+}
+
+__attribute__((target("avx2,fma"))) static void nn_axpy_avx2(float *dst, float alpha, const float *src, size_t n)
+{
+    __m256 a = _mm256_set1_ps(alpha);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        _mm256_storeu_ps(dst + i, _mm256_fmadd_ps(a, _mm256_loadu_ps(src + i), _mm256_loadu_ps(dst + i)));
+    }
+    nn_axpy_scalar(dst + i, alpha, src + i, n - i);
+}
+
+// Four accumulators to cover the FMA latency
+__attribute__((target("avx2,fma"))) static float nn_dot_avx2(const float *a, const float *b, size_t n)
+{
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+        acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16), acc2);
+        acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24), acc3);
+    }
+    for (; i + 8 <= n; i += 8)
+    {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    }
+    __m256 acc = _mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3));
+    __m128 h = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+    return _mm_cvtss_f32(_mm_add_ss(h, _mm_shuffle_ps(h, h, 1))) + nn_dot_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma"))) static void nn_relu_avx2(float *x, size_t n)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        _mm256_storeu_ps(x + i, _mm256_max_ps(_mm256_loadu_ps(x + i), zero));
+    }
+    nn_relu_sse2(x + i, n - i);
+}
+
+// Needs F16C on top of AVX2, which nn_kernels_select checks for separately
+__attribute__((target("avx2,fma,f16c"))) static void nn_cvt_f16_f16c(float *dst, const uint16_t *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(src + i))));
+    }
+    nn_cvt_f16_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2,fma"))) static void nn_cvt_bf16_avx2(float *dst, const uint16_t *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i w = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_castsi256_ps(_mm256_slli_epi32(w, 16)));
+    }
+    nn_cvt_bf16_sse2(dst + i, src + i, n - i);
+}
+
+// pmaddubsw multiplies the four input bytes broadcast to every column by that column's four
+// weights and adds adjacent pairs to int16 (at most 2 * 127 * 127, no saturation), pmaddwd
+// against ones finishes the four-way sum in int32
+__attribute__((target("avx2,fma"))) static inline __m256i nn_qdot_avx2(__m256i acc, __m256i a, const int8_t *b)
+{
+    __m256i p = _mm256_maddubs_epi16(a, _mm256_loadu_si256((const __m256i *)b));
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(p, _mm256_set1_epi16(1)));
+}
+
+__attribute__((target("avx2,fma"))) static void nn_qgemm_avx2(size_t m, size_t n, size_t k4, const uint8_t *a,
+                                                             const int8_t *b, int32_t *c)
+{
+    for (size_t i = 0; i < m; i++)
+    {
+        const uint8_t *ai = a + i * 4 * k4;
+        size_t j = 0;
+        for (; j + 32 <= n; j += 32)
+        {
+            __m256i c0 = _mm256_setzero_si256(), c1 = c0, c2 = c0, c3 = c0;
+            for (size_t p = 0; p < k4; p++)
+            {
+                int32_t quad;
+                memcpy(&quad, ai + 4 * p, sizeof(quad));
+                __m256i av = _mm256_set1_epi32(quad);
+                const int8_t *bp = b + (p * n + j) * 4;
+                c0 = nn_qdot_avx2(c0, av, bp);
+                c1 = nn_qdot_avx2(c1, av, bp + 32);
+                c2 = nn_qdot_avx2(c2, av, bp + 64);
+                c3 = nn_qdot_avx2(c3, av, bp + 96);
+            }
+            _mm256_storeu_si256((__m256i *)(c + i * n + j), c0);
+            _mm256_storeu_si256((__m256i *)(c + i * n + j + 8), c1);
+            _mm256_storeu_si256((__m256i *)(c + i * n + j + 16), c2);
+            _mm256_storeu_si256((__m256i *)(c + i * n + j + 24), c3);
+        }
+        for (; j < n; j += 8)
+        {
+            __m256i c0 = _mm256_setzero_si256();
+            for (size_t p = 0; p < k4; p++)
+            {
+                int32_t quad;
+                memcpy(&quad, ai + 4 * p, sizeof(quad));
+                c0 = nn_qdot_avx2(c0, _mm256_set1_epi32(quad), b + (p * n + j) * 4);
+            }
+            _mm256_storeu_si256((__m256i *)(c + i * n + j), c0);
+        }
+    }
+}
+
+// Every nonzero of a row scales one row of b into up to 32 columns of accumulators. A single
+// column (one sample) is a sparse dot product instead, gathering b at the nonzeros' columns.
+__attribute__((target("avx2,fma"))) static void nn_spmm_avx2(size_t m, size_t n, const uint32_t *row_ptr,
+                                                            const uint32_t *col, const float *val,
+                                                            const float *b, size_t ldb, float *c, size_t ldc)
+{
+    for (size_t i = 0; i < m; i++)
+    {
+        uint32_t p0 = row_ptr[i];
+        uint32_t p1 = row_ptr[i + 1];
+        float *ci = c + i * ldc;
+        if (n == 1 && ldb == 1)
+        {
+            __m256 acc = _mm256_setzero_ps();
+            uint32_t p = p0;
+            for (; p + 8 <= p1; p += 8)
+            {
+                __m256i idx = _mm256_loadu_si256((const __m256i *)(col + p));
+                acc = _mm256_fmadd_ps(_mm256_loadu_ps(val + p), _mm256_i32gather_ps(b, idx, 4), acc);
+            }
+            __m128 h = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+            h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+            float sum = _mm_cvtss_f32(_mm_add_ss(h, _mm_shuffle_ps(h, h, 1)));
+            for (; p < p1; p++)
+            {
+                sum += val[p] * b[col[p]];
+            }
+            ci[0] = sum;
+            continue;
+        }
+
+        size_t j = 0;
+        for (; j + 32 <= n; j += 32)
+        {
+            __m256 c0 = _mm256_setzero_ps(), c1 = c0, c2 = c0, c3 = c0;
+            for (uint32_t p = p0; p < p1; p++)
+            {
+                __m256 v = _mm256_set1_ps(val[p]);
+                const float *bp = b + col[p] * ldb + j;
+                c0 = _mm256_fmadd_ps(v, _mm256_loadu_ps(bp), c0);
+                c1 = _mm256_fmadd_ps(v, _mm256_loadu_ps(bp + 8), c1);
+                c2 = _mm256_fmadd_ps(v, _mm256_loadu_ps(bp + 16), c2);
+                c3 = _mm256_fmadd_ps(v, _mm256_loadu_ps(bp + 24), c3);
+            }
+            _mm256_storeu_ps(ci + j, c0);
+            _mm256_storeu_ps(ci + j + 8, c1);
+            _mm256_storeu_ps(ci + j + 16, c2);
+            _mm256_storeu_ps(ci + j + 24, c3);
+        }
+        for (; j + 8 <= n; j += 8)
+        {
+            __m256 c0 = _mm256_setzero_ps();
+            for (uint32_t p = p0; p < p1; p++)
+            {
+                c0 = _mm256_fmadd_ps(_mm256_set1_ps(val[p]), _mm256_loadu_ps(b + col[p] * ldb + j), c0);
+            }
+            _mm256_storeu_ps(ci + j, c0);
+        }
+        if (j < n)
+        {
+            nn_spmm_scalar(1, n - j, row_ptr + i, col, val, b + j, ldb, ci + j, ldc);
+        }
+    }
+}
+
+__attribute__((target("avx2,fma"))) static void nn_sigf_avx2(float *x, size_t n)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 e = nn_exp_avx2(_mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(x + i)));
+        _mm256_storeu_ps(x + i, _mm256_div_ps(one, _mm256_add_ps(one, e)));
+    }
+    if (i < n)
+    {
+        NN_TAIL(8, x + i, n - i, nn_sigf_avx2);
+    }
+}
+
+__attribute__((target("avx2,fma"))) static inline __m256 nn_exp2_fast_avx2(__m256 t, int fastest)
+{
+    t = _mm256_min_ps(_mm256_max_ps(t, _mm256_set1_ps(-NN_SIGF_T_MAX)), _mm256_set1_ps(NN_SIGF_T_MAX));
+    __m256 fl = _mm256_floor_ps(t);
+    __m256 f = _mm256_sub_ps(t, fl);
+
+    __m256 p;
+    if (fastest)
+    {
+        p = _mm256_fmadd_ps(f, _mm256_set1_ps(NN_SIGF_F2_2), _mm256_set1_ps(NN_SIGF_F2_1));
+    }
+    else
+    {
+        p = _mm256_fmadd_ps(f, _mm256_set1_ps(NN_SIGF_F3_3), _mm256_set1_ps(NN_SIGF_F3_2));
+        p = _mm256_fmadd_ps(f, p, _mm256_set1_ps(NN_SIGF_F3_1));
+    }
+    p = _mm256_fmadd_ps(f, p, _mm256_set1_ps(1.0f));
+
+    __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(fl), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+__attribute__((target("avx2,fma"))) static inline size_t nn_sigf_poly_avx2(float *x, size_t n, int fastest)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 nlog2e = _mm256_set1_ps(-NN_SIGF_LOG2E);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 d = _mm256_add_ps(one, nn_exp2_fast_avx2(_mm256_mul_ps(_mm256_loadu_ps(x + i), nlog2e), fastest));
+        _mm256_storeu_ps(x + i, fastest ? _mm256_rcp_ps(d) : _mm256_div_ps(one, d));
+    }
+    return i;
+}
+
+__attribute__((target("avx2,fma"))) static void nn_sigf_fast_avx2(float *x, size_t n)
+{
+    size_t i = nn_sigf_poly_avx2(x, n, 0);
+    if (i < n)
+    {
+        NN_TAIL(8, x + i, n - i, nn_sigf_fast_avx2);
+    }
+}
+
+__attribute__((target("avx2,fma"))) static void nn_sigf_fastest_avx2(float *x, size_t n)
+{
+    size_t i = nn_sigf_poly_avx2(x, n, 1);
+    if (i < n)
+    {
+        NN_TAIL(8, x + i, n - i, nn_sigf_fastest_avx2);
+    }
+}
+
+__attribute__((target("avx2,fma"))) static void nn_sigf_table_avx2(float *x, size_t n)
+{
+    const __m256 range = _mm256_set1_ps(NN_SIGF_TABLE_RANGE);
+    const __m256 scale = _mm256_set1_ps(NN_SIGF_TABLE_SCALE);
+    const __m256 top = _mm256_set1_ps(NN_SIGF_TABLE_N - 1.0f / 1024.0f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        // max_ps returns its second operand for a NaN, which keeps the gather in range
+        __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(x + i), range), scale);
+        u = _mm256_min_ps(_mm256_max_ps(u, _mm256_setzero_ps()), top);
+        __m256i j = _mm256_cvttps_epi32(u);
+        __m256 f = _mm256_sub_ps(u, _mm256_cvtepi32_ps(j));
+        __m256 a = _mm256_i32gather_ps(nn_sigf_table, j, 4);
+        __m256 b = _mm256_i32gather_ps(nn_sigf_table + 1, j, 4);
+        _mm256_storeu_ps(x + i, _mm256_fmadd_ps(f, _mm256_sub_ps(b, a), a));
+    }
+    nn_sigf_table_scalar(x + i, n - i);
+}
+
+__attribute__((target("avx2,fma"))) static void nn_dsigf_avx2(float *d, const float *a, size_t n)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 av = _mm256_loadu_ps(a + i);
+        _mm256_storeu_ps(d + i, _mm256_mul_ps(_mm256_loadu_ps(d + i), _mm256_mul_ps(av, _mm256_sub_ps(one, av))));
+    }
+    nn_dsigf_sse2(d + i, a + i, n - i);
+}
+
+__attribute__((target("avx2,fma"))) static void nn_optimize_avx2(float *w, const float *g, float *m, float *v,
+                                                                size_t n, const OptimizerStep *st)
+{
+    const __m256 rate = _mm256_set1_ps(st->rate);
+    const __m256 scale = _mm256_set1_ps(st->scale);
+    const __m256 mu = _mm256_set1_ps(st->momentum);
+    const __m256 b1 = _mm256_set1_ps(st->beta1);
+    const __m256 b2 = _mm256_set1_ps(st->beta2);
+    const __m256 nb1 = _mm256_set1_ps(1.0f - st->beta1);
+    const __m256 nb2 = _mm256_set1_ps(1.0f - st->beta2);
+    const __m256 eps = _mm256_set1_ps(st->eps);
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 gi = _mm256_mul_ps(scale, _mm256_loadu_ps(g + i));
+        __m256 wi = _mm256_loadu_ps(w + i);
+        __m256 mi, vi;
+        switch (st->kind)
+        {
+        case NN_OPT_SGD:
+            wi = _mm256_fnmadd_ps(rate, gi, wi);
+            break;
+        case NN_OPT_MOMENTUM:
+            mi = _mm256_fmadd_ps(mu, _mm256_loadu_ps(m + i), gi);
+            _mm256_storeu_ps(m + i, mi);
+            wi = _mm256_fnmadd_ps(rate, mi, wi);
+            break;
+        case NN_OPT_NESTEROV:
+            mi = _mm256_fmadd_ps(mu, _mm256_loadu_ps(m + i), gi);
+            _mm256_storeu_ps(m + i, mi);
+            wi = _mm256_fnmadd_ps(rate, _mm256_fmadd_ps(mu, mi, gi), wi);
+            break;
+        case NN_OPT_RMSPROP:
+            vi = _mm256_fmadd_ps(b2, _mm256_loadu_ps(v + i), _mm256_mul_ps(nb2, _mm256_mul_ps(gi, gi)));
+            _mm256_storeu_ps(v + i, vi);
+            wi = _mm256_fnmadd_ps(rate, _mm256_div_ps(gi, _mm256_add_ps(_mm256_sqrt_ps(vi), eps)), wi);
+            break;
+        case NN_OPT_ADAM:
+            mi = _mm256_fmadd_ps(b1, _mm256_loadu_ps(m + i), _mm256_mul_ps(nb1, gi));
+            vi = _mm256_fmadd_ps(b2, _mm256_loadu_ps(v + i), _mm256_mul_ps(nb2, _mm256_mul_ps(gi, gi)));
+            _mm256_storeu_ps(m + i, mi);
+            _mm256_storeu_ps(v + i, vi);
+            wi = _mm256_fnmadd_ps(rate, _mm256_div_ps(mi, _mm256_add_ps(_mm256_sqrt_ps(vi), eps)), wi);
+            break;
+        }
+        _mm256_storeu_ps(w + i, wi);
+    }
+
+    nn_optimize_scalar(w + i, g + i, m ? m + i : NULL, v ? v + i : NULL, n - i, st);
+}
+
+// AVX-512
+
+__attribute__((target("avx512f"))) static inline __m512 nn_exp_avx512(__m512 x)
+{
+    x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(NN_EXP_LO)), _mm512_set1_ps(NN_EXP_HI));
+    __m512i n = _mm512_cvtps_epi32(_mm512_mul_ps(x, _mm512_set1_ps(NN_LOG2E)));
+    __m512 fx = _mm512_cvtepi32_ps(n);
+    x = _mm512_fnmadd_ps(fx, _mm512_set1_ps(NN_EXP_C1), x);
+    x = _mm512_fnmadd_ps(fx, _mm512_set1_ps(NN_EXP_C2), x);
+
+    __m512 y = _mm512_set1_ps(NN_EXP_P0);
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(NN_EXP_P1));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(NN_EXP_P2));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(NN_EXP_P3));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(NN_EXP_P4));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(NN_EXP_P5));
+    y = _mm512_fmadd_ps(y, _mm512_mul_ps(x, x), _mm512_add_ps(x, _mm512_set1_ps(1.0f)));
+
+    __m512i e = _mm512_slli_epi32(_mm512_add_epi32(n, _mm512_set1_epi32(127)), 23);
+    return _mm512_mul_ps(y, _mm512_castsi512_ps(e));
+}
+
+__attribute__((target("avx512f"))) static void nn_gemm_kernel_avx512(size_t kc, const float *pa, const float *pb,
+                                                                    float *c, size_t ldc, int accumulate,
+                                                                    const float *bias)
+{
+    __m512 acc[8][2];
+    for (size_t r = 0; r < 8; r++)
+    {
+        acc[r][0] = _mm512_setzero_ps();
+        acc[r][1] = _mm512_setzero_ps();
+    }
+
+    for (size_t p = 0; p < kc; p++)
+    {
+        __m512 b0 = _mm512_loadu_ps(pb + p * 32);
+        __m512 b1 = _mm512_loadu_ps(pb + p * 32 + 16);
+        for (size_t r = 0; r < 8; r++)
+        {
+            __m512 ar = _mm512_set1_ps(pa[p * 8 + r]);
+            acc[r][0] = _mm512_fmadd_ps(ar, b0, acc[r][0]);
+            acc[r][1] = _mm512_fmadd_ps(ar, b1, acc[r][1]);
+        }
+    }
+
+    if (bias != NULL)
+    {
+        __m512 bias0 = _mm512_loadu_ps(bias);
+        __m512 bias1 = _mm512_loadu_ps(bias + 16);
+        for (size_t r = 0; r < 8; r++)
+        {
+            acc[r][0] = _mm512_add_ps(acc[r][0], bias0);
+            acc[r][1] = _mm512_add_ps(acc[r][1], bias1);
+        }
+    }
+
+    for (size_t r = 0; r < 8; r++)
+    {
+        float *cr = c + r * ldc;
+        if (accumulate)
+        {
+            acc[r][0] = _mm512_add_ps(acc[r][0], _mm512_loadu_ps(cr));
+            acc[r][1] = _mm512_add_ps(acc[r][1], _mm512_loadu_ps(cr + 16));
+        }
+        _mm512_storeu_ps(cr, acc[r][0]);
+        _mm512_storeu_ps(cr + 16, acc[r][1]);
+    }
+}
+
+__attribute__((target("avx512f"))) static void nn_add_avx512(float *dst, const float *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        _mm512_storeu_ps(dst + i, _mm512_add_ps(_mm512_loadu_ps(dst + i), _mm512_loadu_ps(src + i)));
+    }
+    __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_ps(dst + i, m, _mm512_add_ps(_mm512_maskz_loadu_ps(m, dst + i), _mm512_maskz_loadu_ps(m, src + i)));
+}
+
+__attribute__((target("avx512f"))) static void nn_fill_avx512(float *dst, float val, size_t n)
+{
+    __m512 v = _mm512_set1_ps(val);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        _mm512_storeu_ps(dst + i, v);
+    }
+    _mm512_mask_storeu_ps(dst + i, (__mmask16)((1u << (n - i)) - 1), v);
+}
+
+__attribute__((target("avx512f"))) static void nn_axpy_avx512(float *dst, float alpha, const float *src, size_t n)
+{
+    __m512 a = _mm512_set1_ps(alpha);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        _mm512_storeu_ps(dst + i, _mm512_fmadd_ps(a, _mm512_loadu_ps(src + i), _mm512_loadu_ps(dst + i)));
+    }
+    __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_ps(dst + i, m, _mm512_fmadd_ps(a, _mm512_maskz_loadu_ps(m, src + i), _mm512_maskz_loadu_ps(m, dst + i)));
+}
+
+__attribute__((target("avx512f"))) static float nn_dot_avx512(const float *a, const float *b, size_t n)
+{
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64)
+    {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+        acc2 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 32), _mm512_loadu_ps(b + i + 32), acc2);
+        acc3 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 48), _mm512_loadu_ps(b + i + 48), acc3);
+    }
+    for (; i + 16 <= n; i += 16)
+    {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+    }
+    __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+    acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i), acc1);
+    return _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(acc0, acc1), _mm512_add_ps(acc2, acc3)));
+}
+
+__attribute__((target("avx512f"))) static void nn_relu_avx512(float *x, size_t n)
+{
+    const __m512 zero = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        _mm512_storeu_ps(x + i, _mm512_max_ps(_mm512_loadu_ps(x + i), zero));
+    }
+    __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_ps(x + i, m, _mm512_max_ps(_mm512_maskz_loadu_ps(m, x + i), zero));
+}
+
+// Masked 16-bit loads need AVX-512BW, so the tails go to the AVX2 versions (every AVX-512F CPU has F16C)
+__attribute__((target("avx512f"))) static void nn_cvt_f16_avx512(float *dst, const uint16_t *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        _mm512_storeu_ps(dst + i, _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)(src + i))));
+    }
+    nn_cvt_f16_f16c(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static void nn_cvt_bf16_avx512(float *dst, const uint16_t *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m512i w = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(src + i)));
+        _mm512_storeu_ps(dst + i, _mm512_castsi512_ps(_mm512_slli_epi32(w, 16)));
+    }
+    nn_cvt_bf16_avx2(dst + i, src + i, n - i);
+}
+
+// vpdpbusd does the four multiplies and the int32 sum in one instruction
+__attribute__((target("avx512f,avx512vnni"))) static void nn_qgemm_vnni(size_t m, size_t n, size_t k4,
+                                                                       const uint8_t *a, const int8_t *b, int32_t *c)
+{
+    for (size_t i = 0; i < m; i++)
+    {
+        const uint8_t *ai = a + i * 4 * k4;
+        size_t j = 0;
+        for (; j + 64 <= n; j += 64)
+        {
+            __m512i c0 = _mm512_setzero_si512(), c1 = c0, c2 = c0, c3 = c0;
+            for (size_t p = 0; p < k4; p++)
+            {
+                int32_t quad;
+                memcpy(&quad, ai + 4 * p, sizeof(quad));
+                __m512i av = _mm512_set1_epi32(quad);
+                const int8_t *bp = b + (p * n + j) * 4;
+                c0 = _mm512_dpbusd_epi32(c0, av, _mm512_loadu_si512(bp));
+                c1 = _mm512_dpbusd_epi32(c1, av, _mm512_loadu_si512(bp + 64));
+                c2 = _mm512_dpbusd_epi32(c2, av, _mm512_loadu_si512(bp + 128));
+                c3 = _mm512_dpbusd_epi32(c3, av, _mm512_loadu_si512(bp + 192));
+            }
+            _mm512_storeu_si512(c + i * n + j, c0);
+            _mm512_storeu_si512(c + i * n + j + 16, c1);
+            _mm512_storeu_si512(c + i * n + j + 32, c2);
+            _mm512_storeu_si512(c + i * n + j + 48, c3);
+        }
+        for (; j < n; j += 16)
+        {
+            __m512i c0 = _mm512_setzero_si512();
+            for (size_t p = 0; p < k4; p++)
+            {
+                int32_t quad;
+                memcpy(&quad, ai + 4 * p, sizeof(quad));
+                c0 = _mm512_dpbusd_epi32(c0, _mm512_set1_epi32(quad), _mm512_loadu_si512(b + (p * n + j) * 4));
+            }
+            _mm512_storeu_si512(c + i * n + j, c0);
+        }
+    }
+}
+
+__attribute__((target("avx512f"))) static void nn_spmm_avx512(size_t m, size_t n, const uint32_t *row_ptr,
+                                                             const uint32_t *col, const float *val,
+                                                             const float *b, size_t ldb, float *c, size_t ldc)
+{
+    for (size_t i = 0; i < m; i++)
+    {
+        uint32_t p0 = row_ptr[i];
+        uint32_t p1 = row_ptr[i + 1];
+        float *ci = c + i * ldc;
+        if (n == 1 && ldb == 1)
+        {
+            __m512 acc = _mm512_setzero_ps();
+            uint32_t p = p0;
+            for (; p + 16 <= p1; p += 16)
+            {
+                __m512i idx = _mm512_loadu_si512(col + p);
+                acc = _mm512_fmadd_ps(_mm512_loadu_ps(val + p), _mm512_i32gather_ps(idx, b, 4), acc);
+            }
+            __mmask16 k = (__mmask16)((1u << (p1 - p)) - 1);
+            __m512i idx = _mm512_maskz_loadu_epi32(k, col + p);
+            acc = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(k, val + p),
+                                  _mm512_mask_i32gather_ps(_mm512_setzero_ps(), k, idx, b, 4), acc);
+            ci[0] = _mm512_reduce_add_ps(acc);
+            continue;
+        }
+
+        size_t j = 0;
+        for (; j + 64 <= n; j += 64)
+        {
+            __m512 c0 = _mm512_setzero_ps(), c1 = c0, c2 = c0, c3 = c0;
+            for (uint32_t p = p0; p < p1; p++)
+            {
+                __m512 v = _mm512_set1_ps(val[p]);
+                const float *bp = b + col[p] * ldb + j;
+                c0 = _mm512_fmadd_ps(v, _mm512_loadu_ps(bp), c0);
+                c1 = _mm512_fmadd_ps(v, _mm512_loadu_ps(bp + 16), c1);
+                c2 = _mm512_fmadd_ps(v, _mm512_loadu_ps(bp + 32), c2);
+                c3 = _mm512_fmadd_ps(v, _mm512_loadu_ps(bp + 48), c3);
+            }
+            _mm512_storeu_ps(ci + j, c0);
+            _mm512_storeu_ps(ci + j + 16, c1);
+            _mm512_storeu_ps(ci + j + 32, c2);
+            _mm512_storeu_ps(ci + j + 48, c3);
+        }
+        for (; j < n; j += 16)
+        {
+            __mmask16 k = n - j >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << (n - j)) - 1);
+            __m512 c0 = _mm512_setzero_ps();
+            for (uint32_t p = p0; p < p1; p++)
+            {
+                c0 = _mm512_fmadd_ps(_mm512_set1_ps(val[p]), _mm512_maskz_loadu_ps(k, b + col[p] * ldb + j), c0);
+            }
+            _mm512_mask_storeu_ps(ci + j, k, c0);
+        }
+    }
+}
+
+__attribute__((target("avx512f"))) static inline __m512 nn_sigf16_avx512(__m512 x)
+{
+    const __m512 one = _mm512_set1_ps(1.0f);
+    return _mm512_div_ps(one, _mm512_add_ps(one, nn_exp_avx512(_mm512_sub_ps(_mm512_setzero_ps(), x))));
+}
+
+__attribute__((target("avx512f"))) static void nn_sigf_avx512(float *x, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        _mm512_storeu_ps(x + i, nn_sigf16_avx512(_mm512_loadu_ps(x + i)));
+    }
+    __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_ps(x + i, m, nn_sigf16_avx512(_mm512_maskz_loadu_ps(m, x + i)));
+}
+
+__attribute__((target("avx512f"))) static inline __m512 nn_sigf16_poly_avx512(__m512 x, int fastest)
+{
+    const __m512 one = _mm512_set1_ps(1.0f);
+    __m512 t = _mm512_mul_ps(x, _mm512_set1_ps(-NN_SIGF_LOG2E));
+    t = _mm512_min_ps(_mm512_max_ps(t, _mm512_set1_ps(-NN_SIGF_T_MAX)), _mm512_set1_ps(NN_SIGF_T_MAX));
+    __m512 fl = _mm512_roundscale_ps(t, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    __m512 f = _mm512_sub_ps(t, fl);
+
+    __m512 p;
+    if (fastest)
+    {
+        p = _mm512_fmadd_ps(f, _mm512_set1_ps(NN_SIGF_F2_2), _mm512_set1_ps(NN_SIGF_F2_1));
+    }
+    else
+    {
+        p = _mm512_fmadd_ps(f, _mm512_set1_ps(NN_SIGF_F3_3), _mm512_set1_ps(NN_SIGF_F3_2));
+        p = _mm512_fmadd_ps(f, p, _mm512_set1_ps(NN_SIGF_F3_1));
+    }
+    p = _mm512_fmadd_ps(f, p, one);
+
+    // scalef does p * 2^fl without building the exponent by hand
+    __m512 d = _mm512_add_ps(one, _mm512_scalef_ps(p, fl));
+    return fastest ? _mm512_rcp14_ps(d) : _mm512_div_ps(one, d);
+}
+
+__attribute__((target("avx512f"))) static void nn_sigf_fast_avx512(float *x, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        _mm512_storeu_ps(x + i, nn_sigf16_poly_avx512(_mm512_loadu_ps(x + i), 0));
+    }
+    __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_ps(x + i, m, nn_sigf16_poly_avx512(_mm512_maskz_loadu_ps(m, x + i), 0));
+}
+
+__attribute__((target("avx512f"))) static void nn_sigf_fastest_avx512(float *x, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        _mm512_storeu_ps(x + i, nn_sigf16_poly_avx512(_mm512_loadu_ps(x + i), 1));
+    }
+    __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_ps(x + i, m, nn_sigf16_poly_avx512(_mm512_maskz_loadu_ps(m, x + i), 1));
+}
+
+__attribute__((target("avx512f"))) static inline __m512 nn_sigf16_table_avx512(__m512 x)
+{
+    __m512 u = _mm512_mul_ps(_mm512_add_ps(x, _mm512_set1_ps(NN_SIGF_TABLE_RANGE)), _mm512_set1_ps(NN_SIGF_TABLE_SCALE));
+    u = _mm512_min_ps(_mm512_max_ps(u, _mm512_setzero_ps()), _mm512_set1_ps(NN_SIGF_TABLE_N - 1.0f / 1024.0f));
+    __m512i j = _mm512_cvttps_epi32(u);
+    __m512 f = _mm512_sub_ps(u, _mm512_cvtepi32_ps(j));
+    __m512 a = _mm512_i32gather_ps(j, nn_sigf_table, 4);
+    __m512 b = _mm512_i32gather_ps(j, nn_sigf_table + 1, 4);
+    return _mm512_fmadd_ps(f, _mm512_sub_ps(b, a), a);
+}
+
+__attribute__((target("avx512f"))) static void nn_sigf_table_avx512(float *x, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        _mm512_storeu_ps(x + i, nn_sigf16_table_avx512(_mm512_loadu_ps(x + i)));
+    }
+    __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_ps(x + i, m, nn_sigf16_table_avx512(_mm512_maskz_loadu_ps(m, x + i)));
+}
+
+__attribute__((target("avx512f"))) static void nn_dsigf_avx512(float *d, const float *a, size_t n)
+{
+    const __m512 one = _mm512_set1_ps(1.0f);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m512 av = _mm512_loadu_ps(a + i);
+        _mm512_storeu_ps(d + i, _mm512_mul_ps(_mm512_loadu_ps(d + i), _mm512_mul_ps(av, _mm512_sub_ps(one, av))));
+    }
+    __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+    __m512 av = _mm512_maskz_loadu_ps(m, a + i);
+    _mm512_mask_storeu_ps(d + i, m, _mm512_mul_ps(_mm512_maskz_loadu_ps(m, d + i), _mm512_mul_ps(av, _mm512_sub_ps(one, av))));
+}
+
+__attribute__((target("avx512f"))) static void nn_optimize_avx512(float *w, const float *g, float *m, float *v,
+                                                                 size_t n, const OptimizerStep *st)
+{
+    const __m512 rate = _mm512_set1_ps(st->rate);
+    const __m512 scale = _mm512_set1_ps(st->scale);
+    const __m512 mu = _mm512_set1_ps(st->momentum);
+    const __m512 b1 = _mm512_set1_ps(st->beta1);
+    const __m512 b2 = _mm512_set1_ps(st->beta2);
+    const __m512 nb1 = _mm512_set1_ps(1.0f - st->beta1);
+    const __m512 nb2 = _mm512_set1_ps(1.0f - st->beta2);
+    const __m512 eps = _mm512_set1_ps(st->eps);
+
+    for (size_t i = 0; i < n; i += 16)
+    {
+        __mmask16 k = n - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+        __m512 gi = _mm512_mul_ps(scale, _mm512_maskz_loadu_ps(k, g + i));
+        __m512 wi = _mm512_maskz_loadu_ps(k, w + i);
+        __m512 mi, vi;
+        switch (st->kind)
+        {
+        case NN_OPT_SGD:
+            wi = _mm512_fnmadd_ps(rate, gi, wi);
+            break;
+        case NN_OPT_MOMENTUM:
+            mi = _mm512_fmadd_ps(mu, _mm512_maskz_loadu_ps(k, m + i), gi);
+            _mm512_mask_storeu_ps(m + i, k, mi);
+            wi = _mm512_fnmadd_ps(rate, mi, wi);
+            break;
+        case NN_OPT_NESTEROV:
+            mi = _mm512_fmadd_ps(mu, _mm512_maskz_loadu_ps(k, m + i), gi);
+            _mm512_mask_storeu_ps(m + i, k, mi);
+            wi = _mm512_fnmadd_ps(rate, _mm512_fmadd_ps(mu, mi, gi), wi);
+            break;
+        case NN_OPT_RMSPROP:
+            vi = _mm512_fmadd_ps(b2, _mm512_maskz_loadu_ps(k, v + i), _mm512_mul_ps(nb2, _mm512_mul_ps(gi, gi)));
+            _mm512_mask_storeu_ps(v + i, k, vi);
+            wi = _mm512_fnmadd_ps(rate, _mm512_div_ps(gi, _mm512_add_ps(_mm512_sqrt_ps(vi), eps)), wi);
+            break;
+        case NN_OPT_ADAM:
+            mi = _mm512_fmadd_ps(b1, _mm512_maskz_loadu_ps(k, m + i), _mm512_mul_ps(nb1, gi));
+            vi = _mm512_fmadd_ps(b2, _mm512_maskz_loadu_ps(k, v + i), _mm512_mul_ps(nb2, _mm512_mul_ps(gi, gi)));
+            _mm512_mask_storeu_ps(m + i, k, mi);
+            _mm512_mask_storeu_ps(v + i, k, vi);
+            wi = _mm512_fnmadd_ps(rate, _mm512_div_ps(mi, _mm512_add_ps(_mm512_sqrt_ps(vi), eps)), wi);
+            break;
+        }
+        _mm512_mask_storeu_ps(w + i, k, wi);
+    }
+}
+#endif // NN_X86
+
+#define NN_KERNELS_SCALAR                     \
+    {                                         \
+        .isa = NN_ISA_SCALAR,                 \
+        .name = "scalar",                     \
+        .mr = NN_GEMM_MR,                     \
+        .nr = NN_GEMM_NR,                     \
+        .gemm_kernel = nn_gemm_kernel_scalar, \
+        .add = nn_add_scalar,                 \
+        .fill = nn_fill_scalar,               \
+        .axpy = nn_axpy_scalar,               \
+        .dot = nn_dot_scalar,                 \
+        .sigf = nn_sigf_scalar,               \
+        .sigf_mode = NN_SIGF_EXACT,           \
+        .relu = nn_relu_scalar,               \
+        .tanh = nn_tanh_scalar,               \
+        .dsigf = nn_dsigf_scalar,             \
+        .cvt_f16 = nn_cvt_f16_scalar,         \
+        .cvt_bf16 = nn_cvt_bf16_scalar,       \
+        .qgemm = nn_qgemm_scalar,             \
+        .spmm = nn_spmm_scalar,               \
+        .optimize = nn_optimize_scalar,       \
+    }
+
+NnKernels nn_kernels = NN_KERNELS_SCALAR;
+
+NnIsa nn_cpu_isa(void)
+{
+#ifdef NN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return NN_ISA_AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return NN_ISA_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return NN_ISA_SSE2;
+#endif
+    return NN_ISA_SCALAR;
+}
+
+// Sigmoid variants per level, indexed by SigfMode. SSE2 has no gather, so its table mode stays scalar.
+typedef void (*NnSigfKernel)(float *x, size_t n);
+
+static const NnSigfKernel nn_sigf_modes_scalar[] = {
+    nn_sigf_scalar, nn_sigf_fast_scalar, nn_sigf_fastest_scalar, nn_sigf_table_scalar};
+#ifdef NN_X86
+static const NnSigfKernel nn_sigf_modes_sse2[] = {
+    nn_sigf_sse2, nn_sigf_fast_sse2, nn_sigf_fastest_sse2, nn_sigf_table_scalar};
+static const NnSigfKernel nn_sigf_modes_avx2[] = {
+    nn_sigf_avx2, nn_sigf_fast_avx2, nn_sigf_fastest_avx2, nn_sigf_table_avx2};
+static const NnSigfKernel nn_sigf_modes_avx512[] = {
+    nn_sigf_avx512, nn_sigf_fast_avx512, nn_sigf_fastest_avx512, nn_sigf_table_avx512};
+#endif
+
+// Selects the kernels for isa, or for the best level the CPU has if that is lower.
+// The sigmoid mode carries over from the current table.
+void nn_kernels_select(NnIsa isa)
+{
+    NnIsa best = nn_cpu_isa();
+    if (isa > best)
+    {
+        isa = best;
+    }
+
+    SigfMode mode = nn_kernels.sigf_mode;
+    if (mode == NN_SIGF_TABLE && nn_sigf_table[NN_SIGF_TABLE_N] == 0.0f)
+    {
+        nn_sigf_table_init();
+    }
+
+    // Each level starts from the one below, so a slot without a wider version keeps the narrower one
+    NnKernels k = NN_KERNELS_SCALAR;
+    k.sigf = nn_sigf_modes_scalar[mode];
+    k.sigf_mode = mode;
+#ifdef NN_X86
+    if (isa >= NN_ISA_SSE2)
+    {
+        k.isa = NN_ISA_SSE2;
+        k.name = "sse2";
+        k.mr = 4;
+        k.nr = 8;
+        k.gemm_kernel = nn_gemm_kernel_sse2;
+        k.add = nn_add_sse2;
+        k.fill = nn_fill_sse2;
+        k.axpy = nn_axpy_sse2;
+        k.dot = nn_dot_sse2;
+        k.sigf = nn_sigf_modes_sse2[mode];
+        k.relu = nn_relu_sse2;
+        k.tanh = nn_tanh_sigf;
+        k.dsigf = nn_dsigf_sse2;
+        k.cvt_bf16 = nn_cvt_bf16_sse2;
+    }
+    if (isa >= NN_ISA_AVX2)
+    {
+        k.isa = NN_ISA_AVX2;
+        k.name = "avx2";
+        k.mr = 6;
+        k.nr = 16;
+        k.gemm_kernel = nn_gemm_kernel_avx2;
+        k.add = nn_add_avx2;
+        k.fill = nn_fill_avx2;
+        k.axpy = nn_axpy_avx2;
+        k.dot = nn_dot_avx2;
+        k.sigf = nn_sigf_modes_avx2[mode];
+        k.relu = nn_relu_avx2;
+        k.dsigf = nn_dsigf_avx2;
+        k.optimize = nn_optimize_avx2;
+        k.cvt_bf16 = nn_cvt_bf16_avx2;
+        k.qgemm = nn_qgemm_avx2;
+        k.spmm = nn_spmm_avx2;
+        if (__builtin_cpu_supports("f16c"))
+        {
+            k.cvt_f16 = nn_cvt_f16_f16c;
+        }
+    }
+    if (isa >= NN_ISA_AVX512)
+    {
+        k.isa = NN_ISA_AVX512;
+        k.name = "avx512";
+        k.mr = 8;
+        k.nr = 32;
+        k.gemm_kernel = nn_gemm_kernel_avx512;
+        k.add = nn_add_avx512;
+        k.fill = nn_fill_avx512;
+        k.axpy = nn_axpy_avx512;
+        k.dot = nn_dot_avx512;
+        k.sigf = nn_sigf_modes_avx512[mode];
+        k.relu = nn_relu_avx512;
+        k.dsigf = nn_dsigf_avx512;
+        k.optimize = nn_optimize_avx512;
+        k.cvt_f16 = nn_cvt_f16_avx512;
+        k.cvt_bf16 = nn_cvt_bf16_avx512;
+        k.spmm = nn_spmm_avx512;
+        if (__builtin_cpu_supports("avx512vnni"))
+        {
+            k.qgemm = nn_qgemm_vnni;
+        }
+    }
+#endif
+    nn_kernels = k;
+}
+
+// Switches mat_sigf and the forward pass to the given accuracy mode. Like nn_kernels_select,
+// this is a global setting: call it before any thread is running kernels.
+void nn_sigf_mode(SigfMode mode)
+{
+    nn_kernels.sigf_mode = mode;
+    nn_kernels_select(nn_kernels.isa);
+}
+
+static float nn_sigf_batch_error(const float *in, float *out, size_t n, float max_err)
+{
+    memcpy(out, in, n * sizeof(float));
+    nn_kernels.sigf(out, n);
+    for (size_t i = 0; i < n; i++)
+    {
+        float err = fabsf(out[i] - sigf(in[i]));
+        if (err > max_err)
+        {
+            max_err = err;
+        }
+    }
+    return max_err;
+}
+
+// Max absolute difference between the sigmoid kernel in mode and sigf(), over every step-th
+// float bit pattern (step 1 is exhaustive). NaN and infinity are skipped.
+float nn_sigf_max_error(SigfMode mode, uint32_t step)
+{
+    SigfMode saved = nn_kernels.sigf_mode;
+    nn_sigf_mode(mode);
+
+    float in[1024];
+    float out[1024];
+    float max_err = 0.0f;
+    size_t n = 0;
+    for (uint64_t bits = 0; bits <= UINT32_MAX; bits += step ? step : 1)
+    {
+        uint32_t b = (uint32_t)bits;
+        float x;
+        memcpy(&x, &b, sizeof(x));
+        if (!isfinite(x))
+        {
+            continue;
+        }
+        in[n++] = x;
+        if (n == ARRAY_LEN(in))
+        {
+            max_err = nn_sigf_batch_error(in, out, n, max_err);
+            n = 0;
+        }
+    }
+    max_err = nn_sigf_batch_error(in, out, n, max_err);
+
+    nn_sigf_mode(saved);
+    return max_err;
+}
+
+#ifdef __GNUC__
+__attribute__((constructor)) static void nn_kernels_init(void)
+{
+    nn_kernels_select(NN_ISA_AVX512);
+}
+#endif
+
+// True when rows follow each other with no gap, so the whole matrix is one flat run
+static int mat_contiguous(Matrix m)
+{
+    return m.stride == m.cols || m.rows <= 1;
+}
+
+static size_t nn_dtype_size(NnDtype dtype)
+{
+    return dtype == NN_DTYPE_F32 ? sizeof(float) : sizeof(uint16_t);
+}
+
+Matrix mat_alloc(size_t rows, size_t cols)
+{
+    return mat_alloc_dtype(rows, cols, NN_DTYPE_F32);
+}
+
+Matrix mat_alloc_dtype(size_t rows, size_t cols, NnDtype dtype)
+{
+    Matrix m;
+    m.rows = rows;
+    m.cols = cols;
+    m.stride = cols;
+    m.dtype = dtype;
+    m.data = malloc(rows * cols * nn_dtype_size(dtype));
+
+    assert(m.data != NULL);
+
+    return m;
+}
+
+static float mat_get(Matrix m, size_t i, size_t j)
+{
+    return m.dtype == NN_DTYPE_F32 ? MAT_AT(m, i, j) : nn_half_to_float(m.data16[i * m.stride + j], m.dtype);
+}
+
+// Copies src into dst (same shape), converting between their element types
+void mat_convert(Matrix dst, Matrix src)
+{
+    assert(dst.rows == src.rows);
+    assert(dst.cols == src.cols);
+
+    for (size_t i = 0; i < dst.rows; i++)
+    {
+        if (dst.dtype == NN_DTYPE_F32 && src.dtype != NN_DTYPE_F32)
+        {
+            const uint16_t *row = src.data16 + i * src.stride;
+            (src.dtype == NN_DTYPE_F16 ? nn_kernels.cvt_f16 : nn_kernels.cvt_bf16)(&MAT_AT(dst, i, 0), row, dst.cols);
+            continue;
+        }
+        for (size_t j = 0; j < dst.cols; j++)
+        {
+            float x = mat_get(src, i, j);
+            if (dst.dtype == NN_DTYPE_F32)
+            {
+                MAT_AT(dst, i, j) = x;
+            }
+            else
+            {
+                dst.data16[i * dst.stride + j] = nn_float_to_half(x, dst.dtype);
+            }
+        }
+    }
+}
+
+void mat_free(Matrix m)
+{
+    free(m.data);
+}
+
+void mat_print(Matrix m, char *name)
+{
+    printf("%s: [\n", name);
+    for (size_t i = 0; i < m.rows; i++)
+    {
+        for (size_t j = 0; j < m.cols; j++)
+        {
+            printf("    %f", mat_get(m, i, j));
+        }
+        printf("\n");
+    }
+    printf("]\n");
+}
+
+void mat_rand(Matrix m, float min, float max)
+{
+    for (size_t i = 0; i < m.rows; i++)
+    {
+        for (size_t j = 0; j < m.cols; j++)
+        {
+            MAT_AT(m, i, j) = rand_float() * (max - min) + min;
+        }
+    }
+}
+
+void mat_fill(Matrix m, float val)
+{
+    if (mat_contiguous(m))
+    {
+        nn_kernels.fill(m.data, val, m.rows * m.cols);
+        return;
+    }
+
+    for (size_t i = 0; i < m.rows; i++)
+    {
+        nn_kernels.fill(&MAT_AT(m, i, 0), val, m.cols);
+    }
+}
+
+void mat_cpy(Matrix dst, Matrix src)
+{
+    assert(dst.rows == src.rows);
+    assert(dst.cols == src.cols);
+
+    NN_TRACE_BEGIN(t0);
+    // memcpy already picks the widest moves the CPU has
+    if (mat_contiguous(dst) && mat_contiguous(src))
+    {
+        memcpy(dst.data, src.data, dst.rows * dst.cols * sizeof(*dst.data));
+    }
+    else
+    {
+        for (size_t i = 0; i < dst.rows; i++)
+        {
+            memcpy(&MAT_AT(dst, i, 0), &MAT_AT(src, i, 0), dst.cols * sizeof(*dst.data));
+        }
+    }
+    NN_TRACE_END(t0, NN_TRACE_COPY, -1, 0, 2 * dst.rows * dst.cols * sizeof(float));
+}
+
+Matrix mat_row(Matrix m, size_t row)
+{
+    return mat_rows(m, row, 1);
+}
+
+Matrix mat_rows(Matrix m, size_t row, size_t count)
+{
+    assert(row + count <= m.rows);
+
+    return (Matrix){
+        .rows = count,
+        .cols = m.cols,
+        .stride = m.stride,
+        .data = (float *)((char *)m.data + row * m.stride * nn_dtype_size(m.dtype)),
+        .dtype = m.dtype};
+}
+
+// A single-row a is broadcast over every row of dst
+void mat_sum(Matrix dst, Matrix a)
+{
+    assert(dst.rows == a.rows || a.rows == 1);
+    assert(dst.cols == a.cols);
+
+    NN_TRACE_BEGIN(t0);
+    if (dst.rows == a.rows && mat_contiguous(dst) && mat_contiguous(a))
+    {
+        nn_kernels.add(dst.data, a.data, dst.rows * dst.cols);
+    }
+    else
+    {
+        for (size_t i = 0; i < dst.rows; i++)
+        {
+            nn_kernels.add(&MAT_AT(dst, i, 0), &MAT_AT(a, a.rows == 1 ? 0 : i, 0), dst.cols);
+        }
+    }
+    NN_TRACE_END(t0, NN_TRACE_ADD, -1, dst.rows * dst.cols, 3 * dst.rows * dst.cols * sizeof(float));
+}
+
+// dst (1 x n) += the column sums of a (m x n)
+void mat_sum_cols(Matrix dst, Matrix a)
+{
+    assert(dst.rows == 1);
+    assert(dst.cols == a.cols);
+
+    for (size_t i = 0; i < a.rows; i++)
+    {
+        nn_kernels.add(dst.data, &MAT_AT(a, i, 0), a.cols);
+    }
+}
+
+// dst += alpha * src
+void mat_axpy(Matrix dst, float alpha, Matrix src)
+{
+    assert(dst.rows == src.rows);
+    assert(dst.cols == src.cols);
+
+    if (mat_contiguous(dst) && mat_contiguous(src))
+    {
+        nn_kernels.axpy(dst.data, alpha, src.data, dst.rows * dst.cols);
+        return;
+    }
+
+    for (size_t i = 0; i < dst.rows; i++)
+    {
+        nn_kernels.axpy(&MAT_AT(dst, i, 0), alpha, &MAT_AT(src, i, 0), dst.cols);
+    }
+}
+
+static size_t nn_min(size_t a, size_t b)
+{
+    return a < b ? a : b;
+}
+
+// Tasks a worker's deque holds; a full deque makes the producer run the range itself
+#define NN_POOL_DEQUE 256
+
+typedef struct
+{
+    NnRangeFn fn;
+    void *ctx;
+    atomic_size_t remaining; // ranges not finished yet
+} NnPoolJob;
+
+typedef struct
+{
+    NnPoolJob *job;
+    size_t begin;
+    size_t end;
+} NnPoolTask;
+
+// The owner pushes and pops at bottom, thieves take from top, so a worker runs its newest range
+// while the oldest, usually largest remaining piece of work goes to whoever steals
+typedef struct
+{
+    pthread_mutex_t lock;
+    size_t top;
+    size_t bottom;
+    pthread_t thread;
+    NnPoolTask tasks[NN_POOL_DEQUE];
+} NnPoolDeque;
+
+static struct
+{
+    size_t size;         // threads including the caller, 0 when shut down
+    NnPoolDeque *deques; // size - 1, one per worker
+    atomic_size_t queued;
+    atomic_size_t sleeping;
+    atomic_size_t next; // first deque of the next job's round robin
+    atomic_int stop;
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t wake;
+} nn_pool = {.sleep_lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER};
+
+static pthread_once_t nn_pool_once = PTHREAD_ONCE_INIT;
+static _Thread_local int nn_pool_inside; // set while running pool work: nested loops go inline
+
+static int nn_pool_push(NnPoolDeque *d, NnPoolTask task)
+{
+    pthread_mutex_lock(&d->lock);
+    int ok = d->bottom - d->top < NN_POOL_DEQUE;
+    if (ok)
+    {
+        d->tasks[d->bottom++ % NN_POOL_DEQUE] = task;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+static int nn_pool_take(NnPoolDeque *d, NnPoolTask *task, int own)
+{
+    pthread_mutex_lock(&d->lock);
+    int ok = d->bottom != d->top;
+    if (ok)
+    {
+        *task = own ? d->tasks[--d->bottom % NN_POOL_DEQUE] : d->tasks[d->top++ % NN_POOL_DEQUE];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+// Pops from deque self (none when self is the caller, size - 1), else steals from the next ones
+static int nn_pool_find(size_t self, NnPoolTask *task)
+{
+    size_t workers = nn_pool.size - 1;
+    if (atomic_load(&nn_pool.queued) == 0)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < workers; i++)
+    {
+        size_t w = (self + i) % workers;
+        if (nn_pool_take(&nn_pool.deques[w], task, w == self))
+        {
+            atomic_fetch_sub(&nn_pool.queued, 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void nn_pool_run(NnPoolTask task)
+{
+    task.job->fn(task.job->ctx, task.begin, task.end);
+    atomic_fetch_sub_explicit(&task.job->remaining, 1, memory_order_release);
+}
+
+static void *nn_pool_worker(void *arg)
+{
+    size_t self = (size_t)((NnPoolDeque *)arg - nn_pool.deques);
+    nn_pool_inside = 1;
+
+    for (;;)
+    {
+        NnPoolTask task;
+        if (nn_pool_find(self, &task))
+        {
+            nn_pool_run(task);
+            continue;
+        }
+
+        // Spin a little before sleeping: training loops issue jobs back to back
+        int busy = 0;
+        for (int spin = 0; spin < 2000 && !busy; spin++)
+        {
+            busy = atomic_load(&nn_pool.queued) > 0 || atomic_load(&nn_pool.stop);
+        }
+        if (!busy)
+        {
+            // sleeping is raised before queued is checked, and producers raise queued before
+            // reading sleeping, so one of the two sides always sees the other
+            pthread_mutex_lock(&nn_pool.sleep_lock);
+            atomic_fetch_add(&nn_pool.sleeping, 1);
+            while (atomic_load(&nn_pool.queued) == 0 && !atomic_load(&nn_pool.stop))
+            {
+                pthread_cond_wait(&nn_pool.wake, &nn_pool.sleep_lock);
+            }
+            atomic_fetch_sub(&nn_pool.sleeping, 1);
+            pthread_mutex_unlock(&nn_pool.sleep_lock);
+        }
+        if (atomic_load(&nn_pool.stop) && atomic_load(&nn_pool.queued) == 0)
+        {
+            return NULL;
+        }
+    }
+}
+
+// Stops the pool and joins its first started workers (all of them but after a failed start)
+static void nn_pool_destroy(size_t started)
+{
+    pthread_mutex_lock(&nn_pool.sleep_lock);
+    atomic_store(&nn_pool.stop, 1);
+    pthread_cond_broadcast(&nn_pool.wake);
+    pthread_mutex_unlock(&nn_pool.sleep_lock);
+
+    for (size_t i = 0; i < started; i++)
+    {
+        pthread_join(nn_pool.deques[i].thread, NULL);
+    }
+    for (size_t i = 0; i + 1 < nn_pool.size; i++)
+    {
+        pthread_mutex_destroy(&nn_pool.deques[i].lock);
+    }
+    free(nn_pool.deques);
+    nn_pool.deques = NULL;
+    nn_pool.size = 0;
+    atomic_store(&nn_pool.stop, 0);
+}
+
+void nn_pool_shutdown(void)
+{
+    if (nn_pool.size == 0)
+    {
+        return;
+    }
+    nn_pool_destroy(nn_pool.size - 1);
+}
+
+static void nn_pool_create(size_t num_threads)
+{
+    size_t size = num_threads == 0 ? nn_num_cpus() : num_threads;
+    for (;;)
+    {
+        nn_pool.deques = size > 1 ? calloc(size - 1, sizeof(*nn_pool.deques)) : NULL;
+        assert(size == 1 || nn_pool.deques != NULL);
+        nn_pool.size = size;
+
+        for (size_t i = 0; i + 1 < size; i++)
+        {
+            pthread_mutex_init(&nn_pool.deques[i].lock, NULL);
+        }
+        size_t started = 0;
+        while (started + 1 < size &&
+               pthread_create(&nn_pool.deques[started].thread, NULL, nn_pool_worker, &nn_pool.deques[started]) == 0)
+        {
+            started++;
+        }
+        if (started + 1 == size)
+        {
+            return;
+        }
+
+        // Out of threads: the running workers read nn_pool.size, so rather than shrinking it
+        // under them, wind them down and start over with as many as did start
+        nn_pool_destroy(started);
+        size = started + 1;
+    }
+}
+
+static void nn_pool_start(void)
+{
+    nn_pool_create(0);
+}
+
+static void nn_pool_claim(void)
+{
+}
+
+void nn_pool_init(size_t num_threads)
+{
+    // Use up the lazy start so it cannot replace this pool later
+    pthread_once(&nn_pool_once, nn_pool_claim);
+    nn_pool_shutdown();
+    nn_pool_create(num_threads);
+}
+
+size_t nn_pool_size(void)
+{
+    pthread_once(&nn_pool_once, nn_pool_start);
+    return nn_pool.size > 0 ? nn_pool.size : 1;
+}
+
+void nn_parallel_for(size_t begin, size_t end, size_t grain, NnRangeFn fn, void *ctx)
+{
+    if (begin >= end)
+    {
+        return;
+    }
+    size_t n = end - begin;
+    grain = grain > 0 ? grain : 1;
+    size_t threads = nn_pool_inside ? 1 : nn_pool_size();
+    if (threads <= 1 || n <= grain)
+    {
+        fn(ctx, begin, end);
+        return;
+    }
+
+    // A few ranges per thread so stealing can even out uneven ones
+    size_t chunks = nn_min((n + grain - 1) / grain, 4 * threads);
+    NnPoolJob job = {.fn = fn, .ctx = ctx, .remaining = chunks};
+    size_t workers = threads - 1;
+    size_t first = atomic_fetch_add(&nn_pool.next, 1);
+
+    nn_pool_inside = 1;
+    atomic_fetch_add(&nn_pool.queued, chunks - 1);
+    for (size_t c = 1; c < chunks; c++)
+    {
+        NnPoolTask task = {&job, begin + c * n / chunks, begin + (c + 1) * n / chunks};
+        if (!nn_pool_push(&nn_pool.deques[(first + c) % workers], task))
+        {
+            atomic_fetch_sub(&nn_pool.queued, 1);
+            nn_pool_run(task);
+        }
+    }
+    if (atomic_load(&nn_pool.sleeping) > 0)
+    {
+        pthread_mutex_lock(&nn_pool.sleep_lock);
+        pthread_cond_broadcast(&nn_pool.wake);
+        pthread_mutex_unlock(&nn_pool.sleep_lock);
+    }
+
+    // The caller keeps the first range, then helps with whatever is queued until the job is done
+    nn_pool_run((NnPoolTask){&job, begin, begin + n / chunks});
+    while (atomic_load_explicit(&job.remaining, memory_order_acquire) > 0)
+    {
+        NnPoolTask task;
+        if (nn_pool_find(workers, &task))
+        {
+            nn_pool_run(task);
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+    nn_pool_inside = 0;
+}
+
+// Copies an mc x kc block of a into mr-row panels, each stored k-major and zero padded
+static void nn_gemm_pack_a(float *dst, const float *a, size_t rsa, size_t csa, size_t mc, size_t kc, size_t mr)
+{
+    for (size_t i = 0; i < mc; i += mr)
+    {
+        size_t rows = nn_min(mr, mc - i);
+        for (size_t p = 0; p < kc; p++)
+        {
+            for (size_t r = 0; r < mr; r++)
+            {
+                *dst++ = r < rows ? a[(i + r) * rsa + p * csa] : 0.0f;
+            }
+        }
+    }
+}
+
+// Element index of b as float, whatever b stores
+static inline float nn_gemm_b_at(const void *b, NnDtype type, size_t index)
+{
+    return type == NN_DTYPE_F32 ? ((const float *)b)[index] : nn_half_to_float(((const uint16_t *)b)[index], type);
+}
+
+// Copies a kc x nc block of b into nr-column panels, each stored k-major and zero padded.
+// Half-precision b is widened here, so the micro-kernels only ever see floats.
+static void nn_gemm_pack_b(float *dst, const void *b, NnDtype type, size_t rsb, size_t csb, size_t kc, size_t nc,
+                           size_t nr)
+{
+    if (type == NN_DTYPE_F32)
+    {
+        const float *bf = b;
+        for (size_t j = 0; j < nc; j += nr)
+        {
+            size_t cols = nn_min(nr, nc - j);
+            for (size_t p = 0; p < kc; p++)
+            {
+                for (size_t c = 0; c < nr; c++)
+                {
+                    *dst++ = c < cols ? bf[p * rsb + (j + c) * csb] : 0.0f;
+                }
+            }
+        }
+        return;
+    }
+
+    void (*cvt)(float *, const uint16_t *, size_t) = type == NN_DTYPE_F16 ? nn_kernels.cvt_f16 : nn_kernels.cvt_bf16;
+    for (size_t j = 0; j < nc; j += nr)
+    {
+        size_t cols = nn_min(nr, nc - j);
+        for (size_t p = 0; p < kc; p++, dst += nr)
+        {
+            if (csb == 1)
+            {
+                cvt(dst, (const uint16_t *)b + p * rsb + j, cols);
+            }
+            else
+            {
+                for (size_t c = 0; c < cols; c++)
+                {
+                    dst[c] = nn_gemm_b_at(b, type, p * rsb + (j + c) * csb);
+                }
+            }
+            for (size_t c = cols; c < nr; c++)
+            {
+                dst[c] = 0.0f;
+            }
+        }
+    }
+}
+
+static void nn_activate(Activation act, float *x, size_t n)
+{
+    switch (act)
+    {
+    case NN_ACT_SIGMOID:
+        nn_kernels.sigf(x, n);
+        break;
+    case NN_ACT_RELU:
+        nn_kernels.relu(x, n);
+        break;
+    case NN_ACT_TANH:
+        nn_kernels.tanh(x, n);
+        break;
+    default:
+        break;
+    }
+}
+
+// Work nn_gemm does on each output tile once its last k block is in: the bias (n values, one
+// per column, or NULL) is added in registers by the micro-kernel, then the activation runs over
+// the tile while it is still in L1.
+typedef struct
+{
+    const float *bias;
+    Activation act;
+} NnEpilogue;
+
+// Unblocked product for the sizes where packing costs more than it saves. Always inlined so the
+// float call below gets its own copy with the element type folded out of the inner loop.
+__attribute__((always_inline)) static inline void nn_gemm_small(size_t m, size_t n, size_t k,
+                                                                const float *a, size_t rsa, size_t csa,
+                                                                const void *b, NnDtype b_type, size_t rsb, size_t csb,
+                                                                float *c, size_t ldc, int accumulate,
+                                                                const NnEpilogue *epi)
+{
+    for (size_t i = 0; i < m; i++)
+    {
+        for (size_t j = 0; j < n; j++)
+        {
+            float acc = accumulate ? c[i * ldc + j] : 0.0f;
+            if (epi != NULL && epi->bias != NULL)
+            {
+                acc += epi->bias[j];
+            }
+            for (size_t p = 0; p < k; p++)
+            {
+                acc += a[i * rsa + p * csa] * nn_gemm_b_at(b, b_type, p * rsb + j * csb);
+            }
+            c[i * ldc + j] = acc;
+        }
+        if (epi != NULL)
+        {
+            nn_activate(epi->act, c + i * ldc, n);
+        }
+    }
+}
+
+// Packing buffers, one of each kind per thread, grown on demand and freed when the thread exits,
+// so a GEMM does not pay an allocation. A buffer is checked out while in use: a GEMM nested in one
+// (a pool task the caller runs while it waits for its own) gets a buffer of its own from malloc.
+typedef struct
+{
+    float *data;
+    size_t cap;
+    int busy;
+} NnGemmScratch;
+
+enum { NN_GEMM_SCRATCH_A, NN_GEMM_SCRATCH_B, NN_GEMM_SCRATCH_COUNT };
+
+static _Thread_local NnGemmScratch nn_gemm_scratch[NN_GEMM_SCRATCH_COUNT];
+static pthread_key_t nn_gemm_scratch_key;
+static pthread_once_t nn_gemm_scratch_once = PTHREAD_ONCE_INIT;
+
+static void nn_gemm_scratch_release(void *arg)
+{
+    NnGemmScratch *scratch = arg;
+    for (size_t i = 0; i < NN_GEMM_SCRATCH_COUNT; i++)
+    {
+        free(scratch[i].data);
+        scratch[i] = (NnGemmScratch){0};
+    }
+}
+
+static void nn_gemm_scratch_key_init(void)
+{
+    pthread_key_create(&nn_gemm_scratch_key, nn_gemm_scratch_release);
+}
+
+static float *nn_gemm_scratch_take(int kind, size_t floats)
+{
+    NnGemmScratch *s = &nn_gemm_scratch[kind];
+    if (s->busy)
+    {
+        float *data = malloc(floats * sizeof(float));
+        assert(data != NULL);
+        return data;
+    }
+    if (s->cap < floats)
+    {
+        if (s->data == NULL)
+        {
+            // First buffer of this thread: have it freed on exit
+            pthread_once(&nn_gemm_scratch_once, nn_gemm_scratch_key_init);
+            pthread_setspecific(nn_gemm_scratch_key, nn_gemm_scratch);
+        }
+        free(s->data);
+        s->data = malloc(floats * sizeof(float));
+        assert(s->data != NULL);
+        s->cap = floats;
+    }
+    s->busy = 1;
+    return s->data;
+}
+
+static void nn_gemm_scratch_give(int kind, float *data)
+{
+    NnGemmScratch *s = &nn_gemm_scratch[kind];
+    if (data == s->data)
+    {
+        s->busy = 0;
+    }
+    else
+    {
+        free(data);
+    }
+}
+
+// One (jc, pc) step of nn_gemm over the packed b panel pb, cut into tasks for the thread pool:
+// task t packs mc-row block t / nb_j of a and computes its tiles in the (t % nb_j)-th run of
+// slivers nr-column slivers.
+typedef struct
+{
+    NnKernels kern;
+    size_t m, nc, kc, mc_max;
+    size_t nb_j, slivers;
+    const float *a; // at column pc
+    size_t rsa, csa;
+    const float *pb;
+    float *c; // at column jc
+    size_t ldc;
+    int acc;
+    const NnEpilogue *epi; // NULL but on the last k block
+    const float *bias;     // at column jc
+    float *pa;             // packing buffer, NULL to have each task use its thread's
+} NnGemmStep;
+
+static void nn_gemm_step(void *ctx, size_t begin, size_t end)
+{
+    const NnGemmStep *s = ctx;
+    const NnKernels *kern = &s->kern;
+    size_t kc = s->kc;
+    float *pa = s->pa != NULL ? s->pa : nn_gemm_scratch_take(NN_GEMM_SCRATCH_A, s->mc_max * kc);
+    size_t packed = SIZE_MAX; // row block currently in pa
+
+    for (size_t t = begin; t < end; t++)
+    {
+        size_t ic = t / s->nb_j * s->mc_max;
+        size_t mc = nn_min(s->mc_max, s->m - ic);
+        if (ic != packed)
+        {
+            nn_gemm_pack_a(pa, s->a + ic * s->rsa, s->rsa, s->csa, mc, kc, kern->mr);
+            packed = ic;
+        }
+
+        size_t j0 = t % s->nb_j * s->slivers * kern->nr;
+        size_t j1 = nn_min(s->nc, j0 + s->slivers * kern->nr);
+        for (size_t jr = j0; jr < j1; jr += kern->nr)
+        {
+            for (size_t ir = 0; ir < mc; ir += kern->mr)
+            {
+                float *ct = s->c + (ic + ir) * s->ldc + jr;
+                size_t mt = nn_min(kern->mr, mc - ir);
+                size_t nt = nn_min(kern->nr, s->nc - jr);
+                if (mt == kern->mr && nt == kern->nr)
+                {
+                    kern->gemm_kernel(kc, pa + ir * kc, s->pb + jr * kc, ct, s->ldc, s->acc, s->bias != NULL ? s->bias + jr : NULL);
+                }
+                else
+                {
+                    // Edge tile: run the full kernel into a scratch tile and copy the valid part
+                    float tile[NN_GEMM_MAX_TILE];
+                    float tile_bias[NN_GEMM_MAX_NR] = {0.0f};
+                    if (s->bias != NULL)
+                    {
+                        memcpy(tile_bias, s->bias + jr, nt * sizeof(float));
+                    }
+                    kern->gemm_kernel(kc, pa + ir * kc, s->pb + jr * kc, tile, kern->nr, 0, s->bias != NULL ? tile_bias : NULL);
+                    for (size_t r = 0; r < mt; r++)
+                    {
+                        for (size_t j = 0; j < nt; j++)
+                        {
+                            float *cj = &ct[r * s->ldc + j];
+                            *cj = s->acc ? *cj + tile[r * kern->nr + j] : tile[r * kern->nr + j];
+                        }
+                    }
+                }
+
+                if (s->epi != NULL && s->epi->act != NN_ACT_IDENTITY)
+                {
+                    for (size_t r = 0; r < mt; r++)
+                    {
+                        nn_activate(s->epi->act, ct + r * s->ldc, nt);
+                    }
+                }
+            }
+        }
+    }
+
+    if (s->pa == NULL)
+    {
+        nn_gemm_scratch_give(NN_GEMM_SCRATCH_A, pa);
+    }
+}
+
+// Products narrower than one micro-kernel tile (m < mr or n < nr), where packing and padded
+// tiles would cost more than the product. With few rows of a, b's rows contiguous and c's rows at
+// least half a tile wide (so each axpy fills whole vectors), c's rows are built as axpys of b's
+// rows. Otherwise every c[i][j] is a dot product along k of a's row i with b's column j, copied
+// to contiguous scratch when strided unless a has a single row; when only a's columns are
+// contiguous (a transposed), c's columns are built as axpys of a's columns instead.
+typedef struct
+{
+    size_t m, n, k;
+    const float *a;
+    size_t rsa, csa;
+    const float *b;  // for the axpys and a single row's strided dot products
+    size_t rsb, csb;
+    const float *bt; // b's columns, ldbt apart, for the dot products; NULL for the axpys
+    size_t ldbt;
+    float *c;
+    size_t ldc;
+    int acc;
+    const NnEpilogue *epi;
+} NnGemmSkinny;
+
+static void nn_gemm_skinny_epilogue(const NnGemmSkinny *g, float *c, size_t j, size_t n)
+{
+    if (g->epi != NULL)
+    {
+        if (g->epi->bias != NULL)
+        {
+            nn_kernels.add(c, g->epi->bias + j, n);
+        }
+        nn_activate(g->epi->act, c, n);
+    }
+}
+
+// Rows [begin, end) of c, column by column, from a's contiguous columns
+static void nn_gemm_skinny_cols(const NnGemmSkinny *g, size_t begin, size_t end)
+{
+    size_t rows = end - begin;
+    float *col = nn_gemm_scratch_take(NN_GEMM_SCRATCH_A, rows);
+    for (size_t j = 0; j < g->n; j++)
+    {
+        nn_kernels.fill(col, 0.0f, rows);
+        for (size_t p = 0; p < g->k; p++)
+        {
+            nn_kernels.axpy(col, g->bt[j * g->ldbt + p], g->a + p * g->csa + begin, rows);
+        }
+        for (size_t i = 0; i < rows; i++)
+        {
+            float *cij = g->c + (begin + i) * g->ldc + j;
+            *cij = g->acc ? *cij + col[i] : col[i];
+        }
+    }
+    nn_gemm_scratch_give(NN_GEMM_SCRATCH_A, col);
+
+    for (size_t i = begin; i < end; i++)
+    {
+        nn_gemm_skinny_epilogue(g, g->c + i * g->ldc, 0, g->n);
+    }
+}
+
+// Rows [begin, end) of c as dot products
+static void nn_gemm_skinny_dots(void *ctx, size_t begin, size_t end)
+{
+    const NnGemmSkinny *g = ctx;
+    if (g->csa != 1 && g->rsa == 1 && g->m >= nn_kernels.mr)
+    {
+        nn_gemm_skinny_cols(g, begin, end);
+        return;
+    }
+
+    float *row = g->csa != 1 ? nn_gemm_scratch_take(NN_GEMM_SCRATCH_A, g->k) : NULL;
+    for (size_t i = begin; i < end; i++)
+    {
+        const float *ai = g->a + i * g->rsa;
+        if (row != NULL)
+        {
+            for (size_t p = 0; p < g->k; p++)
+            {
+                row[p] = ai[p * g->csa];
+            }
+            ai = row;
+        }
+        float *ci = g->c + i * g->ldc;
+        for (size_t j = 0; j < g->n; j++)
+        {
+            float sum = nn_kernels.dot(ai, g->bt + j * g->ldbt, g->k);
+            ci[j] = g->acc ? ci[j] + sum : sum;
+        }
+        nn_gemm_skinny_epilogue(g, ci, 0, g->n);
+    }
+    if (row != NULL)
+    {
+        nn_gemm_scratch_give(NN_GEMM_SCRATCH_A, row);
+    }
+}
+
+// Columns [begin, end) of c as axpys of b's rows, scaled by a's elements
+static void nn_gemm_skinny_axpys(void *ctx, size_t begin, size_t end)
+{
+    const NnGemmSkinny *g = ctx;
+    for (size_t i = 0; i < g->m; i++)
+    {
+        float *ci = g->c + i * g->ldc + begin;
+        if (!g->acc)
+        {
+            nn_kernels.fill(ci, 0.0f, end - begin);
+        }
+        for (size_t p = 0; p < g->k; p++)
+        {
+            nn_kernels.axpy(ci, g->a[i * g->rsa + p * g->csa], g->b + p * g->rsb + begin, end - begin);
+        }
+        nn_gemm_skinny_epilogue(g, ci, begin, end - begin);
+    }
+}
+
+// c's single row as dot products read straight from b's strided columns: with no other row of a
+// to reuse them, copying the columns out first would cost more than the product
+static void nn_gemm_skinny_strided(const NnGemmSkinny *g)
+{
+    for (size_t j = 0; j < g->n; j++)
+    {
+        const float *bj = g->b + j * g->csb;
+        // Four partial sums to cover the add latency
+        float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+        size_t p = 0;
+        for (; p + 4 <= g->k; p += 4)
+        {
+            s0 += g->a[p * g->csa] * bj[p * g->rsb];
+            s1 += g->a[(p + 1) * g->csa] * bj[(p + 1) * g->rsb];
+            s2 += g->a[(p + 2) * g->csa] * bj[(p + 2) * g->rsb];
+            s3 += g->a[(p + 3) * g->csa] * bj[(p + 3) * g->rsb];
+        }
+        for (; p < g->k; p++)
+        {
+            s0 += g->a[p * g->csa] * bj[p * g->rsb];
+        }
+        float sum = (s0 + s1) + (s2 + s3);
+        g->c[j] = g->acc ? g->c[j] + sum : sum;
+    }
+    nn_gemm_skinny_epilogue(g, g->c, 0, g->n);
+}
+
+static void nn_gemm_skinny(size_t m, size_t n, size_t k, const float *a, size_t rsa, size_t csa,
+                           const float *b, size_t rsb, size_t csb, float *c, size_t ldc, int accumulate,
+                           const NnEpilogue *epi)
+{
+    NnGemmSkinny g = {
+        .m = m,
+        .n = n,
+        .k = k,
+        .a = a,
+        .rsa = rsa,
+        .csa = csa,
+        .b = b,
+        .rsb = rsb,
+        .csb = csb,
+        .c = c,
+        .ldc = ldc,
+        .acc = accumulate,
+        .epi = epi,
+    };
+    int parallel = m * n * k >= NN_POOL_GEMM_MIN && !nn_pool_inside;
+    if (m < nn_kernels.mr && n >= nn_kernels.nr / 2 && csb == 1)
+    {
+        // Enough columns per task for about NN_POOL_GEMM_MIN multiply-adds
+        size_t grain = parallel ? NN_POOL_GEMM_MIN / (m * k) + 1 : n;
+        nn_parallel_for(0, n, grain, nn_gemm_skinny_axpys, &g);
+        return;
+    }
+    if (m < 4 && rsb != 1)
+    {
+        nn_gemm_skinny_strided(&g);
+        return;
+    }
+
+    float *bt = NULL;
+    if (rsb == 1)
+    {
+        g.bt = b;
+        g.ldbt = csb;
+    }
+    else
+    {
+        bt = nn_gemm_scratch_take(NN_GEMM_SCRATCH_B, n * k);
+        for (size_t j = 0; j < n; j++)
+        {
+            for (size_t p = 0; p < k; p++)
+            {
+                bt[j * k + p] = b[p * rsb + j * csb];
+            }
+        }
+        g.bt = bt;
+        g.ldbt = k;
+    }
+    size_t grain = parallel ? NN_POOL_GEMM_MIN / (n * k) + 1 : m;
+    nn_parallel_for(0, m, grain, nn_gemm_skinny_dots, &g);
+    if (bt != NULL)
+    {
+        nn_gemm_scratch_give(NN_GEMM_SCRATCH_B, bt);
+    }
+}
+
+// c (m x n, row stride ldc) = epi([c +] a (m x k) * b (k x n)), epi may be NULL.
+// a and b are addressed through row/column strides so any view or transpose can be fed in;
+// b's elements are of type b_type. f32 products narrower than one micro-kernel tile take the
+// unpacked nn_gemm_skinny path. Products of NN_POOL_GEMM_MIN multiply-adds and up split each
+// packed b panel's tiles (or the skinny path's rows or columns) over the thread pool; every
+// element is still summed in the same order, so the result does not depend on the thread count.
+static void nn_gemm(size_t m, size_t n, size_t k,
+                    const float *a, size_t rsa, size_t csa,
+                    const void *b, NnDtype b_type, size_t rsb, size_t csb,
+                    float *c, size_t ldc, int accumulate, const NnEpilogue *epi)
+{
+    NN_TRACE_BEGIN(t0);
+    if (m * n * k <= NN_GEMM_SMALL)
+    {
+        if (b_type == NN_DTYPE_F32)
+        {
+            nn_gemm_small(m, n, k, a, rsa, csa, b, NN_DTYPE_F32, rsb, csb, c, ldc, accumulate, epi);
+        }
+        else
+        {
+            nn_gemm_small(m, n, k, a, rsa, csa, b, b_type, rsb, csb, c, ldc, accumulate, epi);
+        }
+        NN_TRACE_END(t0, NN_TRACE_GEMM, -1, 2 * m * n * k, (m * k + m * n) * sizeof(float) + k * n * nn_dtype_size(b_type));
+        return;
+    }
+
+    const NnKernels kern = nn_kernels;
+    if (b_type == NN_DTYPE_F32 && (m < kern.mr || n < kern.nr))
+    {
+        nn_gemm_skinny(m, n, k, a, rsa, csa, b, rsb, csb, c, ldc, accumulate, epi);
+        NN_TRACE_END(t0, NN_TRACE_GEMM, -1, 2 * m * n * k, (m * k + m * n + k * n) * sizeof(float));
+        return;
+    }
+    size_t mc_max = NN_GEMM_MC > kern.mr ? NN_GEMM_MC / kern.mr * kern.mr : kern.mr;
+    size_t nc_max = NN_GEMM_NC > kern.nr ? NN_GEMM_NC / kern.nr * kern.nr : kern.nr;
+    size_t threads = m * n * k >= NN_POOL_GEMM_MIN && !nn_pool_inside ? nn_pool_size() : 1;
+    // Serially this thread packs a itself, so the buffer is taken once for the whole product
+    float *pa = threads > 1 ? NULL : nn_gemm_scratch_take(NN_GEMM_SCRATCH_A, mc_max * NN_GEMM_KC);
+    float *pb = nn_gemm_scratch_take(NN_GEMM_SCRATCH_B, NN_GEMM_KC * nc_max);
+
+    NnGemmStep step = {
+        .kern = kern,
+        .m = m,
+        .mc_max = mc_max,
+        .rsa = rsa,
+        .csa = csa,
+        .pb = pb,
+        .ldc = ldc,
+        .pa = pa,
+    };
+    size_t nb_i = (m + mc_max - 1) / mc_max;
+    for (size_t jc = 0; jc < n; jc += nc_max)
+    {
+        size_t nc = nn_min(nc_max, n - jc);
+        // Serially one task per row block; in parallel about two tasks per thread, with the
+        // columns split too when there are few row blocks
+        size_t slivers = (nc + kern.nr - 1) / kern.nr;
+        size_t nb_j = threads > 1 ? nn_min(slivers, (2 * threads + nb_i - 1) / nb_i) : 1;
+        step.slivers = (slivers + nb_j - 1) / nb_j;
+        step.nb_j = (slivers + step.slivers - 1) / step.slivers;
+        step.nc = nc;
+        step.c = c + jc;
+
+        for (size_t pc = 0; pc < k; pc += NN_GEMM_KC)
+        {
+            step.kc = nn_min(NN_GEMM_KC, k - pc);
+            step.acc = accumulate || pc > 0;
+            // The epilogue belongs to the last k block, when the tiles hold their final sums
+            step.epi = pc + step.kc >= k ? epi : NULL;
+            step.bias = step.epi != NULL && step.epi->bias != NULL ? step.epi->bias + jc : NULL;
+            step.a = a + pc * csa;
+            const char *bb = (const char *)b + (pc * rsb + jc * csb) * nn_dtype_size(b_type);
+            nn_gemm_pack_b(pb, bb, b_type, rsb, csb, step.kc, nc, kern.nr);
+
+            if (threads > 1)
+            {
+                nn_parallel_for(0, nb_i * step.nb_j, 1, nn_gemm_step, &step);
+            }
+            else
+            {
+                nn_gemm_step(&step, 0, nb_i * step.nb_j);
+            }
+        }
+    }
+
+    if (pa != NULL)
+    {
+        nn_gemm_scratch_give(NN_GEMM_SCRATCH_A, pa);
+    }
+    nn_gemm_scratch_give(NN_GEMM_SCRATCH_B, pb);
+    NN_TRACE_END(t0, NN_TRACE_GEMM, -1, 2 * m * n * k, (m * k + m * n) * sizeof(float) + k * n * nn_dtype_size(b_type));
+}
+
+void mat_dot(Matrix dst, Matrix a, Matrix b)
+{
+    mat_gemm(dst, a, 0, b, 0, 0);
+}
+
+// dst [+]= op(a) * op(b), where op transposes its operand when the matching flag is set.
+// b may hold half-precision values; dst and a are float.
+void mat_gemm(Matrix dst, Matrix a, int trans_a, Matrix b, int trans_b, int accumulate)
+{
+    assert(dst.dtype == NN_DTYPE_F32 && a.dtype == NN_DTYPE_F32);
+    size_t m = trans_a ? a.cols : a.rows;
+    size_t k = trans_a ? a.rows : a.cols;
+    size_t n = trans_b ? b.rows : b.cols;
+
+    assert(dst.rows == m);
+    assert(dst.cols == n);
+    assert(k == (trans_b ? b.cols : b.rows));
+
+    nn_gemm(m, n, k,
+            a.data, trans_a ? 1 : a.stride, trans_a ? a.stride : 1,
+            b.data, b.dtype, trans_b ? 1 : b.stride, trans_b ? b.stride : 1,
+            dst.data, dst.stride, accumulate, NULL);
+}
+
+// dst = act(a * b + bias), with bias a 1 x dst.cols row added to every row of the product.
+// Bias and activation are applied per output tile inside the product instead of in two more
+// passes over dst.
+void mat_dot_bias_act(Matrix dst, Matrix a, Matrix b, Matrix bias, Activation act)
+{
+    assert(dst.rows == a.rows);
+    assert(dst.cols == b.cols);
+    assert(a.cols == b.rows);
+    assert(bias.rows == 1);
+    assert(bias.cols == dst.cols);
+    assert(dst.dtype == NN_DTYPE_F32 && a.dtype == NN_DTYPE_F32 && bias.dtype == NN_DTYPE_F32);
+
+    NnEpilogue epi = {.bias = bias.data, .act = act};
+    nn_gemm(dst.rows, dst.cols, a.cols,
+            a.data, a.stride, 1,
+            b.data, b.dtype, b.stride, 1,
+            dst.data, dst.stride, 0, &epi);
+}
+
+typedef struct
+{
+    const NnSparseMatrix *w;
+    const float *b;
+    size_t ldb;
+    float *c;
+    size_t ldc;
+    size_t n;
+} NnSpmmRange;
+
+static void nn_spmm_range(void *ctx, size_t begin, size_t end)
+{
+    const NnSpmmRange *r = ctx;
+    nn_kernels.spmm(end - begin, r->n, r->w->row_ptr + begin, r->w->col, r->w->val, r->b, r->ldb,
+                    r->c + begin * r->ldc, r->ldc);
+}
+
+// dst = act(a * W + bias) for a layer whose weights W are held as w (W transposed, in CSR).
+// The product runs as w * a^T so every nonzero scales a contiguous run of samples: a and the
+// result go through transposed copies in the per-thread GEMM scratch, except for a single row,
+// which w multiplies as is.
+void mat_dot_sparse_bias_act(Matrix dst, Matrix a, const NnSparseMatrix *w, Matrix bias, Activation act)
+{
+    assert(dst.rows == a.rows);
+    assert(dst.cols == w->rows);
+    assert(a.cols == w->cols);
+    assert(bias.rows == 1);
+    assert(bias.cols == dst.cols);
+    assert(dst.dtype == NN_DTYPE_F32 && a.dtype == NN_DTYPE_F32 && bias.dtype == NN_DTYPE_F32);
+
+    size_t n = a.rows;
+    float *at = NULL;
+    float *ct = NULL;
+    NnSpmmRange r = {.w = w, .b = a.data, .ldb = 1, .c = dst.data, .ldc = 1, .n = n};
+    if (n > 1)
+    {
+        at = nn_gemm_scratch_take(NN_GEMM_SCRATCH_A, w->cols * n);
+        ct = nn_gemm_scratch_take(NN_GEMM_SCRATCH_B, w->rows * n);
+        for (size_t i = 0; i < n; i++)
+        {
+            for (size_t k = 0; k < a.cols; k++)
+            {
+                at[k * n + i] = MAT_AT(a, i, k);
+            }
+        }
+        r.b = at;
+        r.ldb = n;
+        r.c = ct;
+        r.ldc = n;
+    }
+
+    // Enough output rows per task for about NN_POOL_GEMM_MIN multiply-adds
+    size_t grain = NN_POOL_GEMM_MIN / (n * (w->nnz / w->rows + 1)) + 1;
+    nn_parallel_for(0, w->rows, grain, nn_spmm_range, &r);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        float *row = &MAT_AT(dst, i, 0);
+        if (ct != NULL)
+        {
+            for (size_t j = 0; j < dst.cols; j++)
+            {
+                row[j] = ct[j * n + i] + bias.data[j];
+            }
+        }
+        else
+        {
+            nn_kernels.add(row, bias.data, dst.cols);
+        }
+        nn_activate(act, row, dst.cols);
+    }
+    if (ct != NULL)
+    {
+        nn_gemm_scratch_give(NN_GEMM_SCRATCH_B, ct);
+        nn_gemm_scratch_give(NN_GEMM_SCRATCH_A, at);
+    }
+}
+
+// Reference i-j-k product, kept to check mat_dot against
+void mat_dot_naive(Matrix dst, Matrix a, Matrix b)
+{
+    assert(dst.rows == a.rows);
+    assert(dst.cols == b.cols);
+    assert(a.cols == b.rows);
+
+    for (size_t i = 0; i < dst.rows; i++)
+    {
+        for (size_t j = 0; j < dst.cols; j++)
+        {
+            MAT_AT(dst, i, j) = 0.0f;
+            for (size_t k = 0; k < a.cols; k++)
+            {
+                MAT_AT(dst, i, j) += MAT_AT(a, i, k) * MAT_AT(b, k, j);
+            }
+        }
+    }
+}
+
+void mat_sigf(Matrix a)
+{
+    mat_activate(a, NN_ACT_SIGMOID);
+}
+
+// d *= a * (1 - a), with a the sigmoid output d is backpropagated through
+void mat_dsigf(Matrix d, Matrix a)
+{
+    mat_activate_grad(d, a, NN_ACT_SIGMOID);
+}
+
+typedef struct
+{
+    Activation act;
+    float *d;
+    const float *a;
+} NnActivateRange;
+
+static void nn_activate_range(void *ctx, size_t begin, size_t end)
+{
+    const NnActivateRange *r = ctx;
+    nn_activate(r->act, r->d + begin, end - begin);
+}
+
+void mat_activate(Matrix a, Activation act)
+{
+    NN_TRACE_BEGIN(t0);
+    if (mat_contiguous(a))
+    {
+        NnActivateRange r = {.act = act, .d = a.data};
+        nn_parallel_for(0, a.rows * a.cols, NN_POOL_GRAIN, nn_activate_range, &r);
+    }
+    else
+    {
+        for (size_t i = 0; i < a.rows; i++)
+        {
+            nn_activate(act, &MAT_AT(a, i, 0), a.cols);
+        }
+    }
+    NN_TRACE_END(t0, NN_TRACE_ACTIVATION, -1, a.rows * a.cols, 2 * a.rows * a.cols * sizeof(float));
+}
+
+// d *= act'(z), written in terms of the activation's output a = act(z) like mat_dsigf
+static void nn_activate_grad(Activation act, float *d, const float *a, size_t n)
+{
+    switch (act)
+    {
+    case NN_ACT_SIGMOID:
+        nn_kernels.dsigf(d, a, n);
+        break;
+    case NN_ACT_RELU:
+        for (size_t i = 0; i < n; i++)
+        {
+            d[i] = a[i] > 0.0f ? d[i] : 0.0f;
+        }
+        break;
+    case NN_ACT_TANH:
+        for (size_t i = 0; i < n; i++)
+        {
+            d[i] *= 1.0f - a[i] * a[i];
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void nn_activate_grad_range(void *ctx, size_t begin, size_t end)
+{
+    const NnActivateRange *r = ctx;
+    nn_activate_grad(r->act, r->d + begin, r->a + begin, end - begin);
+}
+
+void mat_activate_grad(Matrix d, Matrix a, Activation act)
+{
+    assert(d.rows == a.rows);
+    assert(d.cols == a.cols);
+
+    NN_TRACE_BEGIN(t0);
+    if (mat_contiguous(d) && mat_contiguous(a))
+    {
+        NnActivateRange r = {.act = act, .d = d.data, .a = a.data};
+        nn_parallel_for(0, d.rows * d.cols, NN_POOL_GRAIN, nn_activate_grad_range, &r);
+    }
+    else
+    {
+        for (size_t i = 0; i < d.rows; i++)
+        {
+            nn_activate_grad(act, &MAT_AT(d, i, 0), &MAT_AT(a, i, 0), d.cols);
+        }
+    }
+    NN_TRACE_END(t0, NN_TRACE_ACTIVATION_GRAD, -1, 2 * d.rows * d.cols, 3 * d.rows * d.cols * sizeof(float));
+}
+
+static size_t nn_align_up(size_t bytes)
+{
+    return (bytes + NN_ALIGN - 1) / NN_ALIGN * NN_ALIGN;
+}
+
+static void *nn_aligned_alloc(size_t bytes)
+{
+    void *ptr = aligned_alloc(NN_ALIGN, nn_align_up(bytes > 0 ? bytes : 1));
+    assert(ptr != NULL);
+    return ptr;
+}
+
+// One aligned block: the num_layers + 1 Matrix headers, then every activation's data
+static Matrix *nn_alloc_activations(size_t *archi, size_t num_layers, size_t batch_size)
+{
+    size_t header = nn_align_up((num_layers + 1) * sizeof(Matrix));
+    size_t floats = 0;
+    for (size_t i = 0; i <= num_layers; i++)
+    {
+        floats += batch_size * archi[i];
+    }
+
+    Matrix *activations = nn_aligned_alloc(header + floats * sizeof(float));
+    float *data = (float *)((char *)activations + header);
+    for (size_t i = 0; i <= num_layers; i++)
+    {
+        activations[i] = (Matrix){.rows = batch_size, .cols = archi[i], .stride = archi[i], .data = data};
+        data += batch_size * archi[i];
+    }
+
+    return activations;
+}
+
+static void nn_free_activations(Matrix *activations)
+{
+    free(activations);
+}
+
+NeuralNetwork nn_alloc(size_t archi[], size_t num_layers)
+{
+    return nn_alloc_batch(archi, num_layers, 1);
+}
+
+static size_t nn_count_params(size_t *archi, size_t num_layers)
+{
+    size_t count = 0;
+    for (size_t i = 1; i <= num_layers; i++)
+    {
+        count += archi[i - 1] * archi[i] + archi[i];
+    }
+
+    return count;
+}
+
+// Builds the layer views over an existing parameter arena, which the network then owns
+static NeuralNetwork nn_alloc_views(size_t *archi, size_t num_layers, size_t batch_size, float *params)
+{
+    assert(batch_size > 0);
+
+    NeuralNetwork nn;
+    nn.num_layers = num_layers;
+    nn.mapping = NULL;
+    nn.mapping_size = 0;
+    nn.dtype = NN_DTYPE_F32;
+    nn.sparse = NULL;
+    nn.weights = malloc(2 * num_layers * sizeof(Matrix) + (num_layers + 1) * sizeof(size_t) +
+                        num_layers * sizeof(Activation));
+    assert(nn.weights != NULL);
+    nn.biases = nn.weights + num_layers;
+    nn.archi = (size_t *)(nn.biases + num_layers);
+    memcpy(nn.archi, archi, (num_layers + 1) * sizeof(size_t));
+    nn.act = (Activation *)(nn.archi + num_layers + 1);
+    for (size_t i = 0; i < num_layers; i++)
+    {
+        nn.act[i] = NN_ACT_SIGMOID;
+    }
+
+    nn.num_params = nn_count_params(archi, num_layers);
+    nn.params = params;
+
+    float *data = nn.params;
+    for (size_t i = 1; i <= num_layers; i++)
+    {
+        nn.weights[i - 1] = (Matrix){.rows = archi[i - 1], .cols = archi[i], .stride = archi[i], .data = data};
+        data += archi[i - 1] * archi[i];
+        nn.biases[i - 1] = (Matrix){.rows = 1, .cols = archi[i], .stride = archi[i], .data = data};
+        data += archi[i];
+    }
+
+    nn.activations = nn_alloc_activations(nn.archi, num_layers, batch_size);
+
+    return nn;
+}
+
+// Activations hold batch_size rows so a whole batch goes through each layer as one matrix product.
+// The network takes three blocks: layer headers (plus its own archi and activations), one aligned arena
+// for every weight and bias, and one for the activations.
+NeuralNetwork nn_alloc_batch(size_t archi[], size_t num_layers, size_t batch_size)
+{
+    float *params = nn_aligned_alloc(nn_count_params(archi, num_layers) * sizeof(float));
+    return nn_alloc_views(archi, num_layers, batch_size, params);
+}
+
+void nn_free(NeuralNetwork nn)
+{
+    if (nn.mapping != NULL)
+    {
+        munmap(nn.mapping, nn.mapping_size);
+    }
+    else
+    {
+        free(nn.params);
+    }
+    nn_free_activations(nn.activations);
+    free(nn.weights);
+    free(nn.sparse);
+}
+
+// Deep copy with the same batch size
+NeuralNetwork nn_clone(NeuralNetwork nn)
+{
+    NeuralNetwork copy = nn_alloc_batch(nn.archi, nn.num_layers, NN_INPUT(nn).rows);
+    nn_copy(copy, nn);
+
+    return copy;
+}
+
+// Copies the parameters and layer activations of src into dst, which must have the same architecture
+void nn_copy(NeuralNetwork dst, NeuralNetwork src)
+{
+    assert(dst.num_params == src.num_params);
+    assert(dst.num_layers == src.num_layers);
+    assert(dst.dtype == NN_DTYPE_F32 && src.dtype == NN_DTYPE_F32);
+    assert(dst.sparse == NULL);
+
+    memcpy(dst.params, src.params, src.num_params * sizeof(*src.params));
+    memcpy(dst.act, src.act, src.num_layers * sizeof(*src.act));
+}
+
+// layer counts from 0 (the first hidden layer) to num_layers - 1 (the output layer)
+void nn_set_activation(NeuralNetwork nn, size_t layer, Activation act)
+{
+    assert(layer < nn.num_layers);
+    assert(act < NN_ACT_COUNT);
+
+    nn.act[layer] = act;
+}
+
+// Inference copy of nn with its weights stored as dtype, which for the half types halves their
+// memory and the bandwidth of streaming them through the forward pass. Biases stay float and the
+// batch size carries over. The copy runs nn_forward, nn_predict and nn_mse; training it or
+// saving it takes F32.
+NeuralNetwork nn_convert(NeuralNetwork nn, NnDtype dtype)
+{
+    assert(nn.dtype == NN_DTYPE_F32);
+    if (dtype == NN_DTYPE_F32)
+    {
+        return nn_clone(nn);
+    }
+
+    size_t num_weights = 0;
+    for (size_t i = 0; i < nn.num_layers; i++)
+    {
+        num_weights += nn.weights[i].rows * nn.weights[i].cols;
+    }
+    size_t weight_bytes = nn_align_up(num_weights * nn_dtype_size(dtype));
+    char *arena = nn_aligned_alloc(weight_bytes + (nn.num_params - num_weights) * sizeof(float));
+
+    // The arena holds every weight first, then every bias, so the floats stay aligned
+    NeuralNetwork out = nn_alloc_views(nn.archi, nn.num_layers, NN_INPUT(nn).rows, (float *)arena);
+    out.dtype = dtype;
+    memcpy(out.act, nn.act, nn.num_layers * sizeof(*nn.act));
+
+    char *w = arena;
+    float *b = (float *)(arena + weight_bytes);
+    for (size_t i = 0; i < nn.num_layers; i++)
+    {
+        Matrix src = nn.weights[i];
+        out.weights[i] = (Matrix){.rows = src.rows, .cols = src.cols, .stride = src.cols, .data = (float *)w, .dtype = dtype};
+        mat_convert(out.weights[i], src);
+        w += src.rows * src.cols * nn_dtype_size(dtype);
+
+        out.biases[i] = (Matrix){.rows = 1, .cols = src.cols, .stride = src.cols, .data = b};
+        mat_cpy(out.biases[i], nn.biases[i]);
+        b += src.cols;
+    }
+
+    return out;
+}
+
+static int nn_cmp_float(const void *a, const void *b)
+{
+    float x = *(const float *)a;
+    float y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+// Zeroes the floor(sparsity * n) weights of smallest magnitude among the n in layers [first, last)
+static void nn_prune_layers(NeuralNetwork nn, size_t first, size_t last, float sparsity)
+{
+    size_t n = 0;
+    for (size_t l = first; l < last; l++)
+    {
+        n += nn.weights[l].rows * nn.weights[l].cols;
+    }
+    size_t count = (size_t)(sparsity * n);
+    if (count == 0)
+    {
+        return;
+    }
+
+    float *mags = malloc(n * sizeof(*mags));
+    assert(mags != NULL);
+    size_t m = 0;
+    for (size_t l = first; l < last; l++)
+    {
+        for (size_t i = 0; i < nn.weights[l].rows; i++)
+        {
+            for (size_t j = 0; j < nn.weights[l].cols; j++)
+            {
+                mags[m++] = fabsf(MAT_AT(nn.weights[l], i, j));
+            }
+        }
+    }
+    qsort(mags, n, sizeof(*mags), nn_cmp_float);
+    float threshold = mags[count - 1];
+    free(mags);
+
+    // Everything below the threshold goes, then just enough of the weights equal to it
+    size_t pruned = 0;
+    for (int ties = 0; ties <= 1; ties++)
+    {
+        for (size_t l = first; l < last; l++)
+        {
+            for (size_t i = 0; i < nn.weights[l].rows; i++)
+            {
+                for (size_t j = 0; j < nn.weights[l].cols; j++)
+                {
+                    float *w = &MAT_AT(nn.weights[l], i, j);
+                    float mag = fabsf(*w);
+                    if (ties ? mag == threshold && pruned < count : mag < threshold)
+                    {
+                        *w = 0.0f;
+                        pruned++;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Sets the given fraction of nn's weights, those of smallest magnitude, to zero: ranked over the
+// whole network with NN_PRUNE_GLOBAL, which lets wide layers give up more, or within each layer
+// with NN_PRUNE_PER_LAYER. Biases are kept. The network stays dense, so it can be fine-tuned
+// afterwards, but training brings pruned weights back unless they are zeroed again.
+void nn_prune(NeuralNetwork nn, float sparsity, NnPruneScope scope)
+{
+    assert(nn.dtype == NN_DTYPE_F32 && nn.sparse == NULL);
+    assert(sparsity >= 0.0f && sparsity <= 1.0f);
+
+    if (scope == NN_PRUNE_GLOBAL)
+    {
+        nn_prune_layers(nn, 0, nn.num_layers, sparsity);
+        return;
+    }
+    for (size_t l = 0; l < nn.num_layers; l++)
+    {
+        nn_prune_layers(nn, l, l + 1, sparsity);
+    }
+}
+
+// Inference copy of nn in which every layer with at most max_density of its weights nonzero
+// multiplies through a CSR copy of them (see mat_dot_sparse_bias_act). The dense weights are kept
+// too, so the copy saves, clones and converts like nn, as a dense network. Where the sparse product
+// beats the dense one depends on the density, the batch size and the ISA; bench.c measures it.
+NeuralNetwork nn_sparsify(NeuralNetwork nn, float max_density)
+{
+    assert(nn.dtype == NN_DTYPE_F32);
+
+    NeuralNetwork out = nn_clone(nn);
+    size_t bytes = nn.num_layers * sizeof(NnSparseMatrix);
+    out.sparse = malloc(bytes);
+    assert(out.sparse != NULL);
+    for (size_t l = 0; l < nn.num_layers; l++)
+    {
+        Matrix w = nn.weights[l];
+        size_t nnz = 0;
+        for (size_t i = 0; i < w.rows; i++)
+        {
+            for (size_t j = 0; j < w.cols; j++)
+            {
+                nnz += MAT_AT(w, i, j) != 0.0f;
+            }
+        }
+        assert(nnz <= UINT32_MAX);
+
+        out.sparse[l] = (NnSparseMatrix){.rows = w.cols, .cols = w.rows, .nnz = nnz};
+        if (nnz <= max_density * w.rows * w.cols)
+        {
+            bytes += (w.cols + 1 + 2 * nnz) * sizeof(uint32_t);
+        }
+    }
+
+    // One block: the headers, then each sparse layer's row pointers, columns and values
+    out.sparse = realloc(out.sparse, bytes);
+    assert(out.sparse != NULL);
+    char *data = (char *)(out.sparse + nn.num_layers);
+    for (size_t l = 0; l < nn.num_layers; l++)
+    {
+        NnSparseMatrix *sm = &out.sparse[l];
+        Matrix w = nn.weights[l];
+        if (sm->nnz > max_density * w.rows * w.cols)
+        {
+            continue;
+        }
+
+        sm->row_ptr = (uint32_t *)data;
+        sm->col = sm->row_ptr + sm->rows + 1;
+        sm->val = (float *)(sm->col + sm->nnz);
+        data = (char *)(sm->val + sm->nnz);
+
+        uint32_t p = 0;
+        for (size_t j = 0; j < w.cols; j++)
+        {
+            sm->row_ptr[j] = p;
+            for (size_t i = 0; i < w.rows; i++)
+            {
+                if (MAT_AT(w, i, j) != 0.0f)
+                {
+                    sm->col[p] = (uint32_t)i;
+                    sm->val[p] = MAT_AT(w, i, j);
+                    p++;
+                }
+            }
+        }
+        sm->row_ptr[w.cols] = p;
+    }
+
+    return out;
+}
+
+size_t nn_num_params(NeuralNetwork nn)
+{
+    return nn.num_params;
+}
+
+// Parameters are numbered in arena order: layer by layer, weights (row-major) before biases
+float *nn_param(NeuralNetwork nn, size_t index)
+{
+    assert(index < nn.num_params);
+    assert(nn.dtype == NN_DTYPE_F32 && nn.sparse == NULL);
+
+    return nn.params + index;
+}
+
+// Draws in arena order, which is the same weights[i], biases[i] order as before the arena
+void nn_rand(NeuralNetwork nn, float min, float max)
+{
+    assert(nn.dtype == NN_DTYPE_F32 && nn.sparse == NULL);
+
+    for (size_t i = 0; i < nn.num_params; i++)
+    {
+        nn.params[i] = rand_float() * (max - min) + min;
+    }
+}
+
+void nn_fill(NeuralNetwork nn, float val)
+{
+    assert(nn.dtype == NN_DTYPE_F32 && nn.sparse == NULL);
+
+    nn_kernels.fill(nn.params, val, nn.num_params);
+}
+
+void nn_print(NeuralNetwork nn, char *name)
+{
+    printf("%s: [\n", name);
+    for (size_t i = 0; i < nn.num_layers; i++)
+    {
+        mat_print(nn.weights[i], "weights");
+        mat_print(nn.biases[i], "biases");
+    }
+    printf("]\n");
+}
+
+void nn_forward(NeuralNetwork nn)
+{
+    nn_forward_batch(nn, NN_INPUT(nn));
+}
+
+// The forward pass of in into out (in.rows rows) with the hidden layers written to hidden[0..],
+// which need at least in.rows rows. Reads nothing of nn but its parameters.
+static void nn_forward_into(NeuralNetwork nn, Matrix *hidden, Matrix in, Matrix out)
+{
+    Matrix x = in;
+    for (size_t i = 0; i < nn.num_layers; i++)
+    {
+        NN_TRACE_BEGIN(t0);
+        Matrix y = i + 1 == nn.num_layers ? out : mat_rows(hidden[i], 0, in.rows);
+        if (nn.sparse != NULL && nn.sparse[i].row_ptr != NULL)
+        {
+            // Values, column indices and row pointers are all 4 bytes
+            const NnSparseMatrix *w = &nn.sparse[i];
+            mat_dot_sparse_bias_act(y, x, w, nn.biases[i], nn.act[i]);
+            NN_TRACE_END(t0, NN_TRACE_LAYER_FORWARD, i, 2 * y.rows * w->nnz,
+                         (x.rows * x.cols + y.cols + y.rows * y.cols + 2 * w->nnz + w->rows + 1) * sizeof(float));
+        }
+        else
+        {
+            mat_dot_bias_act(y, x, nn.weights[i], nn.biases[i], nn.act[i]);
+            NN_TRACE_END(t0, NN_TRACE_LAYER_FORWARD, i, 2 * y.rows * x.cols * y.cols,
+                         (x.rows * x.cols + y.cols + y.rows * y.cols) * sizeof(float) +
+                             x.cols * y.cols * nn_dtype_size(nn.dtype));
+        }
+        x = y;
+    }
+}
+
+// Runs the in.rows samples of in (at most the batch size) through the network.
+// in is read in place, the outputs land in the first in.rows rows of NN_OUTPUT(nn).
+void nn_forward_batch(NeuralNetwork nn, Matrix in)
+{
+    assert(in.cols == NN_INPUT(nn).cols);
+    assert(in.rows <= NN_INPUT(nn).rows);
+
+    nn_forward_into(nn, nn.activations + 1, in, mat_rows(NN_OUTPUT(nn), 0, in.rows));
+}
+
+NnWorkspace nn_workspace_alloc(NeuralNetwork nn, size_t batch_size)
+{
+    assert(batch_size > 0);
+
+    NnWorkspace ws = {.hidden = NULL, .batch_size = batch_size};
+    if (nn.num_layers > 1)
+    {
+        ws.hidden = nn_alloc_activations(nn.archi + 1, nn.num_layers - 2, batch_size);
+    }
+
+    return ws;
+}
+
+void nn_workspace_free(NnWorkspace ws)
+{
+    if (ws.hidden != NULL)
+    {
+        nn_free_activations(ws.hidden);
+    }
+}
+
+// Writes the network's output for every row of in into out, ws.batch_size rows at a time.
+// The last layer writes straight into out; nn itself is never written.
+void nn_infer(NeuralNetwork nn, NnWorkspace ws, Matrix in, Matrix out)
+{
+    assert(in.rows == out.rows);
+    assert(in.cols == nn.archi[0]);
+    assert(out.cols == nn.archi[nn.num_layers]);
+
+    for (size_t i = 0; i < in.rows; i += ws.batch_size)
+    {
+        size_t rows = nn_min(ws.batch_size, in.rows - i);
+        nn_forward_into(nn, ws.hidden, mat_rows(in, i, rows), mat_rows(out, i, rows));
+    }
+}
+
+// Writes the network's output for every row of in into out, one batch at a time
+void nn_predict(NeuralNetwork nn, Matrix in, Matrix out)
+{
+    assert(in.rows == out.rows);
+    assert(out.cols == NN_OUTPUT(nn).cols);
+
+    size_t batch_size = NN_INPUT(nn).rows;
+    for (size_t i = 0; i < in.rows; i += batch_size)
+    {
+        size_t rows = nn_min(batch_size, in.rows - i);
+        nn_forward_batch(nn, mat_rows(in, i, rows));
+        mat_cpy(mat_rows(out, i, rows), mat_rows(NN_OUTPUT(nn), 0, rows));
+    }
+}
+
+typedef struct
+{
+    NeuralNetwork nn;
+    Matrix ti;
+    Matrix to;
+    size_t num_batches;
+    size_t num_parts;
+    NnWorkspace *ws; // one per part
+    Matrix *out;     // one per part
+    float *sums;     // squared error of each batch
+} NnMseJob;
+
+// Parts [begin, end) of nn_mse's batches, each through a workspace of its own so parts run
+// concurrently
+static void nn_mse_part(void *ctx, size_t begin, size_t end)
+{
+    const NnMseJob *job = ctx;
+    size_t batch_size = NN_INPUT(job->nn).rows;
+    for (size_t t = begin; t < end; t++)
+    {
+        Matrix out = job->out[t];
+        size_t first = t * job->num_batches / job->num_parts;
+        size_t last = (t + 1) * job->num_batches / job->num_parts;
+        for (size_t b = first; b < last; b++)
+        {
+            size_t i = b * batch_size;
+            size_t rows = nn_min(batch_size, job->ti.rows - i);
+            Matrix y = mat_rows(job->to, i, rows);
+            nn_infer(job->nn, job->ws[t], mat_rows(job->ti, i, rows), mat_rows(out, 0, rows));
+
+            float sum = 0.0f;
+            for (size_t k = 0; k < rows; k++)
+            {
+                for (size_t j = 0; j < y.cols; j++)
+                {
+                    float diff = MAT_AT(out, k, j) - MAT_AT(y, k, j);
+                    sum += diff * diff;
+                }
+            }
+            job->sums[b] = sum;
+        }
+    }
+}
+
+// Datasets of NN_POOL_GEMM_MIN rows x parameters and up are split by batches over the thread
+// pool. That path leaves nn's activations alone and sums per batch, so the last digits can
+// differ from the serial loop's.
+float nn_mse(NeuralNetwork nn, Matrix train_in, Matrix train_out)
+{
+    assert(train_in.rows == train_out.rows);
+    assert(train_in.cols == NN_INPUT(nn).cols);
+    assert(train_out.cols == nn.activations[nn.num_layers].cols);
+
+    float result = 0.0f;
+    size_t batch_size = NN_INPUT(nn).rows;
+    size_t num_batches = (train_in.rows + batch_size - 1) / batch_size;
+
+    if (num_batches > 1 && train_in.rows * nn.num_params >= NN_POOL_GEMM_MIN && !nn_pool_inside && nn_pool_size() > 1)
+    {
+        // Enough batches per part for about NN_POOL_GEMM_MIN multiply-adds, at most one part per
+        // pool thread, with their workspaces allocated once for the whole call
+        size_t grain = NN_POOL_GEMM_MIN / (batch_size * nn.num_params) + 1;
+        size_t num_parts = nn_min(nn_pool_size(), (num_batches + grain - 1) / grain);
+        NnMseJob job = {
+            .nn = nn,
+            .ti = train_in,
+            .to = train_out,
+            .num_batches = num_batches,
+            .num_parts = num_parts,
+            .ws = malloc(num_parts * sizeof(NnWorkspace)),
+            .out = malloc(num_parts * sizeof(Matrix)),
+            .sums = malloc(num_batches * sizeof(float)),
+        };
+        assert(job.ws != NULL && job.out != NULL && job.sums != NULL);
+        for (size_t t = 0; t < num_parts; t++)
+        {
+            job.ws[t] = nn_workspace_alloc(nn, batch_size);
+            job.out[t] = mat_alloc(batch_size, train_out.cols);
+        }
+
+        nn_parallel_for(0, num_parts, 1, nn_mse_part, &job);
+        for (size_t b = 0; b < num_batches; b++)
+        {
+            result += job.sums[b];
+        }
+
+        for (size_t t = 0; t < num_parts; t++)
+        {
+            nn_workspace_free(job.ws[t]);
+            mat_free(job.out[t]);
+        }
+        free(job.ws);
+        free(job.out);
+        free(job.sums);
+        return result / train_in.rows;
+    }
+
+    for (size_t i = 0; i < train_in.rows; i += batch_size)
+    {
+        size_t rows = nn_min(batch_size, train_in.rows - i);
+        Matrix y = mat_rows(train_out, i, rows);
+
+        nn_forward_batch(nn, mat_rows(train_in, i, rows));
+
+        for (size_t r = 0; r < rows; r++)
+        {
+            for (size_t j = 0; j < train_out.cols; j++)
+            {
+                float diff = MAT_AT(NN_OUTPUT(nn), r, j) - MAT_AT(y, r, j);
+                result += diff * diff;
+            }
+        }
+    }
+
+    return result / train_in.rows;
+}
+
+// Forward differences against the unperturbed MSE, which is returned
+float nn_finite_diff(NeuralNetwork nn, NeuralNetwork grad, float eps, Matrix train_in, Matrix train_out)
+{
+    NN_TRACE_BEGIN(t0);
+    float saved;
+    float mse = nn_mse(nn, train_in, train_out);
+    for (size_t i = 0; i < nn.num_layers; i++)
+    {
+        for (size_t j = 0; j < nn.weights[i].rows; j++)
+        {
+            for (size_t k = 0; k < nn.weights[i].cols; k++)
+            {
+                saved = MAT_AT(nn.weights[i], j, k);
+                MAT_AT(nn.weights[i], j, k) += eps;
+                float new_mse = nn_mse(nn, train_in, train_out);
+                MAT_AT(grad.weights[i], j, k) = (new_mse - mse) / eps;
+                MAT_AT(nn.weights[i], j, k) = saved;
+            }
+        }
+        for (size_t j = 0; j < nn.biases[i].rows; j++)
+        {
+            for (size_t k = 0; k < nn.biases[i].cols; k++)
+            {
+                saved = MAT_AT(nn.biases[i], 0, k);
                 MAT_AT(nn.biases[i], 0, k) += eps;
                 float new_mse = nn_mse(nn, train_in, train_out);
                 MAT_AT(grad.biases[i], 0, k) = (new_mse - mse) / eps;
@@ -302,94 +4189,1943 @@ void nn_finite_diff(NeuralNetwork nn, NeuralNetwork grad, float eps, Matrix trai
             }
         }
     }
+    NN_TRACE_END(t0, NN_TRACE_FINITE_DIFF, -1, 0, 0);
+    return mse;
+}
+
+typedef struct
+{
+    NeuralNetwork nn; // private copy, perturbed in place
+    NeuralNetwork grad;
+    Matrix ti;
+    Matrix to;
+    const size_t *params;
+    size_t num_params;
+    float mse;
+    FiniteDiffConfig cfg;
+} NnFiniteDiffWorker;
+
+static void nn_finite_diff_worker(NnFiniteDiffWorker *w)
+{
+    float eps = w->cfg.eps;
+
+    NN_TRACE_BEGIN(t0);
+    for (size_t i = 0; i < w->num_params; i++)
+    {
+        float *p = nn_param(w->nn, w->params[i]);
+        float saved = *p;
+
+        *p = saved + eps;
+        float plus = nn_mse(w->nn, w->ti, w->to);
+        if (w->cfg.central)
+        {
+            *p = saved - eps;
+            float minus = nn_mse(w->nn, w->ti, w->to);
+            *nn_param(w->grad, w->params[i]) = (plus - minus) / (2 * eps);
+        }
+        else
+        {
+            *nn_param(w->grad, w->params[i]) = (plus - w->mse) / eps;
+        }
+        *p = saved;
+    }
+    NN_TRACE_END(t0, NN_TRACE_FINITE_DIFF, -1, 0, 0);
+}
+
+static void nn_finite_diff_range(void *ctx, size_t begin, size_t end)
+{
+    NnFiniteDiffWorker *workers = ctx;
+    for (size_t t = begin; t < end; t++)
+    {
+        nn_finite_diff_worker(&workers[t]);
+    }
+}
+
+// Finite-difference gradient with the parameters split into num_threads parts (0 = one per pool
+// thread) that run on the thread pool, each perturbing its own copy of the network. With
+// cfg.subset set, a fresh random subset of parameters is drawn (through rand()) on every call and
+// all other gradient entries are zeroed.
+void nn_finite_diff_mt(NeuralNetwork nn, NeuralNetwork grad, Matrix train_in, Matrix train_out, FiniteDiffConfig cfg)
+{
+    size_t total = nn_num_params(nn);
+    size_t count = cfg.subset > 0 && cfg.subset < total ? cfg.subset : total;
+    size_t *params = malloc(total * sizeof(*params));
+    assert(params != NULL);
+
+    for (size_t i = 0; i < total; i++)
+    {
+        params[i] = i;
+    }
+    if (count < total)
+    {
+        // Partial Fisher-Yates: the first count entries become a uniform random subset
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t j = i + (size_t)rand() % (total - i);
+            size_t tmp = params[i];
+            params[i] = params[j];
+            params[j] = tmp;
+        }
+        nn_fill(grad, 0.0f);
+    }
+
+    size_t num_threads = cfg.num_threads == 0 ? nn_pool_size() : cfg.num_threads;
+    if (num_threads > count)
+    {
+        num_threads = count;
+    }
+    if (num_threads == 0)
+    {
+        num_threads = 1;
+    }
+
+    float mse = cfg.central ? 0.0f : nn_mse(nn, train_in, train_out);
+    NnFiniteDiffWorker *workers = malloc(num_threads * sizeof(*workers));
+    assert(workers != NULL);
+
+    for (size_t t = 0; t < num_threads; t++)
+    {
+        size_t begin = t * count / num_threads;
+        size_t end = (t + 1) * count / num_threads;
+
+        workers[t] = (NnFiniteDiffWorker){
+            .nn = t == 0 ? nn : nn_clone(nn),
+            .grad = grad,
+            .ti = train_in,
+            .to = train_out,
+            .params = params + begin,
+            .num_params = end - begin,
+            .mse = mse,
+            .cfg = cfg,
+        };
+    }
+
+    nn_parallel_for(0, num_threads, 1, nn_finite_diff_range, workers);
+
+    for (size_t t = 1; t < num_threads; t++)
+    {
+        nn_free(workers[t].nn);
+    }
+    free(workers);
+    free(params);
+}
+
+// Accumulates the MSE gradient over the dataset one batch at a time. For each batch,
+// with A[l] = f[l](Z[l]) the layer outputs and D[l] = dC/dZ[l] stored in grad.activations:
+//   D[L]   = 2 (A[L] - Y) * f[L]'
+//   dW[l] += A[l-1]^T D[l]
+//   db[l] += column sums of D[l]
+//   D[l-1] = (D[l] W[l]^T) * f[l-1]'
+// where each f' is written through A (A (1 - A) for the sigmoid, see mat_activate_grad).
+// grad must be allocated with at least nn's batch size. Returns the summed squared error of the
+// forward passes, so the loss comes for free.
+static float nn_backprop_accumulate(NeuralNetwork nn, NeuralNetwork grad, Matrix ti, Matrix to)
+{
+    assert(ti.rows == to.rows);
+    assert(to.cols == NN_OUTPUT(nn).cols);
+    assert(NN_INPUT(grad).rows >= NN_INPUT(nn).rows);
+
+    size_t num_samples = ti.rows;
+    size_t batch_size = NN_INPUT(nn).rows;
+
+    float loss = 0.0f;
+    NN_TRACE_BEGIN(t0);
+    for (size_t i = 0; i < num_samples; i += batch_size)
+    {
+        size_t rows = nn_min(batch_size, num_samples - i);
+        Matrix x = mat_rows(ti, i, rows);
+        Matrix y = mat_rows(to, i, rows);
+
+        // Forward
+        nn_forward_batch(nn, x);
+
+        Matrix out = mat_rows(NN_OUTPUT(nn), 0, rows);
+        Matrix delta = mat_rows(NN_OUTPUT(grad), 0, rows);
+        for (size_t r = 0; r < rows; r++)
+        {
+            for (size_t j = 0; j < to.cols; j++)
+            {
+                float d = MAT_AT(out, r, j) - MAT_AT(y, r, j);
+                loss += d * d;
+                MAT_AT(delta, r, j) = 2 * d;
+            }
+        }
+        mat_activate_grad(delta, out, nn.act[nn.num_layers - 1]);
+
+        // Backward pass
+        for (size_t l = nn.num_layers; l > 0; l--)
+        {
+            NN_TRACE_BEGIN(t1);
+            Matrix prev = l == 1 ? x : mat_rows(nn.activations[l - 1], 0, rows);
+            delta = mat_rows(grad.activations[l], 0, rows);
+
+            mat_gemm(grad.weights[l - 1], prev, 1, delta, 0, 1);
+            mat_sum_cols(grad.biases[l - 1], delta);
+
+            if (l > 1)
+            {
+                Matrix prev_delta = mat_rows(grad.activations[l - 1], 0, rows);
+                mat_gemm(prev_delta, delta, 0, nn.weights[l - 1], 1, 0);
+                mat_activate_grad(prev_delta, prev, nn.act[l - 2]);
+            }
+            NN_TRACE_END(t1, NN_TRACE_LAYER_BACKWARD, l - 1, 2 * rows * prev.cols * delta.cols * (l > 1 ? 2 : 1),
+                         (2 * prev.rows * prev.cols + 2 * delta.rows * delta.cols + 2 * grad.weights[l - 1].rows * grad.weights[l - 1].cols) * sizeof(float));
+        }
+    }
+    NN_TRACE_END(t0, NN_TRACE_BACKPROP, -1, 0, 0);
+    return loss;
+}
+
+static void nn_grad_normalize(NeuralNetwork grad, size_t num_samples)
+{
+    for (size_t i = 0; i < grad.num_params; i++)
+    {
+        grad.params[i] /= num_samples;
+    }
+}
+
+
+// Sums the gradient of each sample into grad (zeroed first) and averages it. Returns the MSE
+// before the update, as nn_mse would compute it, taken from the same forward passes.
+float nn_backpropagation(NeuralNetwork nn, NeuralNetwork grad, Matrix ti, Matrix to)
+{
+    nn_fill(grad, 0.0f);
+    float loss = nn_backprop_accumulate(nn, grad, ti, to);
+    nn_grad_normalize(grad, ti.rows);
+    return loss / ti.rows;
+}
+
+size_t nn_num_cpus(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 1;
+}
+
+typedef struct
+{
+    NeuralNetwork nn;   // shares the caller's weights, owns its activations
+    NeuralNetwork grad; // partial gradient for this part's rows
+    Matrix ti;
+    Matrix to;
+    float loss;
+} NnBackpropPart;
+
+// Parts past the first own activations and a partial gradient, sized for nn's batch size and
+// reused for every call that passes the job; part 0 works in the caller's nn and grad
+typedef struct
+{
+    NnBackpropPart *parts;
+    size_t num_parts;
+} NnBackpropJob;
+
+// num_parts = 0 means one per pool thread
+static NnBackpropJob nn_backprop_job_alloc(NeuralNetwork nn, size_t num_parts)
+{
+    if (num_parts == 0)
+    {
+        num_parts = nn_pool_size();
+    }
+    size_t batch_size = NN_INPUT(nn).rows;
+    NnBackpropJob job = {.parts = calloc(num_parts, sizeof(NnBackpropPart)), .num_parts = num_parts};
+    assert(job.parts != NULL);
+    for (size_t t = 1; t < num_parts; t++)
+    {
+        job.parts[t].nn.activations = nn_alloc_activations(nn.archi, nn.num_layers, batch_size);
+        job.parts[t].grad = nn_alloc_batch(nn.archi, nn.num_layers, batch_size);
+    }
+    return job;
+}
+
+static void nn_backprop_job_free(NnBackpropJob job)
+{
+    for (size_t t = 1; t < job.num_parts; t++)
+    {
+        nn_free_activations(job.parts[t].nn.activations);
+        nn_free(job.parts[t].grad);
+    }
+    free(job.parts);
+}
+
+static void nn_backprop_part(void *ctx, size_t begin, size_t end)
+{
+    const NnBackpropJob *job = ctx;
+    for (size_t t = begin; t < end; t++)
+    {
+        NnBackpropPart *p = &job->parts[t];
+        nn_fill(p->grad, 0.0f);
+        p->loss = nn_backprop_accumulate(p->nn, p->grad, p->ti, p->to);
+    }
+}
+
+// Folds every part's gradient into part 0's over the parameters [begin, end), in part order
+static void nn_backprop_reduce(void *ctx, size_t begin, size_t end)
+{
+    const NnBackpropJob *job = ctx;
+    NN_TRACE_BEGIN(t0);
+    for (size_t t = 1; t < job->num_parts; t++)
+    {
+        nn_kernels.add(job->parts[0].grad.params + begin, job->parts[t].grad.params + begin, end - begin);
+    }
+    NN_TRACE_END(t0, NN_TRACE_GRAD_REDUCE, -1, (job->num_parts - 1) * (end - begin),
+                 (2 * job->num_parts - 1) * (end - begin) * sizeof(float));
+}
+
+// Zeroes grad and sums the per-sample gradients into it, without averaging, with the rows split
+// over at most job->num_parts parts. Returns the summed squared error.
+static float nn_backprop_accumulate_mt(NeuralNetwork nn, NeuralNetwork grad, Matrix ti, Matrix to, NnBackpropJob *job)
+{
+    assert(ti.rows == to.rows);
+
+    size_t num_samples = ti.rows;
+    size_t num_parts = nn_min(job->num_parts, num_samples);
+    if (num_parts <= 1)
+    {
+        nn_fill(grad, 0.0f);
+        return nn_backprop_accumulate(nn, grad, ti, to);
+    }
+
+    for (size_t t = 0; t < num_parts; t++)
+    {
+        NnBackpropPart *p = &job->parts[t];
+        size_t begin = t * num_samples / num_parts;
+        size_t end = (t + 1) * num_samples / num_parts;
+
+        p->ti = mat_rows(ti, begin, end - begin);
+        p->to = mat_rows(to, begin, end - begin);
+
+        // Part 0 works in nn and grad directly, the others share nn's weights
+        Matrix *activations = p->nn.activations;
+        p->nn = nn;
+        if (t == 0)
+        {
+            p->grad = grad;
+        }
+        else
+        {
+            p->nn.activations = activations;
+        }
+    }
+
+    NnBackpropJob run = {.parts = job->parts, .num_parts = num_parts};
+    nn_parallel_for(0, num_parts, 1, nn_backprop_part, &run);
+    nn_parallel_for(0, grad.num_params, NN_POOL_GRAIN, nn_backprop_reduce, &run);
+
+    float loss = 0.0f;
+    for (size_t t = 0; t < num_parts; t++)
+    {
+        loss += job->parts[t].loss;
+    }
+    return loss;
+}
+
+// Same result as nn_backpropagation, with the rows of ti/to split into num_threads parts (0 = one
+// per pool thread) that run on the thread pool. Every part has its own activations and partial
+// gradient; the partials are summed in part order, split by parameter ranges, before averaging.
+// Only the summation order differs from the serial path, so results agree to float rounding:
+// relative differences stay within 1e-4 per element. Returns the MSE like nn_backpropagation.
+float nn_backpropagation_mt(NeuralNetwork nn, NeuralNetwork grad, Matrix ti, Matrix to, size_t num_threads)
+{
+    NnBackpropJob job = nn_backprop_job_alloc(nn, nn_min(num_threads == 0 ? nn_pool_size() : num_threads, ti.rows));
+    float loss = nn_backprop_accumulate_mt(nn, grad, ti, to, &job);
+    nn_backprop_job_free(job);
+    nn_grad_normalize(grad, ti.rows);
+    return loss / ti.rows;
+}
+
+typedef struct
+{
+    NnStopConfig cfg;
+    NnProgress p;
+    size_t stale; // iterations since the last improvement
+    double start;
+} NnStopState;
+
+static double nn_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static NnStopState nn_stop_begin(NnStopConfig cfg)
+{
+    assert(cfg.min_improvement >= 0.0f && cfg.min_improvement < 1.0f);
+    return (NnStopState){.cfg = cfg, .p = {.best_loss = INFINITY}, .start = nn_seconds()};
+}
+
+// Records one iteration's loss; returns nonzero when training should stop
+static int nn_stop_update(NnStopState *s, float loss)
+{
+    NnProgress *p = &s->p;
+    p->iteration++;
+    p->loss = loss;
+    p->elapsed = nn_seconds() - s->start;
+    if (p->iteration == 1 || loss < p->best_loss * (1.0f - s->cfg.min_improvement))
+    {
+        p->best_loss = loss;
+        s->stale = 0;
+    }
+    else
+    {
+        s->stale++;
+    }
+
+    int stop = (s->cfg.target_loss > 0.0f && loss <= s->cfg.target_loss) ||
+               (s->cfg.patience > 0 && s->stale >= s->cfg.patience) ||
+               (s->cfg.max_seconds > 0.0 && p->elapsed >= s->cfg.max_seconds);
+    if (s->cfg.progress != NULL && s->cfg.progress_every > 0 && (stop || p->iteration % s->cfg.progress_every == 0))
+    {
+        stop |= s->cfg.progress(s->cfg.progress_ctx, p) != 0;
+    }
+    return stop;
+}
+
+// Finite-difference gradient descent for at most max_iterations steps, stopping early on the
+// criteria in stop. Each step's loss is the MSE nn_finite_diff measured before the update, so
+// checking progress costs no extra forward pass. Returns where training stopped.
+NnProgress nn_gradient_descent_until(NeuralNetwork nn, float rate, Matrix train_in, Matrix train_out,
+                                     size_t max_iterations, NnStopConfig stop)
+{
+    NeuralNetwork grad = nn_alloc_batch(nn.archi, nn.num_layers, NN_INPUT(nn).rows);
+    NnStopState s = nn_stop_begin(stop);
+    for (size_t it = 0; it < max_iterations; it++)
+    {
+        float loss = nn_finite_diff(nn, grad, 1e-1, train_in, train_out);
+        //float loss = nn_backpropagation(nn, grad, train_in, train_out);
+
+        nn_kernels.axpy(nn.params, -rate, grad.params, nn.num_params);
+        if (nn_stop_update(&s, loss))
+        {
+            break;
+        }
+    }
+
+    nn_free(grad);
+    return s.p;
+}
+
+// Runs all iterations; returns the MSE before the last step
+float nn_gradient_descent(NeuralNetwork nn, float rate, Matrix train_in, Matrix train_out, size_t iterations)
+{
+    return nn_gradient_descent_until(nn, rate, train_in, train_out, iterations, (NnStopConfig){0}).loss;
+}
+
+// What the training steps work in, allocated once per nn_train or nn_train_stream call for
+// datasets of up to max_samples rows
+typedef struct
+{
+    NeuralNetwork grad;
+    NnBackpropJob job;
+    Matrix batch_in; // gathered batches and the sample order, when cfg.shuffle
+    Matrix batch_out;
+    size_t *perm;
+} NnTrainBuffers;
+
+static NnTrainBuffers nn_train_buffers_alloc(NeuralNetwork nn, TrainConfig cfg, size_t max_samples, size_t out_cols)
+{
+    size_t batch_size = cfg.batch_size == 0 || cfg.batch_size > max_samples ? max_samples : cfg.batch_size;
+    size_t num_parts = nn_min(cfg.num_threads == 0 ? nn_pool_size() : cfg.num_threads, batch_size);
+
+    NnTrainBuffers b = {
+        .grad = nn_alloc_batch(nn.archi, nn.num_layers, NN_INPUT(nn).rows),
+        .job = nn_backprop_job_alloc(nn, num_parts),
+    };
+    if (cfg.shuffle)
+    {
+        b.batch_in = mat_alloc(batch_size, NN_INPUT(nn).cols);
+        b.batch_out = mat_alloc(batch_size, out_cols);
+        b.perm = malloc(max_samples * sizeof(*b.perm));
+        assert(b.perm != NULL);
+    }
+    return b;
+}
+
+static void nn_train_buffers_free(NnTrainBuffers b)
+{
+    if (b.perm != NULL)
+    {
+        mat_free(b.batch_in);
+        mat_free(b.batch_out);
+        free(b.perm);
+    }
+    nn_backprop_job_free(b.job);
+    nn_free(b.grad);
+}
+
+// nn_train with the steps numbered from *step on, which is left at the number after the last one
+static NnProgress nn_train_from(NeuralNetwork nn, Matrix train_in, Matrix train_out, TrainConfig cfg, size_t *step,
+                                NnTrainBuffers *buf)
+{
+    assert(train_in.rows == train_out.rows);
+
+    size_t num_samples = train_in.rows;
+    size_t batch_size = cfg.batch_size == 0 || cfg.batch_size > num_samples ? num_samples : cfg.batch_size;
+    assert(!cfg.shuffle || batch_size <= buf->batch_in.rows);
+
+    Optimizer sgd = {.kind = NN_OPT_SGD, .rate = cfg.rate};
+    Optimizer *opt = cfg.optimizer != NULL ? cfg.optimizer : &sgd;
+
+    NeuralNetwork grad = buf->grad;
+    Matrix batch_in = buf->batch_in;
+    Matrix batch_out = buf->batch_out;
+    size_t *perm = buf->perm;
+    if (cfg.shuffle)
+    {
+        for (size_t i = 0; i < num_samples; i++)
+        {
+            perm[i] = i;
+        }
+    }
+
+    NnStopState stop = nn_stop_begin(cfg.stop);
+    for (size_t epoch = 0; epoch < cfg.epochs; epoch++)
+    {
+        if (cfg.shuffle)
+        {
+            for (size_t i = num_samples - 1; i > 0; i--)
+            {
+                size_t j = (size_t)rand() % (i + 1);
+                size_t tmp = perm[i];
+                perm[i] = perm[j];
+                perm[j] = tmp;
+            }
+        }
+
+        // Sum of the squared errors each step saw before its update
+        float loss = 0.0f;
+        size_t seen = 0;
+        for (size_t begin = 0; begin < num_samples; begin += batch_size, (*step)++)
+        {
+            if (*step < cfg.start_step)
+            {
+                continue;
+            }
+
+            size_t rows = nn_min(batch_size, num_samples - begin);
+            Matrix x, y;
+            if (cfg.shuffle)
+            {
+                NN_TRACE_BEGIN(t0);
+                x = mat_rows(batch_in, 0, rows);
+                y = mat_rows(batch_out, 0, rows);
+                for (size_t r = 0; r < rows; r++)
+                {
+                    mat_cpy(mat_row(x, r), mat_row(train_in, perm[begin + r]));
+                    mat_cpy(mat_row(y, r), mat_row(train_out, perm[begin + r]));
+                }
+                NN_TRACE_END(t0, NN_TRACE_GATHER, -1, 0, 2 * rows * (x.cols + y.cols) * sizeof(float));
+            }
+            else
+            {
+                x = mat_rows(train_in, begin, rows);
+                y = mat_rows(train_out, begin, rows);
+            }
+
+            // Raw gradient sums; the optimizer averages them in the same pass as the update
+            loss += nn_backprop_accumulate_mt(nn, grad, x, y, &buf->job);
+            seen += rows;
+            nn_optimizer_step(opt, nn, grad, 1.0f / rows);
+
+            // A snapshot still being written makes this one a no-op; the next boundary retries
+            if (cfg.checkpoint != NULL && cfg.checkpoint_every > 0 && (*step + 1) % cfg.checkpoint_every == 0)
+            {
+                nn_checkpoint_snapshot(cfg.checkpoint, nn, cfg.optimizer, *step + 1);
+            }
+        }
+
+        // Epochs skipped entirely on resume have no loss to judge
+        if (seen > 0 && nn_stop_update(&stop, loss / seen))
+        {
+            break;
+        }
+    }
+
+    return stop.p;
+}
+
+// Mini-batch gradient descent: every epoch walks the dataset in batches of cfg.batch_size
+// samples and takes one step per batch. Without shuffling a batch is a mat_rows view of
+// the training matrices; with it, rows are gathered through a per-epoch permutation into
+// buffers allocated once up front. The gradient and the activations and partial gradients of the
+// cfg.num_threads backpropagation parts are allocated up front too, so no step allocates.
+// With cfg.checkpoint set, the parameters are snapshotted every cfg.checkpoint_every steps. To
+// resume, load the checkpoint and pass the step it returns as cfg.start_step: the steps before
+// it are skipped, still drawing each epoch's shuffle so that the same seed gives the same order.
+// An epoch's loss is the mean squared error its steps measured before their updates, so it lags
+// the final parameters by up to one epoch but costs no extra forward pass; training ends early
+// when cfg.stop says so. Returns the last epoch's progress.
+NnProgress nn_train(NeuralNetwork nn, Matrix train_in, Matrix train_out, TrainConfig cfg)
+{
+    size_t step = 0;
+    NnTrainBuffers buf = nn_train_buffers_alloc(nn, cfg, train_in.rows, train_out.cols);
+    NnProgress progress = nn_train_from(nn, train_in, train_out, cfg, &step, &buf);
+    nn_train_buffers_free(buf);
+    return progress;
+}
+
+// Optimizer with the usual defaults (momentum 0.9, Adam betas 0.9/0.999, RMSProp decay 0.9)
+// and zeroed state sized for nn
+Optimizer nn_optimizer_alloc(NeuralNetwork nn, OptimizerKind kind, float rate)
+{
+    Optimizer opt = {
+        .kind = kind,
+        .rate = rate,
+        .momentum = 0.9f,
+        .beta1 = 0.9f,
+        .beta2 = kind == NN_OPT_RMSPROP ? 0.9f : 0.999f,
+        .eps = 1e-8f,
+    };
+
+    if (kind == NN_OPT_MOMENTUM || kind == NN_OPT_NESTEROV || kind == NN_OPT_ADAM)
+    {
+        opt.m = nn_alloc(nn.archi, nn.num_layers);
+        nn_fill(opt.m, 0.0f);
+    }
+    if (kind == NN_OPT_RMSPROP || kind == NN_OPT_ADAM)
+    {
+        opt.v = nn_alloc(nn.archi, nn.num_layers);
+        nn_fill(opt.v, 0.0f);
+    }
+
+    return opt;
+}
+
+void nn_optimizer_free(Optimizer opt)
+{
+    if (opt.m.params != NULL)
+    {
+        nn_free(opt.m);
+    }
+    if (opt.v.params != NULL)
+    {
+        nn_free(opt.v);
+    }
+}
+
+typedef struct
+{
+    float *w;
+    const float *g;
+    float *m;
+    float *v;
+    const OptimizerStep *st;
+} NnOptimizeRange;
+
+static void nn_optimize_range(void *ctx, size_t begin, size_t end)
+{
+    const NnOptimizeRange *r = ctx;
+    nn_kernels.optimize(r->w + begin, r->g + begin, r->m != NULL ? r->m + begin : NULL,
+                        r->v != NULL ? r->v + begin : NULL, end - begin, r->st);
+}
+
+// Updates nn from the gradient sums in grad, scaled by scale first (1 / num_samples for raw sums)
+void nn_optimizer_step(Optimizer *opt, NeuralNetwork nn, NeuralNetwork grad, float scale)
+{
+    assert(nn.dtype == NN_DTYPE_F32 && nn.sparse == NULL);
+    opt->step++;
+
+    OptimizerStep st = {
+        .kind = opt->kind,
+        .rate = opt->rate,
+        .scale = scale,
+        .momentum = opt->momentum,
+        .beta1 = opt->beta1,
+        .beta2 = opt->beta2,
+        .eps = opt->eps,
+    };
+    if (opt->kind == NN_OPT_ADAM)
+    {
+        st.rate *= sqrtf(1.0f - powf(opt->beta2, (float)opt->step)) / (1.0f - powf(opt->beta1, (float)opt->step));
+    }
+
+    // One sweep over the whole parameter arena and the matching state arenas
+    NN_TRACE_BEGIN(t0);
+    NnOptimizeRange r = {.w = nn.params, .g = grad.params, .m = opt->m.params, .v = opt->v.params, .st = &st};
+    nn_parallel_for(0, nn.num_params, NN_POOL_GRAIN, nn_optimize_range, &r);
+    // w and g, plus read and write of m (all but SGD) and v (Adam)
+    NN_TRACE_END(t0, NN_TRACE_OPTIMIZER, -1, 2 * nn.num_params,
+                 (3 + 2 * (opt->kind != NN_OPT_SGD) + 2 * (opt->kind == NN_OPT_ADAM)) * nn.num_params * sizeof(float));
+}
+
+// Returns 0 on success, -1 with errno set on failure
+int nn_save(NeuralNetwork nn, const char *path)
+{
+    assert(nn.dtype == NN_DTYPE_F32);
+
+    NnFileHeader header = {
+        .magic = NN_FILE_MAGIC,
+        .version = NN_FILE_VERSION,
+        .num_layers = nn.num_layers,
+        .num_params = nn.num_params,
+        .params_offset = nn_align_up(sizeof(NnFileHeader) + (nn.num_layers + 1) * sizeof(uint64_t) +
+                                     nn.num_layers * sizeof(uint32_t)),
+    };
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+    {
+        return -1;
+    }
+
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (size_t i = 0; ok && i <= nn.num_layers; i++)
+    {
+        uint64_t size = nn.archi[i];
+        ok = fwrite(&size, sizeof(size), 1, f) == 1;
+    }
+    for (size_t i = 0; ok && i < nn.num_layers; i++)
+    {
+        uint32_t act = nn.act[i];
+        ok = fwrite(&act, sizeof(act), 1, f) == 1;
+    }
+    long pad = (long)header.params_offset - ftell(f);
+    for (long i = 0; ok && i < pad; i++)
+    {
+        ok = fputc(0, f) != EOF;
+    }
+    ok = ok && fwrite(nn.params, sizeof(*nn.params), nn.num_params, f) == nn.num_params;
+
+    if (fclose(f) != 0)
+    {
+        ok = 0;
+    }
+
+    return ok ? 0 : -1;
+}
+
+// Checks a model file's header against its size and reads archi and the layer activations
+// into one new array: num_layers + 1 sizes, then num_layers Activation values.
+static int nn_file_parse(const unsigned char *data, size_t size, size_t **archi, NnFileHeader *header)
+{
+    if (size < sizeof(*header))
+    {
+        return -1;
+    }
+    memcpy(header, data, sizeof(*header));
+    // Bound num_layers by the file size first, and the arena by division, so that no field can
+    // wrap the arithmetic
+    if (memcmp(header->magic, NN_FILE_MAGIC, 4) != 0 || header->version < 1 ||
+        header->version > NN_FILE_VERSION || header->num_layers == 0 ||
+        header->num_layers > (size - sizeof(*header)) / (sizeof(uint64_t) + sizeof(uint32_t)) ||
+        header->params_offset % NN_ALIGN != 0 || header->params_offset > size ||
+        header->num_params > (size - header->params_offset) / sizeof(float))
+    {
+        return -1;
+    }
+    size_t act_bytes = header->version >= 2 ? header->num_layers * sizeof(uint32_t) : 0;
+    if (sizeof(*header) + (header->num_layers + 1) * sizeof(uint64_t) + act_bytes > header->params_offset)
+    {
+        return -1;
+    }
+
+    *archi = malloc((header->num_layers + 1) * sizeof(**archi) + header->num_layers * sizeof(Activation));
+    assert(*archi != NULL);
+    const unsigned char *p = data + sizeof(*header);
+    for (size_t i = 0; i <= header->num_layers; i++, p += sizeof(uint64_t))
+    {
+        uint64_t dim;
+        memcpy(&dim, p, sizeof(dim));
+        (*archi)[i] = dim;
+    }
+
+    Activation *act = (Activation *)(*archi + header->num_layers + 1);
+    for (size_t i = 0; i < header->num_layers; i++)
+    {
+        uint32_t code = NN_ACT_SIGMOID;
+        if (act_bytes > 0)
+        {
+            memcpy(&code, p + i * sizeof(code), sizeof(code));
+        }
+        if (code >= NN_ACT_COUNT)
+        {
+            free(*archi);
+            return -1;
+        }
+        act[i] = (Activation)code;
+    }
+
+    // nn_count_params, checked: every dimension nonzero and no product past num_params
+    size_t count = 0;
+    for (size_t i = 1; i <= header->num_layers; i++)
+    {
+        size_t in = (*archi)[i - 1];
+        size_t out = (*archi)[i];
+        if (in == 0 || out == 0 || in >= header->num_params || (header->num_params - count) / out < in + 1)
+        {
+            free(*archi);
+            return -1;
+        }
+        count += out * (in + 1);
+    }
+    if (count != header->num_params)
+    {
+        free(*archi);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *nn_file_map(const char *path, size_t *size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        *size = (size_t)st.st_size;
+        // Private writable mapping: pages stay shared with the page cache until something writes to them
+        data = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    return data == MAP_FAILED ? NULL : data;
+}
+
+// Loads a model saved by nn_save into freshly allocated memory. Returns 0 on success, -1 on a
+// missing or malformed file.
+int nn_load(const char *path, size_t batch_size, NeuralNetwork *nn)
+{
+    NeuralNetwork mapped;
+    if (nn_load_mmap(path, 1, &mapped) != 0)
+    {
+        return -1;
+    }
+
+    *nn = nn_alloc_batch(mapped.archi, mapped.num_layers, batch_size);
+    nn_copy(*nn, mapped);
+    nn_free(mapped);
+
+    return 0;
+}
+
+// Maps the model file and points the weight and bias views straight into the mapping, so loading
+// costs no parsing or copying and processes serving the same file share its pages. The mapping
+// is copy-on-write: training a mapped network never modifies the file. nn_free unmaps it.
+int nn_load_mmap(const char *path, size_t batch_size, NeuralNetwork *nn)
+{
+    size_t size;
+    unsigned char *data = nn_file_map(path, &size);
+    if (data == NULL)
+    {
+        return -1;
+    }
+
+    NnFileHeader header;
+    size_t *archi;
+    if (nn_file_parse(data, size, &archi, &header) != 0)
+    {
+        munmap(data, size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    *nn = nn_alloc_views(archi, header.num_layers, batch_size, (float *)(data + header.params_offset));
+    memcpy(nn->act, archi + header.num_layers + 1, header.num_layers * sizeof(Activation));
+    nn->mapping = data;
+    nn->mapping_size = size;
+    free(archi);
+
+    return 0;
+}
+
+// Reads up to chunk_rows records into c. Returns 0, or an errno value on a read or parse error.
+// A chunk that comes back with 0 rows marks the end of a pass; the file is rewound behind it.
+static int nn_stream_read_chunk(NnStream *s, NnStreamChunk *c)
+{
+    size_t cols = s->in_cols + s->out_cols;
+    c->rows = 0;
+
+    if (s->format == NN_DATA_BINARY)
+    {
+        size_t got = fread(c->data, sizeof(float) * cols, s->chunk_rows, s->file);
+        c->rows = got;
+        if (got < s->chunk_rows)
+        {
+            if (ferror(s->file))
+            {
+                return errno != 0 ? errno : EIO;
+            }
+            // A truncated last record leaves bytes behind that fread did not count
+            long pos = ftell(s->file);
+            if (pos >= 0 && (size_t)pos % (sizeof(float) * cols) != 0)
+            {
+                return EINVAL;
+            }
+        }
+    }
+    else
+    {
+        while (c->rows < s->chunk_rows)
+        {
+            int first = ftell(s->file) == 0;
+            if (getline(&s->line, &s->line_cap, s->file) < 0)
+            {
+                if (ferror(s->file))
+                {
+                    return errno != 0 ? errno : EIO;
+                }
+                break;
+            }
+
+            float *rec = c->data + c->rows * cols;
+            char *p = s->line;
+            size_t n = 0;
+            int header = 0;
+            for (;;)
+            {
+                while (*p == ',' || *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+                {
+                    p++;
+                }
+                if (*p == '\0')
+                {
+                    break;
+                }
+                char *end;
+                float v = strtof(p, &end);
+                if (end == p || n == cols)
+                {
+                    header = first && n == 0 && end == p;
+                    n = SIZE_MAX;
+                    break;
+                }
+                rec[n++] = v;
+                p = end;
+            }
+
+            if (n == 0 || header)
+            {
+                continue; // blank line, or a first line that does not start with a number
+            }
+            if (n != cols)
+            {
+                return EINVAL;
+            }
+            c->rows++;
+        }
+    }
+
+    if (c->rows == 0)
+    {
+        rewind(s->file);
+    }
+
+    return 0;
+}
+
+static void *nn_stream_reader(void *arg)
+{
+    NnStream *s = arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&s->lock);
+        while (s->chunks[s->fill].full && !s->stop)
+        {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        int stop = s->stop;
+        pthread_mutex_unlock(&s->lock);
+        if (stop)
+        {
+            break;
+        }
+
+        // The chunk is empty, so the consumer cannot be reading it: fill it without the lock
+        NnStreamChunk *c = &s->chunks[s->fill];
+        int err = nn_stream_read_chunk(s, c);
+
+        pthread_mutex_lock(&s->lock);
+        c->full = 1;
+        c->error = err;
+        s->fill ^= 1;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        if (err != 0)
+        {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+// Opens path and starts prefetching. Returns NULL with errno set if the file cannot be opened.
+NnStream *nn_stream_open(const char *path, NnDataFormat format, size_t in_cols, size_t out_cols, size_t chunk_rows)
+{
+    assert(in_cols + out_cols > 0);
+    assert(chunk_rows > 0);
+
+    FILE *file = fopen(path, format == NN_DATA_BINARY ? "rb" : "r");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    NnStream *s = calloc(1, sizeof(*s));
+    assert(s != NULL);
+    s->file = file;
+    s->format = format;
+    s->in_cols = in_cols;
+    s->out_cols = out_cols;
+    s->chunk_rows = chunk_rows;
+    for (size_t i = 0; i < 2; i++)
+    {
+        s->chunks[i].data = nn_aligned_alloc(chunk_rows * (in_cols + out_cols) * sizeof(float));
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    pthread_create(&s->thread, NULL, nn_stream_reader, s);
+
+    return s;
+}
+
+// Hands out the next chunk as strided views into its buffer and gives the previous one back
+// to the reader. Returns the number of rows, 0 at the end of a pass over the file (the next
+// call starts the next pass), or -1 with errno set on a read or parse error. The views stay
+// valid until the next call.
+int nn_stream_next(NnStream *s, Matrix *train_in, Matrix *train_out)
+{
+    pthread_mutex_lock(&s->lock);
+    if (s->held && s->chunks[s->take].error == 0)
+    {
+        s->chunks[s->take].full = 0;
+        s->take ^= 1;
+        s->held = 0;
+        pthread_cond_broadcast(&s->cond);
+    }
+    while (!s->chunks[s->take].full)
+    {
+        pthread_cond_wait(&s->cond, &s->lock);
+    }
+    NnStreamChunk *c = &s->chunks[s->take];
+    s->held = 1;
+    pthread_mutex_unlock(&s->lock);
+
+    // A failed chunk is never given back, so every later call fails the same way
+    if (c->error != 0)
+    {
+        errno = c->error;
+        return -1;
+    }
+
+    size_t cols = s->in_cols + s->out_cols;
+    *train_in = (Matrix){.rows = c->rows, .cols = s->in_cols, .stride = cols, .data = c->data};
+    *train_out = (Matrix){.rows = c->rows, .cols = s->out_cols, .stride = cols, .data = c->data + s->in_cols};
+
+    return (int)c->rows;
+}
+
+void nn_stream_close(NnStream *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free(s->chunks[0].data);
+    free(s->chunks[1].data);
+    free(s->line);
+    fclose(s->file);
+    free(s);
+}
+
+// nn_train over a stream: every epoch is one pass over the file, trained chunk by chunk
+// (batches and shuffling stay within a chunk) while the reader fills the other buffer. Steps are
+// counted across chunks, so checkpoints and cfg.start_step work as in nn_train. cfg.stop is not
+// used: a chunk is not an epoch.
+// Returns 0, or -1 with errno set if the stream failed.
+int nn_train_stream(NeuralNetwork nn, NnStream *stream, TrainConfig cfg)
+{
+    TrainConfig chunk_cfg = cfg;
+    chunk_cfg.epochs = 1;
+    chunk_cfg.stop = (NnStopConfig){0};
+
+    // Sized for a full chunk and shared by all of them
+    NnTrainBuffers buf = nn_train_buffers_alloc(nn, chunk_cfg, stream->chunk_rows, stream->out_cols);
+    size_t step = 0;
+    for (size_t epoch = 0; epoch < cfg.epochs; epoch++)
+    {
+        Matrix x, y;
+        int rows;
+        while ((rows = nn_stream_next(stream, &x, &y)) > 0)
+        {
+            nn_train_from(nn, x, y, chunk_cfg, &step, &buf);
+        }
+        if (rows < 0)
+        {
+            nn_train_buffers_free(buf);
+            return -1;
+        }
+    }
+
+    nn_train_buffers_free(buf);
+    return 0;
+}
+
+// Writes train_in and train_out as interleaved records (stride in_cols + out_cols).
+// Returns 0 on success, -1 with errno set on failure.
+int nn_dataset_save(const char *path, Matrix train_in, Matrix train_out)
+{
+    assert(train_in.rows == train_out.rows);
+
+    NnDataHeader header = {
+        .magic = NN_DATA_MAGIC,
+        .version = NN_DATA_VERSION,
+        .rows = train_in.rows,
+        .in_cols = train_in.cols,
+        .out_cols = train_out.cols,
+        .stride = train_in.cols + train_out.cols,
+        .data_offset = nn_align_up(sizeof(NnDataHeader)),
+    };
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+    {
+        return -1;
+    }
+
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (size_t i = sizeof(header); ok && i < header.data_offset; i++)
+    {
+        ok = fputc(0, f) != EOF;
+    }
+    for (size_t i = 0; ok && i < train_in.rows; i++)
+    {
+        ok = fwrite(&MAT_AT(train_in, i, 0), sizeof(float), train_in.cols, f) == train_in.cols &&
+             fwrite(&MAT_AT(train_out, i, 0), sizeof(float), train_out.cols, f) == train_out.cols;
+    }
+
+    if (fclose(f) != 0)
+    {
+        ok = 0;
+    }
+
+    return ok ? 0 : -1;
+}
+
+// Maps a file written by nn_dataset_save and points ds->train_in / train_out into it, so opening
+// costs no parsing and processes training on the same file share its page-cache pages. Like
+// nn_load_mmap the mapping is copy-on-write. Returns 0, or -1 with errno set.
+int nn_dataset_open(const char *path, NnDataset *ds)
+{
+    size_t size;
+    unsigned char *data = nn_file_map(path, &size);
+    if (data == NULL)
+    {
+        return -1;
+    }
+
+    NnDataHeader h;
+    int ok = size >= sizeof(h);
+    if (ok)
+    {
+        memcpy(&h, data, sizeof(h));
+        ok = memcmp(h.magic, NN_DATA_MAGIC, 4) == 0 && h.version == NN_DATA_VERSION &&
+             h.in_cols + h.out_cols > 0 && h.stride >= h.in_cols + h.out_cols &&
+             h.data_offset % NN_ALIGN == 0 && h.data_offset <= size &&
+             (h.rows == 0 || (size - h.data_offset) / sizeof(float) / h.stride >= h.rows);
+    }
+    if (!ok)
+    {
+        munmap(data, size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    float *records = (float *)(data + h.data_offset);
+    ds->train_in = (Matrix){.rows = h.rows, .cols = h.in_cols, .stride = h.stride, .data = records};
+    ds->train_out = (Matrix){.rows = h.rows, .cols = h.out_cols, .stride = h.stride, .data = records + h.in_cols};
+    ds->mapping = data;
+    ds->mapping_size = size;
+
+    return 0;
+}
+
+void nn_dataset_close(NnDataset ds)
+{
+    munmap(ds.mapping, ds.mapping_size);
+}
+
+static int nn_write_all(int fd, const void *buf, size_t n)
+{
+    const char *p = buf;
+    while (n > 0)
+    {
+        ssize_t put = write(fd, p, n);
+        if (put < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (put <= 0)
+        {
+            return -1;
+        }
+        p += put;
+        n -= (size_t)put;
+    }
+    return 0;
 }
 
-void nn_backpropagation(NeuralNetwork nn, NeuralNetwork grad, Matrix ti, Matrix to)
+// Parameters plus the optimizer states flagged in states
+static size_t nn_checkpoint_floats(uint32_t states, size_t num_params)
 {
-    nn_fill(grad, 0.0f);
-    size_t num_samples = ti.rows;
+    return (1 + !!(states & NN_CKPT_M) + !!(states & NN_CKPT_V)) * num_params;
+}
+
+// Writes the pending snapshot to path.tmp, fsyncs it, renames it over path and fsyncs the
+// directory. Returns 0 or an errno value.
+static int nn_checkpoint_write(NnCheckpointer *ck)
+{
+    size_t head = sizeof(ck->header) + (ck->header.num_layers + 1) * sizeof(uint64_t);
+    char zeros[NN_ALIGN] = {0};
+    size_t floats = nn_checkpoint_floats(ck->header.states, ck->header.num_params);
 
-    for (size_t i = 0; i < num_samples; i++)
+    int fd = open(ck->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ok = fd >= 0;
+    ok = ok && nn_write_all(fd, &ck->header, sizeof(ck->header)) == 0;
+    ok = ok && nn_write_all(fd, ck->archi, (ck->header.num_layers + 1) * sizeof(uint64_t)) == 0;
+    ok = ok && nn_write_all(fd, zeros, ck->header.data_offset - head) == 0;
+    ok = ok && nn_write_all(fd, ck->snapshot, floats * sizeof(float)) == 0;
+    ok = ok && fsync(fd) == 0;
+    int err = ok ? 0 : errno;
+    if (fd >= 0 && close(fd) != 0 && err == 0)
     {
-        // Forward
-        mat_cpy(NN_INPUT(nn), mat_row(ti, i));
-        nn_forward(nn);
-        
-        for (size_t j = 0; j < grad.num_layers; j++)
+        err = errno;
+    }
+    if (err == 0 && rename(ck->tmp_path, ck->path) != 0)
+    {
+        err = errno;
+    }
+    if (err != 0)
+    {
+        return err;
+    }
+
+    // The rename itself is only durable once the directory is on disk
+    const char *slash = strrchr(ck->path, '/');
+    char *dir = slash == NULL ? strdup(".") : strndup(ck->path, slash == ck->path ? 1 : (size_t)(slash - ck->path));
+    assert(dir != NULL);
+    int dfd = open(dir, O_RDONLY);
+    free(dir);
+    if (dfd >= 0)
+    {
+        fsync(dfd);
+        close(dfd);
+    }
+    return 0;
+}
+
+static void *nn_checkpoint_writer(void *arg)
+{
+    NnCheckpointer *ck = arg;
+
+    pthread_mutex_lock(&ck->lock);
+    for (;;)
+    {
+        while (!ck->pending && !ck->stop)
         {
-            mat_fill(grad.activations[j], 0.0f);
+            pthread_cond_wait(&ck->cond, &ck->lock);
         }
-        
-        for (size_t j = 0; j < to.cols; j++)
+        if (!ck->pending)
         {
-            MAT_AT(NN_OUTPUT(grad), 0, j) = 2 * (MAT_AT(NN_OUTPUT(nn), 0, j) - MAT_AT(to, i, j)) *
-                                             MAT_AT(NN_OUTPUT(nn), 0, j) * (1 - MAT_AT(NN_OUTPUT(nn), 0, j));
+            break;
         }
 
-        // Backward pass
-        for (size_t l = nn.num_layers; l > 0; l--)
+        // The snapshot is not touched while pending is set, so it is written without the lock
+        pthread_mutex_unlock(&ck->lock);
+        int err = nn_checkpoint_write(ck);
+        pthread_mutex_lock(&ck->lock);
+
+        if (err != 0)
         {
-            for (size_t j = 0; j < nn.activations[l].cols; j++)
-            {
-                float dC_dA = MAT_AT(grad.activations[l], 0, j);
-                MAT_AT(grad.biases[l-1], 0, j) += dC_dA;
+            ck->error = err;
+        }
+        else
+        {
+            ck->written = ck->header.step;
+        }
+        ck->pending = 0;
+        pthread_cond_broadcast(&ck->cond);
+    }
+    pthread_mutex_unlock(&ck->lock);
+
+    return NULL;
+}
+
+// Checkpoints of nn, plus opt's state when opt is not NULL, written to path by a background
+// thread. Returns NULL with errno set if the thread cannot be started.
+NnCheckpointer *nn_checkpoint_open(const char *path, NeuralNetwork nn, const Optimizer *opt)
+{
+    assert(nn.dtype == NN_DTYPE_F32);
+
+    uint32_t states = 0;
+    if (opt != NULL)
+    {
+        states = (opt->m.params != NULL ? NN_CKPT_M : 0) | (opt->v.params != NULL ? NN_CKPT_V : 0);
+    }
+    size_t floats = nn_checkpoint_floats(states, nn.num_params);
+
+    NnCheckpointer *ck = calloc(1, sizeof(*ck));
+    assert(ck != NULL);
+    ck->header = (NnCheckpointHeader){
+        .magic = NN_CKPT_MAGIC,
+        .version = NN_CKPT_VERSION,
+        .num_layers = nn.num_layers,
+        .num_params = nn.num_params,
+        .states = states,
+        .data_offset = nn_align_up(sizeof(NnCheckpointHeader) + (nn.num_layers + 1) * sizeof(uint64_t)),
+    };
+    ck->path = malloc(2 * strlen(path) + sizeof(".tmp") + 1);
+    ck->archi = malloc((nn.num_layers + 1) * sizeof(uint64_t));
+    ck->snapshot = nn_aligned_alloc(floats * sizeof(float));
+    assert(ck->path != NULL && ck->archi != NULL);
+    strcpy(ck->path, path);
+    ck->tmp_path = ck->path + strlen(path) + 1;
+    sprintf(ck->tmp_path, "%s.tmp", path);
+    for (size_t i = 0; i <= nn.num_layers; i++)
+    {
+        ck->archi[i] = nn.archi[i];
+    }
+
+    pthread_mutex_init(&ck->lock, NULL);
+    pthread_cond_init(&ck->cond, NULL);
+    int err = pthread_create(&ck->thread, NULL, nn_checkpoint_writer, ck);
+    if (err != 0)
+    {
+        pthread_cond_destroy(&ck->cond);
+        pthread_mutex_destroy(&ck->lock);
+        free(ck->snapshot);
+        free(ck->archi);
+        free(ck->path);
+        free(ck);
+        errno = err;
+        return NULL;
+    }
+
+    return ck;
+}
+
+// Copies the parameters (and optimizer state) into the snapshot buffer and hands it to the
+// writer; step is the number of training steps taken so far. The copy is the only work done on
+// the calling thread. Returns 0, or -1 with errno EBUSY, without copying anything, while the
+// previous snapshot is still being written.
+int nn_checkpoint_snapshot(NnCheckpointer *ck, NeuralNetwork nn, const Optimizer *opt, size_t step)
+{
+    assert(nn.num_params == ck->header.num_params);
+    assert(ck->header.states == 0 || opt != NULL);
+
+    pthread_mutex_lock(&ck->lock);
+    int busy = ck->pending;
+    pthread_mutex_unlock(&ck->lock);
+    if (busy)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    NN_TRACE_BEGIN(t0);
+    size_t n = nn.num_params;
+    float *dst = ck->snapshot;
+    memcpy(dst, nn.params, n * sizeof(float));
+    if (ck->header.states & NN_CKPT_M)
+    {
+        dst += n;
+        memcpy(dst, opt->m.params, n * sizeof(float));
+    }
+    if (ck->header.states & NN_CKPT_V)
+    {
+        dst += n;
+        memcpy(dst, opt->v.params, n * sizeof(float));
+    }
+    NN_TRACE_END(t0, NN_TRACE_CHECKPOINT, -1, 0, 2 * (dst + n - ck->snapshot) * sizeof(float));
+
+    pthread_mutex_lock(&ck->lock);
+    ck->header.step = step;
+    ck->header.opt_kind = opt != NULL ? opt->kind : NN_OPT_SGD;
+    ck->header.opt_step = opt != NULL ? opt->step : 0;
+    ck->pending = 1;
+    pthread_cond_broadcast(&ck->cond);
+    pthread_mutex_unlock(&ck->lock);
+
+    return 0;
+}
+
+// Blocks until the snapshot being written, if any, is on disk. Returns 0, or -1 with errno set
+// if a write failed since the last call.
+int nn_checkpoint_wait(NnCheckpointer *ck)
+{
+    pthread_mutex_lock(&ck->lock);
+    while (ck->pending)
+    {
+        pthread_cond_wait(&ck->cond, &ck->lock);
+    }
+    int err = ck->error;
+    ck->error = 0;
+    pthread_mutex_unlock(&ck->lock);
+
+    if (err != 0)
+    {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// Finishes the pending write and stops the writer. Returns what nn_checkpoint_wait returns.
+int nn_checkpoint_close(NnCheckpointer *ck)
+{
+    int result = nn_checkpoint_wait(ck);
+    int err = errno;
+
+    pthread_mutex_lock(&ck->lock);
+    ck->stop = 1;
+    pthread_cond_broadcast(&ck->cond);
+    pthread_mutex_unlock(&ck->lock);
+    pthread_join(ck->thread, NULL);
+
+    pthread_cond_destroy(&ck->cond);
+    pthread_mutex_destroy(&ck->lock);
+    free(ck->snapshot);
+    free(ck->archi);
+    free(ck->path);
+    free(ck);
+
+    errno = err;
+    return result;
+}
+
+// Resumes from a checkpoint: restores nn's parameters and, when opt is not NULL, its state and
+// step count, and stores the number of training steps taken in *step (pass it to
+// TrainConfig.start_step). nn must have the checkpoint's architecture and opt the same kind.
+// Returns 0, or -1 with errno set: EINVAL for a malformed or mismatching file.
+int nn_checkpoint_load(const char *path, NeuralNetwork nn, Optimizer *opt, size_t *step)
+{
+    assert(nn.dtype == NN_DTYPE_F32 && nn.sparse == NULL);
+
+    size_t size;
+    unsigned char *data = nn_file_map(path, &size);
+    if (data == NULL)
+    {
+        return -1;
+    }
+
+    NnCheckpointHeader header;
+    int ok = size >= sizeof(header);
+    if (ok)
+    {
+        memcpy(&header, data, sizeof(header));
+        size_t floats = nn_checkpoint_floats(header.states, nn.num_params);
+        ok = memcmp(header.magic, NN_CKPT_MAGIC, 4) == 0 && header.version == NN_CKPT_VERSION &&
+             header.num_layers == nn.num_layers && header.num_params == nn.num_params &&
+             header.data_offset % NN_ALIGN == 0 &&
+             sizeof(header) + (header.num_layers + 1) * sizeof(uint64_t) <= header.data_offset &&
+             header.data_offset + floats * sizeof(float) <= size;
+    }
+    for (size_t i = 0; ok && i <= nn.num_layers; i++)
+    {
+        uint64_t dim;
+        memcpy(&dim, data + sizeof(header) + i * sizeof(dim), sizeof(dim));
+        ok = dim == nn.archi[i];
+    }
+    if (ok && opt != NULL)
+    {
+        uint32_t states = (opt->m.params != NULL ? NN_CKPT_M : 0) | (opt->v.params != NULL ? NN_CKPT_V : 0);
+        ok = header.opt_kind == (uint32_t)opt->kind && header.states == states;
+    }
+    if (!ok)
+    {
+        munmap(data, size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t n = nn.num_params;
+    const float *src = (const float *)(data + header.data_offset);
+    memcpy(nn.params, src, n * sizeof(float));
+    if (opt != NULL)
+    {
+        if (header.states & NN_CKPT_M)
+        {
+            src += n;
+            memcpy(opt->m.params, src, n * sizeof(float));
+        }
+        if (header.states & NN_CKPT_V)
+        {
+            src += n;
+            memcpy(opt->v.params, src, n * sizeof(float));
+        }
+        opt->step = header.opt_step;
+    }
+    *step = header.step;
+
+    munmap(data, size);
+    return 0;
+}
+
+// Builds an int8 copy of nn for inference. calib (rows of typical inputs) is run through the
+// float network once to find each layer's input range; the copy has nn's batch size.
+NnQuantNetwork nn_quantize(NeuralNetwork nn, Matrix calib, NnQuantGranularity gran)
+{
+    assert(nn.dtype == NN_DTYPE_F32);
+    assert(calib.cols == NN_INPUT(nn).cols);
+    assert(calib.rows > 0);
 
-                for (size_t k = 0; k < nn.activations[l - 1].cols; k++)
+    size_t L = nn.num_layers;
+    size_t batch_size = NN_INPUT(nn).rows;
+    NnQuantNetwork q;
+    q.num_layers = L;
+    q.layers = malloc(L * sizeof(NnQuantLayer) + (L + 1) * sizeof(size_t) + L * sizeof(Activation));
+    assert(q.layers != NULL);
+    q.archi = (size_t *)(q.layers + L);
+    memcpy(q.archi, nn.archi, (L + 1) * sizeof(size_t));
+    q.act = (Activation *)(q.archi + L + 1);
+    memcpy(q.act, nn.act, L * sizeof(Activation));
+    q.activations = nn_alloc_activations(q.archi, L, batch_size);
+
+    // Input range of every layer, widened to take in 0 so the zero point is representable
+    float *lo = calloc(2 * L, sizeof(float));
+    assert(lo != NULL);
+    float *hi = lo + L;
+    for (size_t r = 0; r < calib.rows; r += batch_size)
+    {
+        Matrix in = mat_rows(calib, r, nn_min(batch_size, calib.rows - r));
+        nn_forward_batch(nn, in);
+        for (size_t l = 0; l < L; l++)
+        {
+            Matrix x = l == 0 ? in : mat_rows(nn.activations[l], 0, in.rows);
+            for (size_t i = 0; i < x.rows; i++)
+            {
+                for (size_t j = 0; j < x.cols; j++)
                 {
-                    MAT_AT(grad.weights[l - 1], k, j) += dC_dA * MAT_AT(nn.activations[l - 1], 0, k);
-                    MAT_AT(grad.activations[l - 1], 0, k) += dC_dA * MAT_AT(nn.weights[l - 1], k, j) *
-                                                            MAT_AT(nn.activations[l - 1], 0, k) * (1 - MAT_AT(nn.activations[l - 1], 0, k));
+                    float v = MAT_AT(x, i, j);
+                    lo[l] = v < lo[l] ? v : lo[l];
+                    hi[l] = v > hi[l] ? v : hi[l];
                 }
             }
         }
     }
 
-    for (size_t i = 0; i < grad.num_layers; i++)
+    size_t max_k = 0;
+    size_t max_n = 0;
+    for (size_t l = 0; l < L; l++)
     {
-        for (size_t j = 0; j < grad.weights[i].rows; j++)
+        Matrix w = nn.weights[l];
+        NnQuantLayer *ql = &q.layers[l];
+        ql->in = w.rows;
+        ql->out = w.cols;
+        ql->k4 = (w.rows + 3) / 4;
+        ql->n_pad = (w.cols + NN_QGEMM_NR - 1) / NN_QGEMM_NR * NN_QGEMM_NR;
+        max_k = ql->k4 > max_k ? ql->k4 : max_k;
+        max_n = ql->n_pad > max_n ? ql->n_pad : max_n;
+
+        ql->in_scale = hi[l] > lo[l] ? (hi[l] - lo[l]) / 127.0f : 1.0f;
+        ql->in_zero = (int32_t)lrintf(-lo[l] / ql->in_scale);
+
+        ql->w = nn_aligned_alloc(ql->k4 * ql->n_pad * 4);
+        memset(ql->w, 0, ql->k4 * ql->n_pad * 4);
+        ql->mul = calloc(2 * ql->n_pad, sizeof(float));
+        assert(ql->mul != NULL);
+        ql->add = ql->mul + ql->n_pad;
+
+        float layer_max = 0.0f;
+        for (size_t i = 0; i < w.rows; i++)
         {
-            for (size_t k = 0; k < grad.weights[i].cols; k++)
+            for (size_t j = 0; j < w.cols; j++)
             {
-                MAT_AT(grad.weights[i], j, k) /= num_samples;
+                layer_max = fmaxf(layer_max, fabsf(MAT_AT(w, i, j)));
             }
         }
-        for (size_t j = 0; j < grad.biases[i].rows; j++)
+        for (size_t j = 0; j < w.cols; j++)
         {
-            for (size_t k = 0; k < grad.biases[i].cols; k++)
+            float max = layer_max;
+            if (gran == NN_QUANT_PER_CHANNEL)
+            {
+                max = 0.0f;
+                for (size_t i = 0; i < w.rows; i++)
+                {
+                    max = fmaxf(max, fabsf(MAT_AT(w, i, j)));
+                }
+            }
+            float w_scale = max > 0.0f ? max / 127.0f : 1.0f;
+
+            int32_t sum = 0;
+            for (size_t i = 0; i < w.rows; i++)
             {
-                MAT_AT(grad.biases[i], j, k) /= num_samples;
+                int8_t v = (int8_t)lrintf(MAT_AT(w, i, j) / w_scale);
+                ql->w[((i / 4) * ql->n_pad + j) * 4 + i % 4] = v;
+                sum += v;
             }
+            ql->mul[j] = ql->in_scale * w_scale;
+            ql->add[j] = MAT_AT(nn.biases[l], 0, j) - (float)ql->in_zero * (float)sum * ql->mul[j];
         }
     }
+    free(lo);
+
+    q.qin = nn_aligned_alloc(batch_size * 4 * max_k);
+    q.acc = nn_aligned_alloc(batch_size * max_n * sizeof(int32_t));
+
+    return q;
 }
 
+void nn_quant_free(NnQuantNetwork q)
+{
+    for (size_t l = 0; l < q.num_layers; l++)
+    {
+        free(q.layers[l].w);
+        free(q.layers[l].mul);
+    }
+    free(q.qin);
+    free(q.acc);
+    nn_free_activations(q.activations);
+    free(q.layers);
+}
 
-void nn_gradient_descent(NeuralNetwork nn, float rate, Matrix train_in, Matrix train_out, size_t iterations)
+// Runs the in.rows samples of in (at most the batch size) through the int8 network; the outputs
+// land in the first in.rows rows of NN_OUTPUT(q), in float.
+void nn_quant_forward_batch(NnQuantNetwork q, Matrix in)
 {
-    NeuralNetwork grad = nn_alloc(nn.archi, nn.num_layers);
-    for (size_t it = 0; it < iterations; it++)
+    assert(in.cols == NN_INPUT(q).cols);
+    assert(in.rows <= NN_INPUT(q).rows);
+
+    Matrix x = in;
+    for (size_t l = 0; l < q.num_layers; l++)
     {
-        nn_finite_diff(nn, grad, 1e-1, train_in, train_out);
-        //nn_backpropagation(nn, grad, train_in, train_out);
+        NN_TRACE_BEGIN(t0);
+        const NnQuantLayer *ql = &q.layers[l];
+        size_t lda = 4 * ql->k4;
+        float inv = 1.0f / ql->in_scale;
+        for (size_t i = 0; i < x.rows; i++)
+        {
+            uint8_t *qi = q.qin + i * lda;
+            for (size_t p = 0; p < x.cols; p++)
+            {
+                long v = lrintf(MAT_AT(x, i, p) * inv) + ql->in_zero;
+                qi[p] = (uint8_t)(v < 0 ? 0 : v > 127 ? 127 : v);
+            }
+            memset(qi + x.cols, 0, lda - x.cols);
+        }
+
+        nn_kernels.qgemm(x.rows, ql->n_pad, ql->k4, q.qin, ql->w, q.acc);
 
-        for (size_t i = 0; i < nn.num_layers; i++)
+        Matrix y = mat_rows(q.activations[l + 1], 0, in.rows);
+        for (size_t i = 0; i < y.rows; i++)
         {
-            for (size_t j = 0; j < nn.weights[i].rows; j++)
+            const int32_t *acc = q.acc + i * ql->n_pad;
+            float *yi = &MAT_AT(y, i, 0);
+            for (size_t j = 0; j < y.cols; j++)
             {
-                for (size_t k = 0; k < nn.weights[i].cols; k++)
-                {
-                    MAT_AT(nn.weights[i], j, k) -= rate * MAT_AT(grad.weights[i], j, k);
-                }
+                yi[j] = (float)acc[j] * ql->mul[j] + ql->add[j];
             }
-            for (size_t j = 0; j < nn.biases[i].rows; j++)
+            nn_activate(q.act[l], yi, y.cols);
+        }
+        NN_TRACE_END(t0, NN_TRACE_LAYER_FORWARD, l, 2 * y.rows * x.cols * y.cols,
+                     (x.rows * x.cols + y.rows * y.cols) * sizeof(float) + ql->k4 * ql->n_pad * 4);
+        x = y;
+    }
+}
+
+// Compares the int8 network's outputs on in against the float network it was made from
+NnQuantError nn_quant_error(NeuralNetwork nn, NnQuantNetwork q, Matrix in)
+{
+    assert(in.cols == NN_INPUT(nn).cols);
+    assert(NN_OUTPUT(nn).cols == NN_OUTPUT(q).cols);
+
+    NnQuantError e = {0};
+    size_t agree = 0;
+    double sum = 0.0;
+    size_t batch_size = nn_min(NN_INPUT(nn).rows, NN_INPUT(q).rows);
+    for (size_t r = 0; r < in.rows; r += batch_size)
+    {
+        Matrix batch = mat_rows(in, r, nn_min(batch_size, in.rows - r));
+        nn_forward_batch(nn, batch);
+        nn_quant_forward_batch(q, batch);
+        for (size_t i = 0; i < batch.rows; i++)
+        {
+            size_t best_f = 0;
+            size_t best_q = 0;
+            for (size_t j = 0; j < NN_OUTPUT(q).cols; j++)
             {
-                for (size_t k = 0; k < nn.biases[i].cols; k++)
-                {
-                    MAT_AT(nn.biases[i], j, k) -= rate * MAT_AT(grad.biases[i], j, k);
-                }
+                float f = MAT_AT(NN_OUTPUT(nn), i, j);
+                float v = MAT_AT(NN_OUTPUT(q), i, j);
+                float err = fabsf(f - v);
+                e.max_abs_error = err > e.max_abs_error ? err : e.max_abs_error;
+                sum += err;
+                best_f = f > MAT_AT(NN_OUTPUT(nn), i, best_f) ? j : best_f;
+                best_q = v > MAT_AT(NN_OUTPUT(q), i, best_q) ? j : best_q;
+            }
+            agree += best_f == best_q;
+        }
+    }
+    if (in.rows > 0)
+    {
+        e.mean_abs_error = (float)(sum / (double)(in.rows * NN_OUTPUT(q).cols));
+        e.argmax_agreement = (float)agree / (float)in.rows;
+    }
+
+    return e;
+}
+
+static const char *const nn_trace_names[NN_TRACE_KIND_COUNT] = {
+    [NN_TRACE_GEMM] = "gemm",
+    [NN_TRACE_ACTIVATION] = "activation",
+    [NN_TRACE_ACTIVATION_GRAD] = "activation_grad",
+    [NN_TRACE_COPY] = "copy",
+    [NN_TRACE_ADD] = "add",
+    [NN_TRACE_LAYER_FORWARD] = "layer_forward",
+    [NN_TRACE_LAYER_BACKWARD] = "layer_backward",
+    [NN_TRACE_BACKPROP] = "backprop",
+    [NN_TRACE_GRAD_REDUCE] = "grad_reduce",
+    [NN_TRACE_OPTIMIZER] = "optimizer",
+    [NN_TRACE_FINITE_DIFF] = "finite_diff",
+    [NN_TRACE_GATHER] = "gather",
+    [NN_TRACE_CHECKPOINT] = "checkpoint",
+};
+
+const char *nn_trace_name(NnTraceKind kind)
+{
+    assert(kind < NN_TRACE_KIND_COUNT);
+
+    return nn_trace_names[kind];
+}
+
+#ifdef NN_TRACE
+
+// One buffer per thread, only ever written by its owner. Buffers sit on a lock-free list that is
+// only pushed to; a thread that exits gives its buffer back (in_use = 0) for the next new thread
+// to claim, so short-lived workers do not grow the list. Stats and events are read without
+// stopping the writers, so call the readers while no kernels are running.
+typedef struct NnTraceThread
+{
+    struct NnTraceThread *next;
+    atomic_int in_use;
+    uint32_t tid;
+    atomic_uint_fast64_t head; // events ever written; the latest is ring[(head - 1) % NN_TRACE_RING]
+    NnTraceStats stats[NN_TRACE_KIND_COUNT][NN_TRACE_MAX_LAYERS + 1]; // [kind][0] is "no layer"
+    NnTraceEvent ring[NN_TRACE_RING];
+} NnTraceThread;
+
+static _Atomic(NnTraceThread *) nn_trace_threads;
+static atomic_uint nn_trace_next_tid;
+static _Thread_local NnTraceThread *nn_trace_self;
+static pthread_key_t nn_trace_key;
+static pthread_once_t nn_trace_key_once = PTHREAD_ONCE_INIT;
+
+static void nn_trace_release(void *arg)
+{
+    NnTraceThread *t = arg;
+    atomic_store_explicit(&t->in_use, 0, memory_order_release);
+}
+
+static void nn_trace_key_init(void)
+{
+    pthread_key_create(&nn_trace_key, nn_trace_release);
+}
+
+static NnTraceThread *nn_trace_register(void)
+{
+    pthread_once(&nn_trace_key_once, nn_trace_key_init);
+
+    NnTraceThread *t = atomic_load_explicit(&nn_trace_threads, memory_order_acquire);
+    for (; t != NULL; t = t->next)
+    {
+        if (atomic_exchange_explicit(&t->in_use, 1, memory_order_acquire) == 0)
+        {
+            break;
+        }
+    }
+    if (t == NULL)
+    {
+        t = calloc(1, sizeof(*t));
+        assert(t != NULL);
+        atomic_store_explicit(&t->in_use, 1, memory_order_relaxed);
+        t->next = atomic_load_explicit(&nn_trace_threads, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&nn_trace_threads, &t->next, t,
+                                                      memory_order_release, memory_order_relaxed))
+        {
+        }
+    }
+
+    t->tid = atomic_fetch_add_explicit(&nn_trace_next_tid, 1, memory_order_relaxed) + 1;
+    pthread_setspecific(nn_trace_key, t);
+    nn_trace_self = t;
+
+    return t;
+}
+
+uint64_t nn_trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void nn_trace_record(NnTraceKind kind, int layer, uint64_t start_ns, uint64_t flops, uint64_t bytes)
+{
+    uint64_t end_ns = nn_trace_now();
+    NnTraceThread *t = nn_trace_self != NULL ? nn_trace_self : nn_trace_register();
+
+    size_t slot = layer < 0 ? 0 : (size_t)layer < NN_TRACE_MAX_LAYERS ? (size_t)layer + 1 : NN_TRACE_MAX_LAYERS;
+    NnTraceStats *s = &t->stats[kind][slot];
+    s->calls++;
+    s->ns += end_ns - start_ns;
+    s->flops += flops;
+    s->bytes += bytes;
+
+    uint64_t head = atomic_load_explicit(&t->head, memory_order_relaxed);
+    t->ring[head % NN_TRACE_RING] = (NnTraceEvent){
+        .start_ns = start_ns,
+        .dur_ns = end_ns - start_ns,
+        .flops = flops,
+        .bytes = bytes,
+        .tid = t->tid,
+        .kind = (uint16_t)kind,
+        .layer = (int16_t)(layer < 0 ? -1 : layer),
+    };
+    atomic_store_explicit(&t->head, head + 1, memory_order_release);
+}
+
+void nn_trace_reset(void)
+{
+    for (NnTraceThread *t = atomic_load(&nn_trace_threads); t != NULL; t = t->next)
+    {
+        memset(t->stats, 0, sizeof(t->stats));
+        atomic_store(&t->head, 0);
+    }
+}
+
+// Sums over every thread; layer -1 adds up all layers and the events without one
+NnTraceStats nn_trace_stats(NnTraceKind kind, int layer)
+{
+    assert(kind < NN_TRACE_KIND_COUNT);
+
+    NnTraceStats sum = {0};
+    size_t first = layer < 0 ? 0 : (size_t)layer < NN_TRACE_MAX_LAYERS ? (size_t)layer + 1 : NN_TRACE_MAX_LAYERS;
+    size_t last = layer < 0 ? NN_TRACE_MAX_LAYERS : first;
+    for (NnTraceThread *t = atomic_load(&nn_trace_threads); t != NULL; t = t->next)
+    {
+        for (size_t i = first; i <= last; i++)
+        {
+            sum.calls += t->stats[kind][i].calls;
+            sum.ns += t->stats[kind][i].ns;
+            sum.flops += t->stats[kind][i].flops;
+            sum.bytes += t->stats[kind][i].bytes;
+        }
+    }
+
+    return sum;
+}
+
+static void nn_trace_report_line(FILE *f, const char *name, int layer, NnTraceStats s)
+{
+    double secs = s.ns * 1e-9;
+    fprintf(f, "%-16s", name);
+    if (layer >= 0)
+    {
+        fprintf(f, " %5d", layer);
+    }
+    else
+    {
+        fprintf(f, " %5s", "-");
+    }
+    fprintf(f, " %10llu %12.3f %10.3f %10.2f %10.2f\n", (unsigned long long)s.calls, secs * 1e3,
+            secs * 1e6 / s.calls, secs > 0 ? s.flops / secs * 1e-9 : 0.0, secs > 0 ? s.bytes / secs * 1e-9 : 0.0);
+}
+
+// One line per kind, then one per layer for the kinds that are tied to layers
+void nn_trace_report(FILE *f)
+{
+    fprintf(f, "%-16s %5s %10s %12s %10s %10s %10s\n", "kind", "layer", "calls", "total ms", "avg us", "GFLOP/s", "GB/s");
+    for (size_t k = 0; k < NN_TRACE_KIND_COUNT; k++)
+    {
+        NnTraceStats s = nn_trace_stats(k, -1);
+        if (s.calls == 0)
+        {
+            continue;
+        }
+        nn_trace_report_line(f, nn_trace_names[k], -1, s);
+
+        for (int l = 0; l < NN_TRACE_MAX_LAYERS; l++)
+        {
+            NnTraceStats ls = nn_trace_stats(k, l);
+            if (ls.calls > 0 && ls.calls < s.calls)
+            {
+                nn_trace_report_line(f, "", l, ls);
             }
         }
     }
 }
 
+// Writes the buffered events of every thread as Chrome trace-event JSON ("X" complete events,
+// microsecond timestamps). Returns 0, or -1 with errno set when the file cannot be written.
+int nn_trace_export_chrome(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+    {
+        return -1;
+    }
+
+    fprintf(f, "{\"traceEvents\": [");
+    const char *sep = "\n";
+    long pid = (long)getpid();
+    for (NnTraceThread *t = atomic_load(&nn_trace_threads); t != NULL; t = t->next)
+    {
+        uint64_t head = atomic_load_explicit(&t->head, memory_order_acquire);
+        uint64_t begin = head > NN_TRACE_RING ? head - NN_TRACE_RING : 0;
+        for (uint64_t i = begin; i < head; i++)
+        {
+            const NnTraceEvent *e = &t->ring[i % NN_TRACE_RING];
+            fprintf(f, "%s{\"name\": \"%s\", \"cat\": \"nn\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                       "\"pid\": %ld, \"tid\": %u, \"args\": {\"layer\": %d, \"flops\": %llu, \"bytes\": %llu}}",
+                    sep, nn_trace_names[e->kind], e->start_ns * 1e-3, e->dur_ns * 1e-3, pid, e->tid, e->layer,
+                    (unsigned long long)e->flops, (unsigned long long)e->bytes);
+            sep = ",\n";
+        }
+    }
+    fprintf(f, "\n]}\n");
+
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+#else
+
+void nn_trace_reset(void)
+{
+}
+
+NnTraceStats nn_trace_stats(NnTraceKind kind, int layer)
+{
+    (void)kind;
+    (void)layer;
+    return (NnTraceStats){0};
+}
+
+void nn_trace_report(FILE *f)
+{
+    fprintf(f, "nn: built without NN_TRACE, nothing recorded\n");
+}
+
+int nn_trace_export_chrome(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+    {
+        return -1;
+    }
+    fprintf(f, "{\"traceEvents\": []}\n");
+
+    return fclose(f) == 0 ? 0 : -1;
+}
+#endif // NN_TRACE
+
 #endif // NN_IMPLEMENTATION
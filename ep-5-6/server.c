@@ -0,0 +1,559 @@
+#define NN_IMPLEMENTATION
+#include "nn.h"
+#include <time.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Micro-batching inference server. Requests from every client go into one queue; a single batcher
+// thread takes up to max_batch of them at a time, waiting at most max_wait_us after the oldest one
+// arrived, and answers them all with one nn_infer call. Every connection has its own writer thread
+// sending the answers, so a client that reads slowly only holds up itself.
+//   server (-m model.bin | -a 784,128,10) [-s socket | -] [-b max_batch] [-w max_wait_us] [-i report_secs]
+// -a serves a randomly initialised network of that shape, for benchmarking. With -s the server
+// listens on a Unix stream socket; with - it reads requests from stdin and answers on stdout.
+//
+// Protocol, host byte order: on a socket the server first sends two uint32, in_cols and out_cols
+// (the pipe has no greeting). Each request is then in_cols float32, answered with out_cols float32;
+// a client may pipeline any number of requests and gets the answers back in order.
+// Latency (enqueue to answer written), throughput and batch sizes go to stderr every report_secs
+// and at exit.
+
+#define QUEUE_CAP 4096
+#define CONN_CAP 256 // requests a connection may have outstanding before its reader stops taking more
+
+typedef struct
+{
+    int in_fd;
+    int out_fd;
+    pthread_cond_t changed; // answers arrived or were written, or the reader finished
+    size_t pending;         // requests queued, being answered or waiting to be written
+    float *answers;         // ring of CONN_CAP answers, out_cols floats each
+    double *enqueued;       // arrival time of each answer's request
+    size_t first;           // oldest unwritten answer
+    size_t ready;           // unwritten answers
+    int closed;             // the reader is done; the writer frees the connection once pending is 0
+} Conn;
+
+typedef struct
+{
+    Conn *conn;
+    double enqueued;
+} Request;
+
+static NeuralNetwork model;
+static size_t in_cols;
+static size_t out_cols;
+static size_t max_batch = 32;
+static double max_wait = 200e-6;
+static double report_every = 10.0;
+
+// Ring of requests; inputs[i] holds the in_cols floats of requests[i]
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t not_empty;
+static pthread_cond_t not_full = PTHREAD_COND_INITIALIZER;
+static Request requests[QUEUE_CAP];
+static float *inputs;
+static size_t head;
+static size_t count;
+static int draining; // no more requests are coming (stdin EOF or shutdown): answer what is queued and exit
+
+static volatile sig_atomic_t stop;
+
+// Latencies since the last report, under lock
+static double *lat;
+static size_t lat_count;
+static size_t lat_cap;
+static size_t batches;
+static double window; // start of the current report
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, size_t n, double q)
+{
+    size_t i = (size_t)(q * (n - 1) + 0.5);
+    return sorted[i < n ? i : n - 1];
+}
+
+static int read_all(int fd, void *buf, size_t n)
+{
+    char *p = buf;
+    while (n > 0)
+    {
+        ssize_t got = read(fd, p, n);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            return -1;
+        }
+        p += got;
+        n -= (size_t)got;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t n)
+{
+    const char *p = buf;
+    while (n > 0)
+    {
+        ssize_t put = write(fd, p, n);
+        if (put < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (put <= 0)
+        {
+            return -1;
+        }
+        p += put;
+        n -= (size_t)put;
+    }
+    return 0;
+}
+
+static Conn *conn_new(int in_fd, int out_fd)
+{
+    Conn *c = calloc(1, sizeof(*c));
+    assert(c != NULL);
+    c->in_fd = in_fd;
+    c->out_fd = out_fd;
+    pthread_cond_init(&c->changed, NULL);
+    c->answers = malloc(CONN_CAP * out_cols * sizeof(float));
+    c->enqueued = malloc(CONN_CAP * sizeof(double));
+    assert(c->answers != NULL && c->enqueued != NULL);
+    return c;
+}
+
+static void conn_free(Conn *c)
+{
+    close(c->in_fd);
+    if (c->out_fd != c->in_fd)
+    {
+        close(c->out_fd);
+    }
+    pthread_cond_destroy(&c->changed);
+    free(c->answers);
+    free(c->enqueued);
+    free(c);
+}
+
+static void record_latency(double l)
+{
+    if (lat_count == lat_cap)
+    {
+        lat_cap = lat_cap ? 2 * lat_cap : 4096;
+        lat = realloc(lat, lat_cap * sizeof(*lat));
+        assert(lat != NULL);
+    }
+    lat[lat_count++] = l;
+}
+
+static void *reader(void *arg)
+{
+    Conn *c = arg;
+    float *buf = malloc(in_cols * sizeof(float));
+    assert(buf != NULL);
+
+    while (read_all(c->in_fd, buf, in_cols * sizeof(float)) == 0)
+    {
+        pthread_mutex_lock(&lock);
+        // Answers nobody reads stop this connection here rather than filling the shared queue
+        while (c->pending == CONN_CAP)
+        {
+            pthread_cond_wait(&c->changed, &lock);
+        }
+        while (count == QUEUE_CAP)
+        {
+            pthread_cond_wait(&not_full, &lock);
+        }
+        size_t slot = (head + count) % QUEUE_CAP;
+        requests[slot] = (Request){.conn = c, .enqueued = now()};
+        memcpy(inputs + slot * in_cols, buf, in_cols * sizeof(float));
+        count++;
+        c->pending++;
+        pthread_cond_signal(&not_empty);
+        pthread_mutex_unlock(&lock);
+    }
+
+    free(buf);
+    pthread_mutex_lock(&lock);
+    c->closed = 1;
+    if (c->out_fd == STDOUT_FILENO)
+    {
+        draining = 1;
+        pthread_cond_signal(&not_empty);
+    }
+    pthread_cond_broadcast(&c->changed);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+// Sends the greeting, then c's answers in order as the batcher hands them over, and frees the
+// connection once the reader is done and every answer is out.
+static void *writer(void *arg)
+{
+    Conn *c = arg;
+    uint32_t hello[2] = {(uint32_t)in_cols, (uint32_t)out_cols};
+    int ok = c->out_fd == STDOUT_FILENO || write_all(c->out_fd, hello, sizeof(hello)) == 0;
+
+    pthread_mutex_lock(&lock);
+    for (;;)
+    {
+        while (c->ready == 0 && !(c->closed && c->pending == 0))
+        {
+            pthread_cond_wait(&c->changed, &lock);
+        }
+        if (c->ready == 0)
+        {
+            break;
+        }
+
+        // The batcher only appends after first + ready, so this run can be written unlocked
+        size_t first = c->first;
+        size_t n = c->ready < CONN_CAP - first ? c->ready : CONN_CAP - first;
+        pthread_mutex_unlock(&lock);
+        // A client that went away just loses its answers
+        ok = ok && write_all(c->out_fd, c->answers + first * out_cols, n * out_cols * sizeof(float)) == 0;
+        double t = now();
+
+        pthread_mutex_lock(&lock);
+        for (size_t i = 0; i < n; i++)
+        {
+            record_latency(t - c->enqueued[first + i]);
+        }
+        c->first = (first + n) % CONN_CAP;
+        c->ready -= n;
+        c->pending -= n;
+        pthread_cond_broadcast(&c->changed);
+    }
+    pthread_mutex_unlock(&lock);
+
+    conn_free(c);
+    return NULL;
+}
+
+// Prints and clears the latencies gathered since the last report. They are sorted outside the
+// lock so writers are not held up.
+static void report(double t)
+{
+    pthread_mutex_lock(&lock);
+    double *sorted = lat;
+    size_t n = lat_count;
+    size_t num_batches = batches;
+    double elapsed = t - window;
+    lat = NULL;
+    lat_count = 0;
+    lat_cap = 0;
+    batches = 0;
+    window = t;
+    pthread_mutex_unlock(&lock);
+
+    if (n > 0)
+    {
+        qsort(sorted, n, sizeof(*sorted), cmp_double);
+        fprintf(stderr, "%zu requests in %.1fs: %.0f req/s, mean batch %.1f, latency p50 %.0fus p99 %.0fus max %.0fus\n",
+                n, elapsed, n / elapsed, num_batches > 0 ? (double)n / num_batches : 0.0,
+                percentile(sorted, n, 0.50) * 1e6, percentile(sorted, n, 0.99) * 1e6, sorted[n - 1] * 1e6);
+    }
+    free(sorted);
+}
+
+// Takes the oldest requests once there are max_batch of them or the oldest has waited max_wait,
+// runs them as one batch and hands every answer to its connection's writer.
+static void *batcher(void *arg)
+{
+    (void)arg;
+    NnWorkspace ws = nn_workspace_alloc(model, max_batch);
+    Matrix in = mat_alloc(max_batch, in_cols);
+    Matrix out = mat_alloc(max_batch, out_cols);
+    Request *batch = malloc(max_batch * sizeof(*batch));
+    assert(batch != NULL);
+
+    for (;;)
+    {
+        pthread_mutex_lock(&lock);
+        while (count == 0 && !draining)
+        {
+            pthread_cond_wait(&not_empty, &lock);
+        }
+        if (count == 0)
+        {
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+        double deadline = requests[head].enqueued + max_wait;
+        while (count < max_batch && !draining)
+        {
+            double left = deadline - now();
+            if (left <= 0.0)
+            {
+                break;
+            }
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_nsec += (long)(left * 1e9);
+            ts.tv_sec += ts.tv_nsec / 1000000000L;
+            ts.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&not_empty, &lock, &ts);
+        }
+
+        size_t n = count < max_batch ? count : max_batch;
+        for (size_t i = 0; i < n; i++)
+        {
+            size_t slot = (head + i) % QUEUE_CAP;
+            batch[i] = requests[slot];
+            memcpy(&MAT_AT(in, i, 0), inputs + slot * in_cols, in_cols * sizeof(float));
+        }
+        head = (head + n) % QUEUE_CAP;
+        count -= n;
+        pthread_cond_broadcast(&not_full);
+        pthread_mutex_unlock(&lock);
+
+        nn_infer(model, ws, mat_rows(in, 0, n), mat_rows(out, 0, n));
+
+        // pending never exceeds CONN_CAP, so there is always a free slot
+        pthread_mutex_lock(&lock);
+        for (size_t i = 0; i < n; i++)
+        {
+            Conn *c = batch[i].conn;
+            size_t slot = (c->first + c->ready) % CONN_CAP;
+            memcpy(c->answers + slot * out_cols, &MAT_AT(out, i, 0), out_cols * sizeof(float));
+            c->enqueued[slot] = batch[i].enqueued;
+            c->ready++;
+            pthread_cond_broadcast(&c->changed);
+        }
+        batches++;
+        int due = report_every > 0.0 && now() - window >= report_every;
+        pthread_mutex_unlock(&lock);
+
+        if (due)
+        {
+            report(now());
+        }
+    }
+
+    free(batch);
+    mat_free(in);
+    mat_free(out);
+    nn_workspace_free(ws);
+    return NULL;
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+// Worker threads start with SIGINT / SIGTERM blocked so that in socket mode the signal lands on
+// the main thread and interrupts its accept
+static void spawn(void *(*fn)(void *), void *arg, pthread_t *thread)
+{
+    sigset_t block;
+    sigset_t old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+
+    pthread_t t;
+    pthread_create(&t, NULL, fn, arg);
+    if (thread != NULL)
+    {
+        *thread = t;
+    }
+    else
+    {
+        pthread_detach(t);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static int parse_archi(const char *s, size_t *archi, size_t cap)
+{
+    size_t n = 0;
+    while (*s != '\0' && n < cap)
+    {
+        char *end;
+        unsigned long v = strtoul(s, &end, 10);
+        if (end == s || v == 0)
+        {
+            return 0;
+        }
+        archi[n++] = v;
+        s = *end == ',' ? end + 1 : end;
+    }
+    return *s == '\0' ? (int)n : 0;
+}
+
+static int usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s (-m model.bin | -a 784,128,10) [-s socket | -] [-b max_batch] [-w max_wait_us] [-i report_secs]\n",
+            prog);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *model_path = NULL;
+    const char *archi_arg = NULL;
+    const char *socket_path = "-";
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-") == 0)
+        {
+            socket_path = "-";
+        }
+        else if (i + 1 >= argc)
+        {
+            return usage(argv[0]);
+        }
+        else if (strcmp(argv[i], "-m") == 0)
+        {
+            model_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-a") == 0)
+        {
+            archi_arg = argv[++i];
+        }
+        else if (strcmp(argv[i], "-s") == 0)
+        {
+            socket_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-b") == 0)
+        {
+            max_batch = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-w") == 0)
+        {
+            max_wait = strtod(argv[++i], NULL) * 1e-6;
+        }
+        else if (strcmp(argv[i], "-i") == 0)
+        {
+            report_every = strtod(argv[++i], NULL);
+        }
+        else
+        {
+            return usage(argv[0]);
+        }
+    }
+    if ((model_path == NULL) == (archi_arg == NULL) || max_batch == 0)
+    {
+        return usage(argv[0]);
+    }
+
+    if (model_path != NULL)
+    {
+        if (nn_load_mmap(model_path, 1, &model) != 0)
+        {
+            perror(model_path);
+            return 1;
+        }
+    }
+    else
+    {
+        size_t archi[64];
+        int n = parse_archi(archi_arg, archi, ARRAY_LEN(archi));
+        if (n < 2)
+        {
+            return usage(argv[0]);
+        }
+        srand(0);
+        model = nn_alloc(archi, (size_t)n - 1);
+        nn_rand(model, -1.0f, 1.0f);
+    }
+    in_cols = model.archi[0];
+    out_cols = model.archi[model.num_layers];
+    inputs = malloc(QUEUE_CAP * in_cols * sizeof(float));
+    assert(inputs != NULL);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&not_empty, &attr);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    window = now();
+    pthread_t batch_thread;
+    spawn(batcher, NULL, &batch_thread);
+
+    int listener = -1;
+    pthread_t pipe_writer;
+    int piped = strcmp(socket_path, "-") == 0;
+    if (piped)
+    {
+        // Only stdin EOF ends a pipe, so SIGINT / SIGTERM keep their default and kill the process
+        Conn *c = conn_new(STDIN_FILENO, STDOUT_FILENO);
+        spawn(writer, c, &pipe_writer);
+        spawn(reader, c, NULL);
+    }
+    else
+    {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        if (strlen(socket_path) >= sizeof(addr.sun_path))
+        {
+            fprintf(stderr, "%s: socket path too long\n", socket_path);
+            return 1;
+        }
+        strcpy(addr.sun_path, socket_path);
+        unlink(socket_path);
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 64) != 0)
+        {
+            perror(socket_path);
+            return 1;
+        }
+        fprintf(stderr, "serving %zu -> %zu on %s, max batch %zu, max wait %.0fus\n",
+                in_cols, out_cols, socket_path, max_batch, max_wait * 1e6);
+
+        struct sigaction sa = {.sa_handler = on_signal};
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+
+        // accept fails with EINTR once a signal sets stop
+        while (!stop)
+        {
+            int fd = accept(listener, NULL, NULL);
+            if (fd < 0)
+            {
+                continue;
+            }
+            Conn *c = conn_new(fd, fd);
+            spawn(writer, c, NULL);
+            spawn(reader, c, NULL);
+        }
+        close(listener);
+        unlink(socket_path);
+
+        pthread_mutex_lock(&lock);
+        draining = 1;
+        pthread_cond_signal(&not_empty);
+        pthread_mutex_unlock(&lock);
+    }
+
+    pthread_join(batch_thread, NULL);
+    if (piped)
+    {
+        pthread_join(pipe_writer, NULL);
+    }
+    report(now());
+    return 0;
+}